@@ -0,0 +1,868 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+// Microbenchmarks for the MidiSink hot paths; run "MidiBench <name> [capture.midisink...] [file.mid...] [dir...]"
+// or "MidiBench" for all.
+
+#include "MidiCodec.h"
+#include "MidiWriter.h"
+#include "MidiClock.h"
+#include "MidiStream.h"
+#include "MidiOutput.h"
+#include "MidiReader.h"
+#include "MidiSmf.h"
+#include "MidiStore.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QByteArray>
+#include <QVector>
+#include <QFileInfo>
+#include <QDir>
+#include <QThread>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
+#ifdef __GLIBC__
+// count every heap allocation of the process, including the ones of QByteArray
+// which go directly to malloc
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+static volatile quint64 s_allocs = 0;
+extern "C" void* malloc(size_t size)
+{
+    s_allocs++;
+    return __libc_malloc(size);
+}
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    s_allocs++;
+    return __libc_realloc(ptr, size);
+}
+extern "C" void* calloc(size_t n, size_t size)
+{
+    s_allocs++;
+    return __libc_calloc(n, size);
+}
+#define HAVE_ALLOC_COUNT
+#else
+static volatile quint64 s_allocs = 0;
+#endif
+
+static void report(const char* name, quint64 events, qint64 nsecs, quint64 allocs)
+{
+    printf("%-28s %10llu events %8.1f ns/event", name, events, double(nsecs) / events);
+#ifdef HAVE_ALLOC_COUNT
+    printf(" %6.2f allocs/event", double(allocs) / events);
+#endif
+    printf("\n");
+    fflush(stdout);
+}
+
+// the cell encoding as it was done in MidiEngine::Imp::callback before MidiCodec
+static QByteArray legacyToVarLen(quint32 value)
+{
+    quint32 buffer = value & 0x7f;
+    while ((value >>= 7) > 0)
+    {
+        buffer <<= 8;
+        buffer |= 0x80;
+        buffer += (value & 0x7f);
+    }
+    QByteArray res;
+    while (true)
+    {
+        res += char(buffer & 0xff);
+        if (buffer & 0x80)
+            buffer >>= 8;
+        else
+            break;
+    }
+    return res;
+}
+
+static void benchEncode()
+{
+    const quint32 count = 2000000;
+    std::vector<unsigned char> message(3);
+    MidiSlot slot;
+    quint64 sum = 0;
+
+    QElapsedTimer t;
+    quint64 allocs = s_allocs;
+    t.start();
+    for( quint32 i = 0; i < count; i++ )
+    {
+        message[0] = 0x90 | ( i & 0xf );
+        message[1] = i & 0x7f;
+        message[2] = ( i >> 7 ) & 0x7f;
+        QByteArray msg = legacyToVarLen(i & 0x3fff);
+        msg += char(i & 0xff);
+        const QByteArray data = QByteArray::fromRawData((const char*)message.data(), message.size());
+        msg += data;
+        slot.len = msg.size();
+        ::memcpy(slot.data, msg.constData(), msg.size());
+        sum += slot.len;
+    }
+    report("encode QByteArray (legacy)", count, t.nsecsElapsed(), s_allocs - allocs);
+
+    allocs = s_allocs;
+    t.start();
+    for( quint32 i = 0; i < count; i++ )
+    {
+        message[0] = 0x90 | ( i & 0xf );
+        message[1] = i & 0x7f;
+        message[2] = ( i >> 7 ) & 0x7f;
+        slot.len = MidiCodec::encodeCell((quint8*)slot.data, i & 0x3fff, i & 0xff, message.data(), message.size());
+        sum += slot.len;
+    }
+    report("encode MidiCodec", count, t.nsecsElapsed(), s_allocs - allocs);
+
+    // round trip check of the varlen codec over the full 32 bit range
+    quint8 buf[MidiCodec::MaxVarLen];
+    for( quint64 v = 0; v <= 0xffffffffULL; v = v * 3 + 1 )
+    {
+        const quint8* p = buf;
+        const quint8* end = MidiCodec::toVarLen(buf, v);
+        if( MidiCodec::fromVarLen(p, end) != v || p != end || end - buf != MidiCodec::varLenSize(v) )
+            printf("varlen round trip failed for %llu\n", v);
+    }
+    if( sum == 0 )
+        printf("\n"); // keep the loops
+}
+
+static int messageLen(quint8 status)
+{
+    switch( status >> 4 )
+    {
+    case 0xc:
+    case 0xd:
+        return 2;
+    default:
+        return 3;
+    }
+}
+
+// converts a plain cell stream to the compact encoding
+static QByteArray compactStream(const QByteArray& plain, const QVector<int>& cells)
+{
+    QByteArray res;
+    res.reserve(plain.size());
+    QVector<MidiCompactState> states(256);
+    const quint8* p = (const quint8*)plain.constData();
+    quint8 header[MidiCodec::MaxCompactHeader];
+    for( int i = 0; i < cells.size(); i++ )
+    {
+        int consumed = 0;
+        const int n = MidiCodec::compactCell(header, p, cells[i], states.data(), consumed);
+        res.append((const char*)header, n);
+        res.append((const char*)p + consumed, cells[i] - consumed);
+        p += cells[i];
+    }
+    return res;
+}
+
+static void compareEncodings(const char* name, const QByteArray& plain, const QVector<int>& cells)
+{
+    QElapsedTimer t;
+    t.start();
+    const QByteArray compact = compactStream(plain, cells);
+    const qint64 nsecs = t.nsecsElapsed();
+    printf("%-28s %10d cells %10d bytes plain %10d bytes compact (%.1f%% smaller)\n", name,
+           cells.size(), plain.size(), compact.size(), 100.0 - 100.0 * compact.size() / plain.size());
+    report("    compact encode", cells.size(), nsecs, 0);
+}
+
+// synthetic capture dominated by aftertouch and controller streams as sent by
+// keyboards over USB, i.e. on a 1 ms grid with some jitter
+static void syntheticCapture(QByteArray& plain, QVector<int>& cells, int count)
+{
+    quint32 seed = 1;
+    quint8 buf[MidiCodec::MaxVarLen + 1 + 3];
+    for( int i = 0; i < count; i++ )
+    {
+        seed = seed * 1103515245 + 12345;
+        const int track = ( seed >> 16 ) % 3;
+        const quint32 jitter = ( seed >> 8 ) % 40;
+        quint8 msg[3];
+        quint64 delta;
+        switch( track )
+        {
+        case 0: // channel pressure every 5 ms
+            msg[0] = 0xd0;
+            msg[1] = ( i >> 2 ) & 0x7f;
+            delta = 5000 + jitter;
+            break;
+        case 1: // modulation wheel every 3 ms
+            msg[0] = 0xb0;
+            msg[1] = 0x01;
+            msg[2] = ( i >> 3 ) & 0x7f;
+            delta = 3000 + jitter;
+            break;
+        default: // poly pressure and now and then a note
+            msg[0] = ( i % 50 ) == 0 ? 0x91 : 0xa1;
+            msg[1] = 60 + ( i % 12 );
+            msg[2] = ( i >> 1 ) & 0x7f;
+            delta = ( i % 50 ) == 0 ? ( seed >> 4 ) % 200000 : 2000 + jitter;
+            break;
+        }
+        const int len = MidiCodec::encodeCell(buf, delta, track, msg, messageLen(msg[0]));
+        plain.append((const char*)buf, len);
+        cells.append(len);
+    }
+}
+
+// re-encodes a recorded .midisink stream as plain cells
+static bool readCapture(const QString& path, QByteArray& plain, QVector<int>& cells)
+{
+    MidiSegmentDevice in(path);
+    MidiStream::Header h;
+    if( !MidiStream::checkHeader(in, &h) )
+        return false;
+    QVector<MidiCompactState> states(256);
+    MidiStream::Cell cell;
+    while( !MidiStream::atEnd(in, h) )
+    {
+        if( !MidiStream::readCell(&in, cell, h.compact() ? states.data() : 0) )
+            return false;
+        const int start = plain.size();
+        plain += MidiStream::toVarLen(cell.time);
+        plain += char(cell.track);
+        if( cell.meta )
+        {
+            plain += char(0xff);
+            plain += char(cell.type);
+            plain += MidiStream::toVarLen(cell.data.size());
+        }
+        plain += cell.data;
+        cells.append(plain.size() - start);
+    }
+    return true;
+}
+
+static void benchCompact(const QStringList& files)
+{
+    QByteArray plain;
+    QVector<int> cells;
+    syntheticCapture(plain, cells, 1000000);
+    compareEncodings("synthetic aftertouch", plain, cells);
+
+    // round trip check of the synthetic stream
+    const QByteArray compact = compactStream(plain, cells);
+    QVector<MidiCompactState> states(256);
+    const quint8* p = (const quint8*)compact.constData();
+    const quint8* end = p + compact.size();
+    const quint8* q = (const quint8*)plain.constData();
+    QElapsedTimer t;
+    t.start();
+    for( int i = 0; i < cells.size(); i++ )
+    {
+        quint32 delta;
+        quint8 track, status;
+        if( !MidiCodec::expandHeader(p, end, states.data(), delta, track, status) )
+        {
+            printf("invalid compact header at cell %d\n", i);
+            break;
+        }
+        quint8 buf[MidiCodec::MaxVarLen + 1 + 3];
+        if( status == 0 )
+            status = *p++;
+        const int len = messageLen(status);
+        quint8 msg[3] = { status, 0, 0 };
+        for( int j = 1; j < len; j++ )
+            msg[j] = *p++;
+        const int n = MidiCodec::encodeCell(buf, delta, track, msg, len);
+        if( n != cells[i] || ::memcmp(buf, q, n) != 0 )
+        {
+            printf("compact round trip failed at cell %d\n", i);
+            break;
+        }
+        q += n;
+    }
+    report("    compact decode", cells.size(), t.nsecsElapsed(), 0);
+
+    for( int i = 0; i < files.size(); i++ )
+    {
+        plain.clear();
+        cells.clear();
+        if( !readCapture(files[i], plain, cells) )
+            printf("cannot read %s\n", files[i].toUtf8().constData());
+        else
+            compareEncodings(QFileInfo(files[i]).fileName().toUtf8().constData(), plain, cells);
+    }
+}
+
+static QByteArray captureHeader(bool compact)
+{
+    QByteArray header("MidiSink");
+    header += char(0);
+    header += char(compact ? MidiStream::CompactVersion : MidiStream::PlainVersion);
+    header += "20240101-000000";
+    header += char(0);
+    header += MidiStream::toVarLen(1); // microseconds
+    if( compact )
+    {
+        header += char(MidiStream::Encoding);
+        header += MidiStream::toVarLen(1);
+        header += char(MidiStream::CompactCells);
+    }
+    header += char(0);
+    return header;
+}
+
+// writes a .midisink stream of the given cells for the readers
+static bool writeCapture(const QString& path, const QByteArray& cells, bool compact)
+{
+    QFile out(path);
+    if( !out.open(QIODevice::WriteOnly) )
+        return false;
+    const QByteArray header = captureHeader(compact);
+    return out.write(header) == header.size() && out.write(cells) == cells.size();
+}
+
+static void compareReaders(const char* name, const QString& path)
+{
+    quint64 sum = 0;
+    quint64 count = 0;
+    QElapsedTimer t;
+    {
+        // the loop of MidiStream::readStream before MidiReader
+        quint64 allocs = s_allocs;
+        t.start();
+        MidiSegmentDevice in(path);
+        MidiStream::Header h;
+        if( !MidiStream::checkHeader(in, &h) )
+        {
+            printf("cannot read %s\n", path.toUtf8().constData());
+            return;
+        }
+        QVector<MidiCompactState> states(256);
+        MidiStream::Cell cell;
+        while( !MidiStream::atEnd(in, h) && MidiStream::readCell(&in, cell, h.compact() ? states.data() : 0) )
+        {
+            sum += cell.time + cell.data.size();
+            count++;
+        }
+        printf("%s\n", name);
+        report("    readCell (legacy)", count, t.nsecsElapsed(), s_allocs - allocs);
+    }
+    const quint64 legacy = sum;
+    sum = count = 0;
+    quint64 allocs = s_allocs;
+    t.start();
+    MidiReader in;
+    if( !in.open(path) )
+        return;
+    MidiReader::Event e;
+    while( in.next(e) )
+    {
+        sum += e.delta + ( e.kind == MidiReader::Message ? e.len : e.size + ( e.kind == MidiReader::Sysex ? 1 + MidiCodec::varLenSize(e.size) : 0 ) );
+        count++;
+    }
+    report("    MidiReader", count, t.nsecsElapsed(), s_allocs - allocs);
+    if( sum != legacy || in.failed() )
+        printf("    MidiReader doesn't read the same\n");
+}
+
+// decoding speed of the .midisink readers, which limits the conversion of long recordings
+static void benchRead(const QStringList& files)
+{
+    QByteArray plain;
+    QVector<int> cells;
+    syntheticCapture(plain, cells, 4000000);
+    const QString path = QDir(QDir::tempPath()).absoluteFilePath("MidiBench.midisink");
+    if( writeCapture(path, plain, false) )
+        compareReaders("synthetic plain", path);
+    if( writeCapture(path, compactStream(plain, cells), true) )
+        compareReaders("synthetic compact", path);
+    QFile::remove(path);
+    for( int i = 0; i < files.size(); i++ )
+        compareReaders(QFileInfo(files[i]).fileName().toUtf8().constData(), files[i]);
+
+    QElapsedTimer t;
+    for( int i = 0; i < files.size(); i++ )
+    {
+        MidiStream::Tracks tracks;
+        t.start();
+        if( MidiStream::readStream(files[i], tracks) )
+            printf("    readStream %.1f ms\n", t.nsecsElapsed() / 1e6);
+    }
+}
+
+// a note cell as MidiEngine::Imp::callback pushes it, with the delta since the last cell of the port
+static void pushNote(MidiSlotRing& ring, quint8 track, quint64 time, quint64& last, QVector<quint64>& sent)
+{
+    MidiSlot* slot = ring.reserve();
+    if( slot == 0 )
+        return;
+    const quint8 msg[3] = { 0x90, quint8(60 + sent.size() % 12), 0x40 };
+    slot->time = time;
+    slot->more = 0;
+    slot->len = MidiCodec::encodeCell((quint8*)slot->data, time - last, track, msg, 3);
+    ring.commit();
+    last = time;
+    sent.append(time);
+}
+
+// unplugs a port while recording and gives its track to a new port, then checks that the
+// reader puts each note of the track at the time it was captured, see MidiWriter::retire
+static void checkReplug()
+{
+    const QString path = QDir(QDir::tempPath()).absoluteFilePath("MidiBench.midisink");
+    MidiFileOutput out(path);
+    const QByteArray header = captureHeader(false);
+    if( !out.open() || out.write(header.constData(), header.size()) != header.size() )
+    {
+        printf("cannot write %s\n", path.toUtf8().constData());
+        return;
+    }
+    MidiClock clock;
+    MidiSlotRing first, other, second;
+    QVector<quint64> sent[2];
+    quint64 last[3] = { 0, 0, 0 };
+    MidiWriter* writer = new MidiWriter(&out, &clock);
+    writer->setSyncInterval(1024);
+    writer->addSource(&first, 0, "first");
+    writer->addSource(&other, 1, "other");
+    writer->start();
+    for( int i = 0; i < 200; i++ )
+    {
+        pushNote(first, 0, clock.elapsed(), last[0], sent[0]);
+        pushNote(other, 1, clock.elapsed(), last[1], sent[1]);
+        QThread::usleep(100);
+    }
+    QAtomicInt done(0);
+    writer->removeSource(0, &done);
+    while( !done.loadAcquire() )
+        QThread::msleep(1);
+    writer->addSource(&second, 0, "second");
+    for( int i = 0; i < 200; i++ )
+    {
+        pushNote(second, 0, clock.elapsed(), last[2], sent[0]);
+        pushNote(other, 1, clock.elapsed(), last[1], sent[1]);
+        QThread::usleep(100);
+    }
+    delete writer; // writes what is left in the rings
+    out.close();
+
+    bool ok = false;
+    {
+        MidiReader in;
+        if( in.open(path) )
+        {
+            MidiReader::Clock times(in.header().timeBase);
+            MidiReader::Event e;
+            int pos[2] = { 0, 0 };
+            ok = true;
+            while( ok && in.next(e) )
+            {
+                quint64 time;
+                if( !times.advance(e, time) )
+                    ok = false;
+                else if( e.kind == MidiReader::Message )
+                    ok = e.track < 2 && pos[e.track] < sent[e.track].size() &&
+                            time * in.header().unit == sent[e.track][pos[e.track]++];
+            }
+            ok = ok && !in.failed() && pos[0] == sent[0].size() && pos[1] == sent[1].size();
+        }
+    }
+    printf("%-28s %s\n", "replug round trip", ok ? "ok" : "failed");
+    out.remove();
+}
+
+static void appendBE(QByteArray& out, quint32 value, int n)
+{
+    for( int i = n - 1; i >= 0; i-- )
+        out += char(( value >> ( i * 8 ) ) & 0xff);
+}
+
+static void appendDelta(QByteArray& out, quint32 delta)
+{
+    quint8 buf[MidiCodec::MaxVarLen];
+    out.append((const char*)buf, MidiCodec::toVarLen(buf, delta) - buf);
+}
+
+// a format 1 file with a tempo track and instrument tracks of mostly notes in running status,
+// some controllers, which interrupt the running status, and SysEx
+static bool writeSmf(const QString& path, int trackCount, int events)
+{
+    QFile out(path);
+    if( !out.open(QIODevice::WriteOnly) )
+        return false;
+    QByteArray head("MThd");
+    appendBE(head, 6, 4);
+    appendBE(head, 1, 2);
+    appendBE(head, trackCount + 1, 2);
+    appendBE(head, 480, 2);
+    out.write(head);
+    for( int t = 0; t <= trackCount; t++ )
+    {
+        QByteArray data;
+        const QByteArray name = t == 0 ? QByteArray("Tempo") : "Instrument " + QByteArray::number(t);
+        appendDelta(data, 0);
+        data += "\xff\x03";
+        appendDelta(data, name.size());
+        data += name;
+        const quint8 chan = ( t - 1 ) & 0xf;
+        quint8 running = 0;
+        for( int i = 0; t == 0 && i < events / 100; i++ )
+        {
+            appendDelta(data, 1920);
+            data += "\xff\x51\x03";
+            appendBE(data, i % 2 ? 428571 : 500000, 3);
+        }
+        for( int i = 0; t != 0 && i < events; i++ )
+        {
+            appendDelta(data, i % 2 ? 60 : ( i * 7 ) % 50);
+            if( i % 10000 == 0 )
+            {
+                data += char(0xf0);
+                appendDelta(data, 5);
+                data += QByteArray::fromHex("7e7f0901f7");
+                running = 0;
+            }else if( i % 64 == 0 )
+            {
+                data += char(0xb0 | chan);
+                data += char(7);
+                data += char(i % 128);
+                running = 0xb0 | chan;
+            }else
+            {
+                if( running != ( 0x90 | chan ) )
+                    data += char(running = 0x90 | chan);
+                data += char(36 + ( i / 2 ) % 60);
+                data += char(i % 2 ? 0 : 64);
+            }
+        }
+        appendDelta(data, 0);
+        data += QByteArray::fromHex("ff2f00");
+        QByteArray chunk("MTrk");
+        appendBE(chunk, data.size(), 4);
+        out.write(chunk);
+        out.write(data);
+    }
+    return out.flush();
+}
+
+// the channel messages and SysEx of each track and their times in microseconds
+static bool collectEvents(const QString& path, QVector<QByteArray>& bytes, QVector< QVector<quint64> >& times)
+{
+    MidiReader in;
+    if( !in.open(path) )
+        return false;
+    bytes = QVector<QByteArray>(256);
+    times = QVector< QVector<quint64> >(256);
+    QVector<quint64> clock(256);
+    MidiReader::Event e;
+    while( in.next(e) )
+    {
+        clock[e.track] += e.delta * in.header().unit;
+        if( e.kind == MidiReader::Meta )
+            continue;
+        if( e.kind == MidiReader::Message )
+            bytes[e.track].append((const char*)e.msg, e.len);
+        else
+        {
+            bytes[e.track] += char(e.type);
+            bytes[e.track].append((const char*)e.data, e.size);
+        }
+        times[e.track].append(clock[e.track]);
+    }
+    return !in.failed();
+}
+
+// decoding with one and with all cores, the merge of the tracks, and a round trip through
+// MidiSmfWriter::convert which must keep the events and their times within a tick
+static void readSmf(const char* name, const QString& path)
+{
+    printf("%s, %.1f MB\n", name, QFileInfo(path).size() / 1e6);
+    QList<int> threads;
+    threads << 1;
+    if( QThread::idealThreadCount() > 1 )
+        threads << QThread::idealThreadCount();
+    QElapsedTimer t;
+    for( int i = 0; i < threads.size(); i++ )
+    {
+        MidiSmfReader in;
+        const quint64 allocs = s_allocs;
+        t.start();
+        if( !in.open(path, threads[i]) )
+        {
+            printf("cannot read %s\n", path.toUtf8().constData());
+            return;
+        }
+        const qint64 decode = t.nsecsElapsed();
+        MidiReader::Event e;
+        quint64 count = 0;
+        while( in.next(e) )
+            count++;
+        const qint64 merge = t.nsecsElapsed() - decode;
+        printf("    %2d threads: %d tracks, decode %.1f ms (%.0f MB/s), merge %.1f ms%s\n", threads[i],
+               in.trackCount(), decode / 1e6, QFileInfo(path).size() / ( decode / 1e3 ), merge / 1e6,
+               in.failed() ? ", FAILED" : "");
+        report("    MidiSmfReader", count, decode + merge, s_allocs - allocs);
+    }
+
+    const QString copy = QDir(QDir::tempPath()).absoluteFilePath("MidiBench.mid");
+    QVector<QByteArray> bytes1, bytes2;
+    QVector< QVector<quint64> > times1, times2;
+    t.start();
+    const bool converted = MidiSmfWriter::convert(path, copy);
+    const qint64 convert = t.nsecsElapsed();
+    if( !converted || !collectEvents(path, bytes1, times1) || !collectEvents(copy, bytes2, times2) )
+    {
+        printf("    round trip failed\n");
+        QFile::remove(copy);
+        return;
+    }
+    QFile::remove(copy);
+    quint64 maxError = 0;
+    bool same = bytes1 == bytes2;
+    for( int i = 0; same && i < times1.size(); i++ )
+    {
+        same = times1[i].size() == times2[i].size();
+        for( int j = 0; same && j < times1[i].size(); j++ )
+            maxError = qMax(maxError, times1[i][j] > times2[i][j] ? times1[i][j] - times2[i][j] : times2[i][j] - times1[i][j]);
+    }
+    if( same )
+        printf("    round trip through MidiSmfWriter %.1f ms, same events, max time error %llu us\n",
+               convert / 1e6, maxError);
+    else
+        printf("    round trip through MidiSmfWriter doesn't give the same events\n");
+    fflush(stdout);
+}
+
+static void benchSmf(const QStringList& files)
+{
+    const QString path = QDir(QDir::tempPath()).absoluteFilePath("MidiBench.smf.mid");
+    if( writeSmf(path, 16, 250000) )
+        readSmf("synthetic 16 tracks", path);
+    if( writeSmf(path, 64, 60000) )
+        readSmf("synthetic 64 tracks", path);
+    QFile::remove(path);
+    for( int i = 0; i < files.size(); i++ )
+        readSmf(QFileInfo(files[i]).fileName().toUtf8().constData(), files[i]);
+}
+
+static void reportQuery(const char* name, const MidiStore& store, qint64 nsecs, int result)
+{
+    printf("    %-24s %8.2f ms  %10d  %5.2f ns/row\n", name, nsecs / 1e6, result, double(nsecs) / store.size());
+    fflush(stdout);
+}
+
+// the query primitives over all rows of a set; each query is repeated and the best time taken
+static void queryStore(const char* name, const QString& path)
+{
+    QElapsedTimer t;
+    MidiStore store;
+    const quint64 allocs = s_allocs;
+    t.start();
+    if( !store.load(path) || store.size() == 0 )
+    {
+        printf("cannot read %s\n", path.toUtf8().constData());
+        return;
+    }
+    const qint64 load = t.nsecsElapsed();
+    printf("%s, %.1f hours\n", name, store.times()[store.size() - 1] / 3600e6);
+    report("    load", store.size(), load, s_allocs - allocs);
+
+    const int rounds = 10;
+    qint64 best;
+    int result = 0;
+    MidiStore::Query notes;
+    notes.types = MidiStore::NoteOn;
+#define BEST(expr) best = -1; for( int r = 0; r < rounds; r++ ) { t.start(); expr; \
+    if( best < 0 || t.nsecsElapsed() < best ) best = t.nsecsElapsed(); }
+    BEST(result = store.count(notes));
+    reportQuery("count notes", store, best, result);
+    BEST(result = store.histogram(notes, MidiStore::Data1)[60]);
+    reportQuery("note histogram (C4)", store, best, result);
+    MidiStore::Query window;
+    window.types = MidiStore::AllTypes;
+    window.channels = 1 << 1;
+    window.lo = 60;
+    window.hi = 71;
+    window.from = store.times()[store.size() / 2];
+    window.to = window.from + 10 * 60000000ULL;
+    BEST(result = store.count(window));
+    reportQuery("channel 2, C4-B4, 10 min", store, best, result);
+    MidiStore::Query track;
+    track.track = store.tracks()[0];
+    track.types = MidiStore::PolyPressure | MidiStore::ChannelPressure;
+    BEST(result = store.select(track).size());
+    reportQuery("select pressure of track", store, best, result);
+#undef BEST
+}
+
+static void benchStore(const QStringList& files)
+{
+    // a three hour set of pressure and controller streams; the tracks advance at different
+    // rates, so unlike with MidiWriter the cells aren't in time order and the load sorts them
+    QByteArray plain;
+    QVector<int> cells;
+    quint8 buf[MidiCodec::MaxVarLen + 1 + 16];
+    for( int t = 0; t < 3; t++ )
+    {
+        const QByteArray name = "\xff\x03\x06Track" + QByteArray::number(t);
+        const int len = MidiCodec::encodeCell(buf, 0, t, (const quint8*)name.constData(), name.size());
+        plain.append((const char*)buf, len);
+        cells.append(len);
+    }
+    syntheticCapture(plain, cells, 6500000);
+    const QString path = QDir(QDir::tempPath()).absoluteFilePath("MidiBench.midisink");
+    if( writeCapture(path, plain, false) )
+        queryStore("synthetic set", path);
+    QFile::remove(path);
+    for( int i = 0; i < files.size(); i++ )
+        queryStore(QFileInfo(files[i]).fileName().toUtf8().constData(), files[i]);
+}
+
+static void reportLatency(const char* name, quint64 events, qint64 nsecs, QVector<qint64>& calls)
+{
+    std::sort(calls.begin(), calls.end());
+    const int n = calls.size();
+    printf("%-28s %10.0f events/s  call p50 %6.1f us  p99 %7.1f us  p99.9 %8.1f us  max %8.1f us\n", name,
+           events / ( nsecs / 1e9 ), calls[n / 2] / 1e3, calls[n * 99 / 100] / 1e3, calls[n * 999 / 1000] / 1e3,
+           calls[n - 1] / 1e3);
+    fflush(stdout);
+}
+
+// writes a synthetic capture through each backend like MidiWriter does, i.e. a batch of cells per
+// write() and a flush() every few batches; what matters is how long the writer thread is blocked
+static void benchOutput(const QString& dir)
+{
+    QByteArray plain;
+    QVector<int> cells;
+    syntheticCapture(plain, cells, 1000000);
+    const int batch = 32; // cells per drain
+    const int flushEvery = 16; // drains
+    const int rounds = 8;
+    printf("output to %s, %d MB\n", dir.toUtf8().constData(), int( rounds * plain.size() / 1024 / 1024 ));
+    const QString path = QDir(dir).absoluteFilePath("MidiBench.midisink");
+    for( int backend = 0; backend < 4; backend++ )
+    {
+        MidiOutput* out;
+        const char* name;
+        switch( backend )
+        {
+        case 0:
+            out = new MidiFileOutput(path);
+            name = "    file";
+            break;
+        case 1:
+            out = new MidiSegmentOutput(path, 64 * 1024 * 1024);
+            name = "    mmap";
+            break;
+        case 2:
+            out = new MidiUringOutput(path);
+            name = "    uring";
+            break;
+        default:
+            out = new MidiUringOutput(path, MidiOutput::NoSync, true);
+            name = "    uring O_DIRECT";
+            break;
+        }
+        if( backend >= 2 && !MidiUringOutput::isAvailable() )
+        {
+            printf("%-28s not available\n", name);
+            delete out;
+            continue;
+        }
+        if( !out->open() )
+        {
+            printf("%-28s cannot open %s\n", name, path.toUtf8().constData());
+            delete out;
+            continue;
+        }
+        QVector<qint64> calls;
+        calls.reserve(rounds * cells.size() / batch * 2);
+        QElapsedTimer t, call;
+        t.start();
+        bool ok = true;
+        for( int r = 0; r < rounds && ok; r++ )
+        {
+            const char* p = plain.constData();
+            for( int i = 0, drains = 0; i < cells.size() && ok; i += batch, drains++ )
+            {
+                int len = 0;
+                for( int j = i; j < qMin(i + batch, cells.size()); j++ )
+                    len += cells[j];
+                call.start();
+                ok = out->write(p, len) == len;
+                if( drains % flushEvery == flushEvery - 1 )
+                    ok = out->flush() && ok;
+                calls.append(call.nsecsElapsed());
+                p += len;
+            }
+        }
+        out->close();
+        const qint64 nsecs = t.nsecsElapsed(); // incl. the final close
+        if( ok )
+            reportLatency(name, quint64(rounds) * cells.size(), nsecs, calls);
+        else
+            printf("%-28s write error\n", name);
+        out->remove();
+        delete out;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    const QStringList args = a.arguments().mid(1);
+    const bool all = args.isEmpty();
+
+    QStringList files; // recorded captures for the benchmarks which can use them
+    QStringList smfs; // MIDI files for the smf benchmark
+    QStringList dirs; // where the output benchmark writes, e.g. a tmpfs and a real disk
+    for( int i = 0; i < args.size(); i++ )
+    {
+        if( args[i].endsWith(".midisink") )
+            files << args[i];
+        else if( args[i].endsWith(".mid") )
+            smfs << args[i];
+        else if( QFileInfo(args[i]).isDir() )
+            dirs << args[i];
+    }
+    if( dirs.isEmpty() )
+    {
+        dirs << QDir::tempPath();
+        if( QFileInfo("/dev/shm").isDir() )
+            dirs << "/dev/shm";
+    }
+
+    if( all || args.contains("encode") )
+        benchEncode();
+    if( all || args.contains("compact") )
+        benchCompact(files);
+    if( all || args.contains("read") )
+        benchRead(files);
+    if( all || args.contains("replug") )
+        checkReplug();
+    if( all || args.contains("smf") )
+        benchSmf(smfs);
+    if( all || args.contains("store") )
+        benchStore(files);
+    if( all || args.contains("output") )
+        for( int i = 0; i < dirs.size(); i++ )
+            benchOutput(dirs[i]);
+    return 0;
+}
@@ -0,0 +1,37 @@
+QT       += core
+QT       -= gui
+
+TARGET = MidiBench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+HEADERS += \
+    MidiClock.h \
+    MidiCodec.h \
+    MidiFilter.h \
+    MidiIndex.h \
+    MidiRing.h \
+    MidiOutput.h \
+    MidiReader.h \
+    MidiRemap.h \
+    MidiSmf.h \
+    MidiStats.h \
+    MidiStore.h \
+    MidiStream.h \
+    MidiWriter.h
+
+SOURCES += \
+    MidiBench.cpp \
+    MidiFilter.cpp \
+    MidiIndex.cpp \
+    MidiOutput.cpp \
+    MidiReader.cpp \
+    MidiRemap.cpp \
+    MidiSmf.cpp \
+    MidiStore.cpp \
+    MidiStream.cpp \
+    MidiWriter.cpp
+
+CONFIG += c++11
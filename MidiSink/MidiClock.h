@@ -0,0 +1,61 @@
+#ifndef _MIDICLOCK_H
+#define _MIDICLOCK_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QtGlobal>
+#include <time.h>
+
+// Microseconds since the start of the recording on the CLOCK_MONOTONIC time base,
+// i.e. the same time base RtMidiIn::getMessageHostTime() uses.
+class MidiClock
+{
+public:
+    MidiClock() { d_start = monotonic(); }
+
+    quint64 elapsed() const { return monotonic() - d_start; }
+    quint64 start() const { return d_start; }
+
+    // converts a driver time stamp; 0 means the driver doesn't provide one
+    quint64 fromHostTime(quint64 host) const
+    {
+        if( host == 0 )
+            return elapsed();
+        return host > d_start ? host - d_start : 0;
+    }
+
+    static quint64 monotonic()
+    {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return quint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    static quint64 monotonicNs()
+    {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return quint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+private:
+    quint64 d_start;
+};
+
+#endif // _MIDICLOCK_H
@@ -0,0 +1,251 @@
+#ifndef _MIDICODEC_H
+#define _MIDICODEC_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QtGlobal>
+#include <string.h>
+
+// Per track state of the compact cell encoding; encoder and decoder keep the same.
+struct MidiCompactState
+{
+    quint8 status; // running status, only channel messages
+    quint32 delta; // last delta other than 0
+    MidiCompactState():status(0),delta(0){}
+};
+
+// Allocation free encoding of .midisink cells into caller provided buffers;
+// safe to be used on the RtMidi callback threads.
+class MidiCodec
+{
+public:
+    enum { MaxVarLen = 5 }; // 32 bit values
+    enum { MaxDelta = 0xffffffff };
+
+    // The compact encoding replaces the varlen delta and the track byte of a cell by a flag byte
+    // and an optional delta, and omits the status byte of channel messages equal to the running status
+    // of the track; everything after the status byte is the same as in the plain encoding.
+    // flag: bits 7..6 delta class, bit 5 running status, bits 4..0 track + 1 or EscapeTrack;
+    // a flag with track bits 0 is invalid, so zero padding can't be mistaken for a cell.
+    // A track name meta cell resets the state of its track, so decoding can start at one.
+    enum DeltaClass { ZeroDelta = 0, ByteDelta = 1, DiffDelta = 2, VarLenDelta = 3 }; // DiffDelta: signed byte relative to the last delta
+    enum { RunningStatus = 0x20, TrackMask = 0x1f, EscapeTrack = 0x1f }; // EscapeTrack: track byte follows
+    enum { MaxCompactHeader = 3 + MaxVarLen };
+
+    // writes the variable length quantity and returns the position after it
+    static inline quint8* toVarLen(quint8* p, quint32 value)
+    {
+        if( value < 0x80 )
+        {
+            *p++ = value;
+            return p;
+        }
+        int shift = 28;
+        while( ( value >> shift ) == 0 )
+            shift -= 7;
+        for( ; shift > 0; shift -= 7 )
+            *p++ = 0x80 | ( ( value >> shift ) & 0x7f );
+        *p++ = value & 0x7f;
+        return p;
+    }
+
+    static inline int varLenSize(quint32 value)
+    {
+        int n = 1;
+        while( ( value >>= 7 ) > 0 )
+            n++;
+        return n;
+    }
+
+    // reads a variable length quantity and advances p; missing bytes read as 0 like fromVarLen(QIODevice*)
+    static inline quint32 fromVarLen(const quint8*& p, const quint8* end)
+    {
+        quint32 value = 0;
+        for( int i = 0; i < MaxVarLen; i++ )
+        {
+            const quint8 c = p < end ? *p++ : 0;
+            value = ( value << 7 ) + ( c & 0x7f );
+            if( !( c & 0x80 ) )
+                break;
+        }
+        return value;
+    }
+
+    // encodes delta, track and the MIDI bytes of one event; buf must hold MaxVarLen + 1 + len bytes
+    static inline int encodeCell(quint8* buf, quint32 delta, quint8 track, const quint8* msg, int len)
+    {
+        quint8* p = toVarLen(buf, delta);
+        *p++ = track;
+        switch( len )
+        {
+        case 3:
+            p[2] = msg[2];
+            // fall through
+        case 2:
+            p[1] = msg[1];
+            // fall through
+        case 1:
+            p[0] = msg[0];
+            // fall through
+        case 0:
+            break;
+        default:
+            ::memcpy(p, msg, len);
+            break;
+        }
+        return ( p - buf ) + len;
+    }
+
+    // encodes a meta cell; buf must hold 2 * MaxVarLen + 3 + len bytes
+    static inline int encodeMeta(quint8* buf, quint32 delta, quint8 track, quint8 type, const quint8* data, int len)
+    {
+        quint8* p = toVarLen(buf, delta);
+        *p++ = track;
+        *p++ = 0xff;
+        *p++ = type;
+        p = toVarLen(p, len);
+        if( len )
+            ::memcpy(p, data, len);
+        return ( p - buf ) + len;
+    }
+
+    // converts the delta, track and status of a plain cell to the compact form in out;
+    // returns the length of the compact header and sets consumed to the length of the plain
+    // header it replaces, i.e. the rest of the cell follows as is; returns 0 if the cell is invalid.
+    // states holds the state of each track.
+    static inline int compactCell(quint8* out, const quint8* cell, int len, MidiCompactState* states, int& consumed)
+    {
+        const quint8* p = cell;
+        const quint8* end = cell + len;
+        const quint32 delta = fromVarLen(p, end);
+        if( p + 2 > end )
+            return 0;
+        const quint8 track = *p++;
+        const quint8 status = *p;
+        MidiCompactState& s = states[track];
+        quint8* q = out + 1;
+        quint8 flag;
+        if( track < EscapeTrack - 1 )
+            flag = track + 1;
+        else
+        {
+            flag = EscapeTrack;
+            *q++ = track;
+        }
+        if( delta == 0 )
+            flag |= ZeroDelta << 6;
+        else if( delta < 256 )
+        {
+            flag |= ByteDelta << 6;
+            *q++ = delta;
+        }else if( qint64(delta) - s.delta >= -128 && qint64(delta) - s.delta <= 127 )
+        {
+            flag |= DiffDelta << 6;
+            *q++ = quint8(qint8(qint64(delta) - s.delta));
+        }else
+        {
+            flag |= VarLenDelta << 6;
+            q = toVarLen(q, delta);
+        }
+        if( delta )
+            s.delta = delta;
+        if( status >= 0x80 && status < 0xf0 )
+        {
+            if( status == s.status )
+            {
+                flag |= RunningStatus;
+                p++;
+            }
+            s.status = status;
+        }else if( status == 0xff && p + 1 < end && p[1] == 0x03 )
+            s = MidiCompactState();
+        out[0] = flag;
+        consumed = p - cell;
+        return q - out;
+    }
+
+    // reads a compact header and advances p; returns false if the flag is invalid;
+    // status is the running status if the cell has none, otherwise 0
+    static inline bool expandHeader(const quint8*& p, const quint8* end, MidiCompactState* states,
+                                    quint32& delta, quint8& track, quint8& status)
+    {
+        if( p >= end || ( *p & TrackMask ) == 0 )
+            return false;
+        const quint8 flag = *p++;
+        if( ( flag & TrackMask ) == EscapeTrack )
+            track = p < end ? *p++ : 0;
+        else
+            track = ( flag & TrackMask ) - 1;
+        MidiCompactState& s = states[track];
+        switch( flag >> 6 )
+        {
+        case ZeroDelta:
+            delta = 0;
+            break;
+        case ByteDelta:
+            delta = p < end ? *p++ : 0;
+            break;
+        case DiffDelta:
+            delta = s.delta + ( p < end ? qint8(*p++) : 0 );
+            break;
+        default:
+            delta = fromVarLen(p, end);
+            break;
+        }
+        if( delta )
+            s.delta = delta;
+        if( flag & RunningStatus )
+            status = s.status;
+        else
+        {
+            status = 0;
+            if( p < end && *p >= 0x80 && *p < 0xf0 )
+                s.status = *p;
+        }
+        return true;
+    }
+
+    // splits a plain cell; returns the length of the bytes after the track, which msg points to
+    static inline int parseCell(const quint8* cell, int len, quint32& delta, quint8& track, const quint8*& msg)
+    {
+        const quint8* p = cell;
+        const quint8* end = cell + len;
+        delta = fromVarLen(p, end);
+        track = p < end ? *p++ : 0;
+        msg = p;
+        return end - p;
+    }
+
+    // encodes a SysEx chunk the same way as in a MIDI file: status 0xf0 starts a message,
+    // 0xf7 continues it, data excludes the status and includes the final 0xf7;
+    // buf must hold 2 * MaxVarLen + 2 + len bytes
+    static inline int encodeSysex(quint8* buf, quint32 delta, quint8 track, quint8 status, const quint8* data, int len)
+    {
+        quint8* p = toVarLen(buf, delta);
+        *p++ = track;
+        *p++ = status;
+        p = toVarLen(p, len);
+        if( len )
+            ::memcpy(p, data, len);
+        return ( p - buf ) + len;
+    }
+};
+
+#endif // _MIDICODEC_H
@@ -0,0 +1,305 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+// Batch converter: converts the .midisink streams of the given files, directories or wildcard
+// patterns to MIDI files (or GM files named .gm.mid with -gm) on all cores; files converted before
+// are skipped. Run "MidiConvert [-gm | -map profile] [-f] [-j N] [-from T] [-to T] <file|dir|pattern>...";
+// -map converts to GM files with a MidiRemap profile, which also takes MIDI files;
+// with -from or -to only the time range T is [[hh:]mm:]ss since the start is converted, using and
+// updating the index.
+
+#include "MidiSmf.h"
+#include "MidiOutput.h"
+#include "MidiIndex.h"
+#include "MidiRemap.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDir>
+#include <QThread>
+#include <QMutex>
+#include <QVector>
+#include <stdio.h>
+#include <algorithm>
+
+struct Job
+{
+    QString in;
+    QString out;
+    qint64 size; // of all segments
+};
+
+static bool bySize(const Job& a, const Job& b)
+{
+    return a.size > b.size;
+}
+
+// Each worker owns a queue of jobs and takes from its front; when it is empty the worker
+// steals from the back of the others, so a few long recordings don't leave cores idle.
+// No jobs are added while the workers run, thus they stop when all queues are empty.
+class Pool
+{
+public:
+    Pool(int count):d_queues(count)
+    {
+        for( int i = 0; i < count; i++ )
+            d_queues[i] = new Queue();
+    }
+    ~Pool()
+    {
+        for( int i = 0; i < d_queues.size(); i++ )
+            delete d_queues[i];
+    }
+    void add(const QList<Job>& jobs) // largest first, dealt round robin
+    {
+        for( int i = 0; i < jobs.size(); i++ )
+            d_queues[i % d_queues.size()]->jobs.append(jobs[i]);
+    }
+    bool take(int worker, Job& job)
+    {
+        for( int i = 0; i < d_queues.size(); i++ )
+        {
+            Queue* q = d_queues[( worker + i ) % d_queues.size()];
+            QMutexLocker lock(&q->lock);
+            if( q->jobs.isEmpty() )
+                continue;
+            job = i == 0 ? q->jobs.takeFirst() : q->jobs.takeLast();
+            return true;
+        }
+        return false;
+    }
+private:
+    struct Queue
+    {
+        QMutex lock;
+        QList<Job> jobs;
+    };
+    QVector<Queue*> d_queues;
+};
+
+static QMutex s_print;
+static const quint64 Forever = ~quint64(0);
+
+class Worker : public QThread
+{
+public:
+    Worker(Pool* pool, int index, const MidiRemap* gm, quint64 from, quint64 to):events(0),bytes(0),done(0),failed(0),
+        d_pool(pool),d_index(index),d_gm(gm),d_from(from),d_to(to){}
+    quint64 events;
+    quint64 bytes;
+    int done;
+    int failed;
+protected:
+    void run()
+    {
+        Job job;
+        while( d_pool->take(d_index, job) )
+        {
+            quint64 count = 0;
+            bool ok;
+            if( d_gm )
+                ok = MidiSmfWriter::convertGm(job.in, job.out, d_gm, &count);
+            else if( d_from != 0 || d_to != Forever )
+                ok = MidiSmfWriter::extract(job.in, job.out, d_from, d_to, &count);
+            else
+                ok = MidiSmfWriter::convert(job.in, job.out, 0, &count);
+            QMutexLocker lock(&s_print);
+            if( ok )
+            {
+                done++;
+                events += count;
+                bytes += job.size;
+                printf("%s: %llu events\n", job.out.toUtf8().constData(), count);
+            }else
+            {
+                failed++;
+                QFile::remove(job.out);
+                fprintf(stderr, "cannot convert %s\n", job.in.toUtf8().constData());
+            }
+            fflush(stdout);
+        }
+    }
+private:
+    Pool* d_pool;
+    int d_index;
+    const MidiRemap* d_gm; // shared, only read
+    quint64 d_from;
+    quint64 d_to;
+};
+
+static QStringList expand(const QString& arg)
+{
+    QFileInfo info(arg);
+    if( info.isDir() )
+    {
+        QStringList res;
+        const QStringList names = QDir(arg).entryList(QStringList() << "*.midisink", QDir::Files, QDir::Name);
+        for( int i = 0; i < names.size(); i++ )
+            res << QDir(arg).filePath(names[i]);
+        return res;
+    }
+    if( info.fileName().contains('*') || info.fileName().contains('?') || info.fileName().contains('[') )
+    {
+        // a pattern the shell didn't expand, e.g. quoted
+        QStringList res;
+        const QDir dir = info.dir();
+        const QStringList names = dir.entryList(QStringList() << info.fileName(), QDir::Files, QDir::Name);
+        for( int i = 0; i < names.size(); i++ )
+            if( names[i].endsWith(".midisink") )
+                res << dir.filePath(names[i]);
+        return res;
+    }
+    return QStringList() << arg;
+}
+
+static quint64 parseTime(const QString& str, bool& ok) // [[hh:]mm:]ss[.fff] in microseconds
+{
+    const QStringList parts = str.split(':');
+    double secs = 0;
+    ok = parts.size() <= 3;
+    for( int i = 0; ok && i < parts.size(); i++ )
+        secs = secs * 60 + parts[i].toDouble(&ok);
+    ok = ok && secs >= 0;
+    return secs * 1000000;
+}
+
+static QString rangeName(quint64 from, quint64 to)
+{
+    return QString(".%1-%2").arg(from / 1000000).arg(to == Forever ? QString("end") : QString::number(to / 1000000));
+}
+
+int main(int argc, char ** argv)
+{
+    QCoreApplication a(argc,argv);
+    const QStringList args = a.arguments().mid(1);
+
+    bool gm = false;
+    QString map;
+    bool force = false;
+    int threads = QThread::idealThreadCount();
+    quint64 from = 0;
+    quint64 to = Forever;
+    bool ok = true;
+    QStringList paths;
+    for( int i = 0; i < args.size(); i++ )
+    {
+        if( args[i] == "-gm" )
+            gm = true;
+        else if( args[i] == "-map" && i + 1 < args.size() )
+            map = args[++i];
+        else if( args[i] == "-f" ) // also the ones up to date
+            force = true;
+        else if( args[i] == "-j" && i + 1 < args.size() )
+            threads = args[++i].toInt();
+        else if( args[i] == "-from" && i + 1 < args.size() && ok )
+            from = parseTime(args[++i], ok);
+        else if( args[i] == "-to" && i + 1 < args.size() && ok )
+            to = parseTime(args[++i], ok);
+        else
+            paths += expand(args[i]);
+    }
+    MidiRemap remap;
+    QString error;
+    if( map.isEmpty() ? !remap.parse(MidiRemap::gmProfile()) : !remap.load(map, &error) )
+    {
+        fprintf(stderr, "invalid profile %s: %s\n", map.toUtf8().constData(), error.toUtf8().constData());
+        return -1;
+    }
+    gm = gm || !map.isEmpty();
+    const bool range = from != 0 || to != Forever;
+    if( paths.isEmpty() || !ok || from > to || ( range && gm ) )
+    {
+        fprintf(stderr, "usage: MidiConvert [-gm | -map profile | -from [[hh:]mm:]ss -to [[hh:]mm:]ss] [-f] "
+                "[-j threads] <file|dir|pattern>...\n");
+        return -1;
+    }
+    if( threads < 1 )
+        threads = 1;
+
+    QList<Job> jobs;
+    int skipped = 0;
+    for( int i = 0; i < paths.size(); i++ )
+    {
+        // MIDI files can be remapped too, see MidiSmfReader
+        const bool smf = gm && paths[i].endsWith(".mid") && !paths[i].endsWith(".gm.mid");
+        if( ( !paths[i].endsWith(".midisink") && !smf ) || !QFileInfo(paths[i]).isFile() )
+        {
+            fprintf(stderr, "not a MidiSink stream: %s\n", paths[i].toUtf8().constData());
+            continue;
+        }
+        Job job;
+        job.in = paths[i];
+        // GM files never overwrite the plain conversion of the same stream
+        if( gm )
+            job.out = paths[i].left(paths[i].size() - ( smf ? 4 : 9 )) + ".gm.mid";
+        else
+            job.out = paths[i].left(paths[i].size() - 9) + ( range ? rangeName(from, to) : QString() ) + ".mid";
+        job.size = 0;
+        // the stream is up to date if the output is newer than all of its segments
+        QDateTime modified;
+        const QStringList segments = MidiSegmentOutput::segments(job.in);
+        for( int j = 0; j < segments.size(); j++ )
+        {
+            const QFileInfo info(segments[j]);
+            job.size += info.size();
+            if( !modified.isValid() || info.lastModified() > modified )
+                modified = info.lastModified();
+        }
+        const QFileInfo out(job.out);
+        if( !force && out.exists() && out.lastModified() >= modified )
+        {
+            skipped++;
+            continue;
+        }
+        jobs << job;
+    }
+    std::sort(jobs.begin(), jobs.end(), bySize);
+    if( threads > jobs.size() )
+        threads = qMax(jobs.size(), 1);
+
+    Pool pool(threads);
+    pool.add(jobs);
+    QElapsedTimer timer;
+    timer.start();
+    QList<Worker*> workers;
+    for( int i = 0; i < threads; i++ )
+    {
+        workers << new Worker(&pool, i, gm ? &remap : 0, from, to);
+        workers.last()->start();
+    }
+    quint64 events = 0;
+    quint64 bytes = 0;
+    int done = 0;
+    int failed = 0;
+    for( int i = 0; i < workers.size(); i++ )
+    {
+        workers[i]->wait();
+        events += workers[i]->events;
+        bytes += workers[i]->bytes;
+        done += workers[i]->done;
+        failed += workers[i]->failed;
+        delete workers[i];
+    }
+    const double secs = qMax(timer.nsecsElapsed(), qint64(1)) / 1e9;
+    printf("%d converted, %d up to date, %d failed on %d threads in %.2f s: %.1f MB/s, %.0f events/s\n",
+           done, skipped, failed, threads, secs, bytes / secs / 1e6, events / secs);
+    return failed ? 1 : 0;
+}
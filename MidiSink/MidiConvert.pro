@@ -0,0 +1,28 @@
+QT       += core
+QT       -= gui
+
+TARGET = MidiConvert
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+HEADERS += \
+    MidiCodec.h \
+    MidiIndex.h \
+    MidiOutput.h \
+    MidiReader.h \
+    MidiRemap.h \
+    MidiSmf.h \
+    MidiStream.h
+
+SOURCES += \
+    MidiConvert.cpp \
+    MidiIndex.cpp \
+    MidiOutput.cpp \
+    MidiReader.cpp \
+    MidiRemap.cpp \
+    MidiSmf.cpp \
+    MidiStream.cpp
+
+CONFIG += c++11
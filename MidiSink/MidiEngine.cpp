@@ -18,397 +18,645 @@
 */
 
 #include "MidiEngine.h"
+#include "MidiWriter.h"
+#include "MidiCodec.h"
+#include "MidiClock.h"
+#include "MidiOutput.h"
+#include "MidiStream.h"
+#include "MidiFilter.h"
+#include "MidiSmf.h"
+#include "MidiHotplug.h"
 #include <RtMidi.h>
 #include <QtDebug>
 #include <QFile>
 #include <QStandardPaths>
 #include <QDir>
 #include <QDateTime>
-#include <QMessageBox>
-#include <QVBoxLayout>
-#include <QPushButton>
-#include <QLabel>
-#include <QFileDialog>
-#include <QElapsedTimer>
-#include <QApplication>
+#include <QSettings>
+#include <QMap>
+#include <QSet>
+#include <QUuid>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
 
 class MidiEngine::Imp
 {
 public:
+    enum { MaxSysexChunk = 256 }; // the ALSA sequencer delivers chunks of this size too
 
     int bytes;
-    QElapsedTimer timer;
-
-    Imp():bytes(0)
+    int headerSize;
+    MidiClock clock;
+    MidiWriter* writer;
+    MidiFlushPolicy policy;
+    MidiOutput* out;
+    MidiQueueOutput* queue; // if out is buffered
+    MidiPrerollOutput* preroll; // if out is the pre-roll
+    MidiMirrorOutput* mirror; // if out is mirrored
+    QByteArray session; // see MidiStream::Session
+    QDir dir;
+    bool dropControllers;
+    bool compact;
+    int priority;
+    int cpu;
+    bool lock;
+    int triggerNote;
+    int triggerChannel;
+    QAtomicInt triggered;
+    QFile* statsFile;
+    MidiSmfWriter* smf;
+    MidiHotplug* hotplug;
+    RtMidiIn enumerator; // a client of its own per enumeration would be announced too
+    QMap<QByteArray,quint8> trackOf; // by portKey(); a port which comes back continues its track
+    QList<quint8> freeTracks; // of closed ports, the longest free first
+    int nextTrack;
+    int droppedGone; // by closed ports
+    quint64 lastStats;
+
+    Imp():bytes(0),headerSize(0),writer(0),out(0),queue(0),preroll(0),mirror(0),dropControllers(false),compact(false),priority(0),cpu(-1),
+        lock(false),triggerNote(-1),triggerChannel(-1),triggered(0),statsFile(0),smf(0),hotplug(0),
+        nextTrack(0),droppedGone(0),lastStats(0)
     {
+        QSettings set;
+        policy.bytes = set.value("FlushBytes", policy.bytes).toUInt();
+        policy.msecs = set.value("FlushMsecs", policy.msecs).toUInt();
+        // SCHED_FIFO priority and CPU of the RtMidi threads, see RtMidiIn::setThreadConfig()
+        priority = set.value("CapturePriority", 0).toInt();
+        cpu = set.value("CaptureCpu", -1).toInt();
+        lock = set.value("LockMemory", false).toBool();
+        // "plain" or "compact", see MidiCodec::compactCell
+        compact = set.value("Encoding", "plain").toString() == "compact";
+        dropControllers = set.value("BufferKB", 0).toUInt() && set.value("BufferPolicy").toString() == "controllers";
+        session = QUuid::createUuid().toRfc4122();
+
         QString path = QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation);
         if( path.isEmpty() )
             path = QDir::homePath();
         if( path.isEmpty() )
             throw QString("cannot find document nor home directory");
-        QDir dir(path);
-        const QByteArray tag("MidiSink");
-        if( !dir.mkpath(tag) )
+        dir = QDir(path);
+        if( !dir.mkpath(tag()) )
             throw QString("cannot create directory: %1").arg(path);
-        dir.cd(tag);
+        dir.cd(tag());
+
+        // keep the last PrerollMinutes (0: as much as fits) in PrerollMB of memory and only start
+        // the file on commitPreroll(), e.g. when the note PrerollTriggerNote comes in on
+        // PrerollTriggerChannel (1 to 16, 0 for any)
+        const quint32 prerollMB = set.value("PrerollMB", 0).toUInt();
+        if( prerollMB )
+        {
+            out = preroll = new MidiPrerollOutput(prerollMB, set.value("PrerollMinutes", 0).toUInt() * 60);
+            compact = true; // about twice the time fits into the same memory
+            triggerNote = set.value("PrerollTriggerNote", -1).toInt();
+            triggerChannel = set.value("PrerollTriggerChannel", 0).toInt() - 1;
+            qDebug() << "Keeping a pre-roll of" << prerollMB << "MB";
+            return;
+        }
+
         const QByteArray name = QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss").toUtf8();
-        out.setFileName( dir.absoluteFilePath(name + ".midisink" ) );
-        if( !out.open(QIODevice::WriteOnly) )
-            throw QString("cannot open file for writing: %1").arg(out.fileName());
-        bytes += out.write(tag.constData(),tag.size()+1);
-        bytes += out.write(name.constData(), name.size()+1);
-        qDebug() << "Streaming to" << out.fileName();
-        timer.start();
+        const QString filePath = dir.absoluteFilePath(name + ".midisink" );
+        out = createOutput(name);
+        const QByteArray header = makeHeader(name);
+        bytes += out->write(header.constData(), header.size());
+        headerSize = bytes;
+        qDebug() << "Streaming to" << out->fileName();
+
+        if( set.value("SmfFile", false).toBool() )
+        {
+            // a MIDI file written along with the capture, complete as soon as the recording stops
+            smf = new MidiSmfWriter(dir.absoluteFilePath(name + ".mid"));
+            qDebug() << "Writing MIDI file" << smf->fileName();
+        }
+
+        if( set.value("StatsFile", false).toBool() )
+        {
+            // one line per port and second, tab separated, times in us
+            statsFile = new QFile(filePath + ".stats");
+            if( !statsFile->open(QIODevice::WriteOnly) )
+            {
+                qCritical() << "cannot open" << statsFile->fileName();
+                delete statsFile;
+                statsFile = 0;
+            }else
+                statsFile->write("time\tport\tevents/s\tbytes/s\tmax burst\tmax queue\t"
+                                 "callback p50\tcallback p99\tlatency p50\tlatency p99\tbacklog\tfiltered\t"
+                                 "buffer fill\tspilled\n");
+        }
+    }
+
+    static QByteArray tag() { return "MidiSink"; }
+
+    MidiOutput* createFile(const QString& filePath, MidiOutput::Durability dur)
+    {
+        QSettings set;
+        // "file": buffered QFile, "mmap": preallocated memory mapped segments, "uring": asynchronous
+        // writes of UringBlocks blocks of UringBlockKB, with O_DIRECT if DirectIO; falls back to "file"
+        const QString backend = set.value("Backend", "file").toString();
+        const quint32 segmentMB = qMax(1u, set.value("SegmentMB", 64).toUInt());
+        if( backend == "mmap" )
+            return new MidiSegmentOutput(filePath, qint64(segmentMB) * 1024 * 1024, dur);
+        if( backend == "uring" && MidiUringOutput::isAvailable() )
+        {
+            MidiUringOutput* o = new MidiUringOutput(filePath, dur, set.value("DirectIO", false).toBool(),
+                                                     set.value("UringBlocks", 2).toInt(),
+                                                     set.value("UringBlockKB", MidiUringOutput::DefaultBlockSize / 1024).toUInt() * 1024);
+            // the ring can still fail, e.g. with ENOMEM below the RLIMIT_MEMLOCK it needs or on a
+            // kernel without linked requests; the file backend truncates what it created
+            if( o->open() )
+                return o;
+            qWarning() << "cannot set up io_uring for" << filePath << ", using the file backend";
+            delete o;
+        }else if( backend == "uring" )
+            qWarning() << "io_uring not available, using the file backend";
+        return new MidiFileOutput(filePath, dur);
+    }
+
+    MidiOutput* createOutput(const QByteArray& name)
+    {
+        QSettings set;
+        const QString durability = set.value("Durability", "none").toString();
+        MidiOutput::Durability dur = MidiOutput::NoSync;
+        if( durability == "fdatasync" )
+            dur = MidiOutput::DataSync;
+        else if( durability == "odsync" )
+            dur = MidiOutput::OpenDSync;
+        const QString filePath = dir.absoluteFilePath(name + ".midisink" );
+        MidiOutput* o = createFile(filePath, dur);
+        // a memory buffer of BufferKB between the writer and the disk, 0 for none; when it is full
+        // BufferPolicy "block" lets the writer wait, "controllers" drops controller events first,
+        // "spill" continues in a file in SpillPath
+        const quint32 bufferKB = set.value("BufferKB", 0).toUInt();
+        if( bufferKB )
+        {
+            const QString bufferPolicy = set.value("BufferPolicy", "block").toString();
+            const QString spillPath = QDir(set.value("SpillPath", QDir::tempPath()).toString())
+                    .absoluteFilePath(name + ".midisink.spill");
+            o = queue = new MidiQueueOutput(o, bufferKB * 1024,
+                                            bufferPolicy == "spill" ? MidiQueueOutput::Spill : MidiQueueOutput::Block,
+                                            spillPath);
+        }
+        // a copy of the stream in the directory MirrorPath, e.g. on another disk, with a buffer of
+        // MirrorBufferKB; the mirror is given up when it falls that far behind
+        const QString mirrorPath = set.value("MirrorPath").toString();
+        if( !mirrorPath.isEmpty() )
+        {
+            const QString path = QDir(mirrorPath).absoluteFilePath(name + ".midisink");
+            const quint32 mirrorKB = qMax(64u, set.value("MirrorBufferKB", 4096).toUInt());
+            o = mirror = new MidiMirrorOutput(o, new MidiQueueOutput(createFile(path, dur), mirrorKB * 1024,
+                                                                    MidiQueueOutput::Detach));
+            qDebug() << "Mirroring to" << path;
+        }
+        if( !o->open() )
+        {
+            queue = 0;
+            mirror = 0;
+            delete o;
+            throw QString("cannot open file for writing: %1").arg(filePath);
+        }
+        return o;
+    }
+
+    // without the end of the extension records if open, see MidiPrerollOutput::commit
+    QByteArray makeHeader(const QByteArray& name, bool open = false) const
+    {
+        QSettings set;
+        const bool segmented = set.value("Backend", "file").toString() == "mmap";
+        const quint32 segmentMB = qMax(1u, set.value("SegmentMB", 64).toUInt());
+        QByteArray header = tag();
+        header += char(0);
+        // plain streams stay readable by v2 readers
+        header += char(compact ? MidiStream::CompactVersion : MidiStream::PlainVersion);
+        header += name;
+        header += char(0);
+        header += MidiStream::toVarLen(1); // microseconds
+        header += char(MidiStream::Session);
+        header += MidiStream::toVarLen(session.size());
+        header += session;
+        if( segmented )
+        {
+            const QByteArray size = MidiStream::toVarLen(segmentMB);
+            header += char(MidiStream::SegmentSize);
+            header += MidiStream::toVarLen(size.size());
+            header += size;
+        }
+        if( compact )
+        {
+            header += char(MidiStream::Encoding);
+            header += MidiStream::toVarLen(1);
+            header += char(MidiStream::CompactCells);
+        }
+        if( !open )
+            header += char(0); // end of extension records
+        return header;
+    }
+
+    void commitPreroll()
+    {
+        const QByteArray name = QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss").toUtf8();
+        MidiOutput* o = createOutput(name);
+        const QByteArray header = makeHeader(name, true);
+        headerSize = header.size() + MidiStream::timeBaseRecord(0).size() + 1;
+        const quint64 usecs = preroll->bufferedUsecs();
+        if( !preroll->commit(o, header) )
+            qCritical() << "pre-roll already committed";
+        // the blocks only needed a sync point each; the file has no use for them
+        writer->setSyncInterval(0);
+        qDebug() << "Streaming to" << o->fileName() << "with a pre-roll of" << usecs / 1000000 << "s";
     }
 
     ~Imp()
     {
+        if( hotplug )
+            hotplug->stop();
+        delete hotplug;
+        // stop the callbacks first so the writer can drain whatever is left in the rings
+        for( int i = 0; i < ports.size(); i++ )
+            ports[i]->in.closePort();
+        if( writer )
+        {
+            writer->stop();
+            if( out->size() > headerSize && !writer->getTakes().isEmpty() &&
+                    !MidiStream::writeTakes(out->fileName(), writer->getTakes()) )
+                qCritical() << "cannot write take table of" << out->fileName();
+            delete writer;
+        }
         for( int i = 0; i < ports.size(); i++ )
+        {
+            if( ports[i]->dropped.load() )
+                qWarning() << "dropped" << ports[i]->dropped.load() << "events of" << ports[i]->name;
             delete ports[i];
-        out.flush();
-        if( out.size() <= 25 )
-            out.remove();
+        }
+        for( int i = 0; i < closing.size(); i++ )
+            delete closing[i];
+        if( out->size() <= headerSize )
+        {
+            out->remove();
+            if( statsFile )
+                statsFile->remove();
+            if( smf )
+                smf->remove();
+        }else
+        {
+            out->close();
+            if( smf )
+                smf->close();
+        }
+        delete out;
+        delete statsFile;
+        delete smf;
     }
 
     void fetchPorts()
     {
-        RtMidiIn in;
-        // works as well: in.openVirtualPort("MidiSink");
-        const size_t nPorts = in.getPortCount();
+        // works as well: enumerator.openVirtualPort("MidiSink");
+        const size_t nPorts = enumerator.getPortCount();
         qDebug() << "*** found" << nPorts << "ports";
         for ( size_t i=0; i<nPorts; i++ )
+            openPort(enumerator.getPortName(i).c_str(), i);
+        if( QSettings().value("Hotplug", true).toBool() )
         {
-            const QByteArray name = in.getPortName(i).c_str();
-            Port* p = new Port(name, i, ports.size(), this );
-            ports.append( p );
-            if( ports.size() > 255 )
-                throw QString("too many MIDI in ports, only 255 supported");
-            //qDebug() << "    " << name;
+            hotplug = new MidiHotplug();
+            hotplug->start();
         }
     }
 
+    void lockMemory()
+    {
+        // only what is mapped now, i.e. the rings and the thread stacks; locking future mappings
+        // too would fault in and pin every preallocated segment
+        if( lock && ::mlockall(MCL_CURRENT) != 0 )
+            qWarning() << "cannot lock memory, continuing without:" << strerror(errno);
+    }
+
+    void startWriter()
+    {
+        writer = new MidiWriter(out, &clock, policy);
+        writer->addWritten(bytes);
+        writer->setCompact(compact);
+        writer->setDropControllers(dropControllers);
+        bytes = 0;
+        QSettings set;
+        // "off", "silence" or "notes", see MidiWriter::TakeSplit; the gap in seconds;
+        // the offsets of the takes are unknown in the pre-roll
+        const QString split = set.value("TakeSplit", "off").toString();
+        const quint32 gap = set.value("TakeGap", 10).toUInt() * 1000;
+        if( preroll )
+            writer->setSyncInterval(MidiPrerollOutput::SyncInterval);
+        else if( split == "silence" )
+            writer->setTakeSplit(MidiWriter::SilenceTakes, gap);
+        else if( split == "notes" )
+            writer->setTakeSplit(MidiWriter::NoteTakes, gap);
+        for( int i = 0; i < ports.size(); i++ )
+            addSource(ports[i]);
+        writer->setSmf(smf);
+        writer->start(QThread::HighPriority);
+    }
+
+    void writeStats(const MidiEngine::Stats& s, quint64 now)
+    {
+        const double secs = s.usecs / 1000000.0;
+        QByteArray line;
+        for( int i = 0; i < s.ports.size(); i++ )
+        {
+            const MidiPortStats::Snapshot& p = s.ports[i].data;
+            line += QByteArray::number(now) + '\t' + s.ports[i].name + '\t' +
+                    QByteArray::number(p.events / secs, 'f', 1) + '\t' +
+                    QByteArray::number(p.bytes / secs, 'f', 1) + '\t' +
+                    QByteArray::number(p.maxBurst) + '\t' +
+                    QByteArray::number(p.maxQueue) + '\t' +
+                    QByteArray::number(MidiHistogram::percentile(p.callback, MidiPortStats::CallbackShift, 0.5) / 1000.0) + '\t' +
+                    QByteArray::number(MidiHistogram::percentile(p.callback, MidiPortStats::CallbackShift, 0.99) / 1000.0) + '\t' +
+                    QByteArray::number(MidiHistogram::percentile(p.latency, MidiPortStats::LatencyShift, 0.5)) + '\t' +
+                    QByteArray::number(MidiHistogram::percentile(p.latency, MidiPortStats::LatencyShift, 0.99)) + '\t' +
+                    QByteArray::number(s.backlog) + '\t' +
+                    QByteArray::number(p.filtered) + '\t' +
+                    QByteArray::number(s.bufferFill) + '\t' +
+                    QByteArray::number(s.spilled) + '\n';
+        }
+        statsFile->write(line);
+        statsFile->flush();
+    }
+
     struct Port
     {
         QByteArray name;
         quint16 index;
         quint8 track;
-        bool hasData;
-        RtMidiIn in;
         Imp* that;
-        quint32 lastTime;
-        Port(const QByteArray& n, int i, int t, Imp* imp):name(n),index(i),track(t),that(imp),lastTime(0),hasData(false)
+        quint64 lastTime;
+        QAtomicInt dropped;
+        QAtomicInt closed; // by the writer, see MidiWriter::removeSource
+        MidiPortStats stats;
+        bool inSysex; // receiving the chunks of a SysEx message
+        bool sysexOpen; // its end is not yet in the ring
+        bool sysexLost; // a chunk didn't fit, skip the rest
+        MidiSlotRing ring; // must outlive in, which joins the callback thread
+        RtMidiIn in;
+        Port(const QByteArray& n, int i, int t, Imp* imp):name(n),index(i),track(t),that(imp),lastTime(0),dropped(0),closed(0),
+            inSysex(false),sysexOpen(false),sysexLost(false)
         {
-            in.ignoreTypes(true,true,true);
+            in.ignoreTypes(false,true,true);
+            in.setSysexChunks();
+            in.setThreadConfig(imp->priority, imp->cpu);
             in.setCallback(callback,this);
+            if( in.getPortName(i) != n.constData() )
+                throw RtMidiError("port moved while enumerating", RtMidiError::INVALID_DEVICE);
             in.openPort(i);
         }
     };
 
     QList<Port*> ports;
-    QFile out;
+    QList<Port*> closing; // until the writer is done with them
 
-    static void callback( double deltatime, std::vector< unsigned char > *message, void *userData )
+    // RtMidi appends the client and port numbers, which change when a device is plugged in again
+    static QByteArray portKey(const QByteArray& name)
     {
-        // tested on Mac.
-        // deltatime is a strange beast; seems to not differ channels; the first event on a channel comes
-        // with delta 0, but port 2 (and only that) strangely starts with a very large number; both
-        // observations make the concept unuseful for me; I therefore need to create the timestamp myself.
-        Port* port = (Port*) userData;
-        if( !port->hasData )
-        {
-            QByteArray msg = toVarLen(0);
-            msg += char(port->track);
-            msg += char(0xff);
-            msg += char(0x03); // Sequence/Track Name
-            msg += toVarLen(port->name.size());
-            msg += port->name;
-            port->that->bytes += port->that->out.write(msg);
-            qDebug() << "    " << port->name;
-            port->hasData = true;
-        }
-        // const quint32 tick = deltatime * 1000.0 + 0.5;
-        const quint32 tick = port->that->timer.elapsed();
-        const quint32 diff = tick - port->lastTime;
-        port->lastTime = tick;
-        QByteArray msg = toVarLen(diff); // milliseconds
-        msg += char(port->track);
-        const QByteArray data = QByteArray::fromRawData((const char*)message->data(), message->size());
-        msg += data;
-        port->that->bytes += port->that->out.write(msg);
-        // qDebug() << port->track << diff << data.toHex().constData();
+        const int pos = name.lastIndexOf(' ');
+        if( pos > 0 && name.indexOf(':', pos) > pos )
+            return name.left(pos);
+        return name;
     }
 
-    static QByteArray toVarLen(quint32 value)
+    int allocTrack(const QByteArray& key)
     {
-        quint32 buffer = value & 0x7f;
-        while ((value >>= 7) > 0)
-        {
-            buffer <<= 8;
-            buffer |= 0x80;
-            buffer += (value & 0x7f);
-        }
-        QByteArray res;
-        while (true)
-        {
-            res += char(buffer & 0xff);
-            if (buffer & 0x80)
-                buffer >>= 8;
-            else
-                break;
-        }
-        return res;
+        int track = -1;
+        if( trackOf.contains(key) && freeTracks.contains(trackOf.value(key)) )
+            track = trackOf.value(key);
+        else if( nextTrack < 255 )
+            track = nextTrack++;
+        else if( !freeTracks.isEmpty() )
+            track = freeTracks.first();
+        else
+            return -1;
+        freeTracks.removeOne(track);
+        // the port which had the track before starts over when it comes back
+        const QList<QByteArray> keys = trackOf.keys();
+        for( int i = 0; i < keys.size(); i++ )
+            if( trackOf.value(keys[i]) == track )
+                trackOf.remove(keys[i]);
+        trackOf[key] = track;
+        return track;
     }
 
-    static quint32 fromVarLen(QIODevice* in)
+    Port* openPort(const QByteArray& name, int index)
     {
-        quint32 value;
-        char ch;
-        if( !in->getChar(&ch) )
-            ch = 0;
-        value = (quint8) ch;
-        if ( value & 0x80 )
+        const QByteArray key = portKey(name);
+        const int track = allocTrack(key);
+        if( track < 0 )
         {
-            value &= 0x7f;
-            quint8 c = 0;
-            do
-            {
-                if( !in->getChar(&ch) )
-                    ch = 0;
-                c = ch;
-                value = (value << 7) + ( c & 0x7f);
-            } while (c & 0x80);
+            qWarning() << "too many MIDI in ports, only 255 supported; not recording" << name;
+            return 0;
         }
-        return value;
-    }
-
-    struct Track
-    {
-        QByteArray name;
-        QByteArray data;
-    };
-    typedef QVector<Track> Tracks;
-
-    static QByteArray readString( QIODevice* in)
-    {
-        QByteArray str;
-        while( !in->atEnd() )
+        Port* p = 0;
+        try
         {
-            char ch = 0;
-            in->getChar(&ch);
-            if( ch == 0 )
-                break;
-            else
-                str += ch;
+            p = new Port(name, index, track, this );
+        }catch( const RtMidiError& error )
+        {
+            qWarning() << "cannot open" << name << error.what();
+            freeTracks.prepend(track);
+            return 0;
         }
-        return str;
+        ports.append( p );
+        return p;
     }
 
-    struct Cell
-    {
-        quint32 time;
-        quint8 track;
-        bool meta;
-        QByteArray data;
-        Cell():time(0),track(0),meta(false){}
-    };
-
-    static bool readCell( QIODevice* in, Cell& cell)
+    bool checkPorts()
     {
-        cell.time = fromVarLen(in);
-        char ch;
-        if( !in->getChar(&ch) )
-            ch = 0;
-        cell.track = (quint8) ch;
-        if( !in->getChar(&ch) )
-            ch = 0;
-        const quint8 type = (quint8) ch;
-        if( type == 0xff )
+        for( int i = closing.size() - 1; i >= 0; i-- )
         {
-            cell.meta = true;
-            if( !in->getChar(&ch) )
-                ch = 0;
-            if( ch != 0x03 )
-                return false;
-            const quint32 len = fromVarLen(in);
-            cell.data = in->read(len);
-            return true;
-        }else if( type >= 0xf0 )
+            if( closing[i]->closed.loadAcquire() )
+            {
+                droppedGone += closing[i]->dropped.load();
+                freeTracks.append(closing[i]->track);
+                delete closing.takeAt(i);
+            }
+        }
+        if( hotplug == 0 || !hotplug->changed() )
             return false;
-        else
+        QSet<QByteArray> present;
+        const size_t nPorts = enumerator.getPortCount();
+        for( size_t i = 0; i < nPorts; i++ )
+            present.insert(enumerator.getPortName(i).c_str());
+        bool changed = false;
+        for( int i = ports.size() - 1; i >= 0; i-- )
         {
-            cell.meta = false;
-            if( !(type & 0x80) )
-                return false; // don't support running status
-            cell.data.resize(1);
-            cell.data[0] = type;
-            const quint8 status = type >> 4;
-            if( status == 0xc || status == 0xd )
-                cell.data += in->read(1);
-            else
-                cell.data += in->read(2);
-            return true;
+            if( present.contains(ports[i]->name) )
+                continue;
+            // the writer drains the ring before it lets go of the port
+            Port* p = ports.takeAt(i);
+            qDebug() << "port gone:" << p->name;
+            p->in.closePort();
+            writer->removeSource(p->track, &p->closed);
+            closing.append(p);
+            changed = true;
         }
+        for( size_t i = 0; i < nPorts; i++ )
+        {
+            const QByteArray name = enumerator.getPortName(i).c_str();
+            bool open = false;
+            for( int j = 0; j < ports.size() && !open; j++ )
+                open = ports[j]->name == name;
+            if( open )
+                continue;
+            Port* p = openPort(name, i);
+            if( p == 0 )
+                continue;
+            qDebug() << "port new:" << name << "on track" << p->track;
+            addSource(p);
+            changed = true;
+        }
+        return changed;
     }
 
-    static bool checkHeader( QFile& in )
+    void addSource(Port* p)
     {
-        if( !in.open(QIODevice::ReadOnly) )
-            return false;
-
-        const QByteArray tag = readString(&in);
-        if( tag != "MidiSink" )
-            return false;
-        readString(&in); // ignore timestamp
-        return true;
+        // "Filter" is the MidiFilter profile of all ports, "PortFilters/<port name>" the one of a port
+        QSettings set;
+        const QString profile = set.value("Filter", "off").toString();
+        const QString name = set.value("PortFilters/" + QString::fromUtf8(p->name), profile).toString();
+        MidiFilter filter;
+        if( !filter.setProfile(name) )
+            qWarning() << "unknown filter profile" << name << "for" << p->name;
+        writer->addSource(&p->ring, p->track, p->name, &p->stats, &filter, &p->dropped);
     }
 
-    static bool readStream( const QString& path, Tracks& tracks )
+    static void callback( double deltatime, std::vector< unsigned char > *message, void *userData )
     {
-        QFile in(path);
-        if( !checkHeader(in) )
-            return false;
+        // tested on Mac.
+        // deltatime is a strange beast; seems to not differ channels; the first event on a channel comes
+        // with delta 0, but port 2 (and only that) strangely starts with a very large number; both
+        // observations make the concept unuseful for me; I therefore use the absolute driver time stamp
+        // where available (ALSA), and create the timestamp myself otherwise.
+        Port* port = (Port*) userData;
+        const quint64 start = MidiClock::monotonicNs();
+        encode(port, message);
+        port->stats.callback.add(MidiClock::monotonicNs() - start);
+    }
 
-        Cell cell;
-        quint32 lastTime = 0;
-        while( !in.atEnd() )
+    static void encode( Port* port, std::vector< unsigned char > *message )
+    {
+        if( message->empty() )
+            return;
+        const quint8 status = message->front();
+        // with setSysexChunks the following chunks of a SysEx message come without status
+        const bool sysex = status == 0xf0 || ( ( status < 0x80 || status == 0xf7 ) && port->inSysex );
+        if( sysex )
         {
-            if( !readCell(&in,cell) )
-                return false;
-            if( cell.meta )
+            if( status == 0xf0 )
+                port->sysexLost = false;
+            port->inSysex = message->back() != 0xf7;
+            if( port->sysexLost )
             {
-                if( tracks.size() <= cell.track)
-                    tracks.resize(cell.track + 1);
-                tracks[cell.track].name = cell.data;
-            }else
+                // the rest of a message which didn't fit in the ring
+                port->dropped.fetchAndAddRelaxed(1);
+                return;
+            }
+        }else if( message->size() > 3 || status < 0x80 || status == 0xf7 )
+        {
+            port->dropped.fetchAndAddRelaxed(1);
+            return;
+        }
+        if( port->that->triggerNote >= 0 && message->size() == 3 && ( status & 0xf0 ) == 0x90 &&
+                (*message)[1] == port->that->triggerNote && (*message)[2] != 0 &&
+                ( port->that->triggerChannel < 0 || ( status & 0x0f ) == port->that->triggerChannel ) )
+            port->that->triggered.storeRelease(1); // see MidiEngine::checkTrigger()
+        quint64 tick = port->that->clock.fromHostTime(port->in.getMessageHostTime());
+        if( tick < port->lastTime )
+            tick = port->lastTime; // the driver stamps are monotonic per port, the fallback clock too
+        port->stats.received(tick, message->size());
+        quint64 diff = tick - port->lastTime;
+        while( diff > MidiCodec::MaxDelta )
+        {
+            // more than 71 minutes since the last event of this port
+            MidiSlot* slot = port->ring.reserve();
+            if( slot == 0 )
+                break;
+            slot->time = tick;
+            slot->more = 0;
+            slot->len = MidiCodec::encodeMeta((quint8*)slot->data, MidiCodec::MaxDelta, port->track, 0x00, 0, 0);
+            port->ring.commit();
+            port->lastTime += MidiCodec::MaxDelta;
+            diff -= MidiCodec::MaxDelta;
+        }
+        if( diff > MidiCodec::MaxDelta )
+        {
+            port->dropped.fetchAndAddRelaxed(1);
+            return;
+        }
+        if( port->sysexOpen && ( status == 0xf0 || ( !sysex && status < 0xf8 ) ) )
+        {
+            // terminate an incomplete message in the file; real-time messages may come in between
+            const quint8 end = 0xf7;
+            if( pushSysex(port, tick, 0xf7, &end, 1) )
+                port->sysexOpen = false;
+        }
+        if( sysex )
+        {
+            // the chunks are stored as they come, so a dump is never assembled in memory
+            const quint8* p = message->data();
+            int left = message->size();
+            quint8 st = 0xf7;
+            if( status == 0xf0 )
             {
-                if( tracks.size() <= cell.track)
-                    return false;
-                lastTime = cell.time;
-                tracks[cell.track].data += toVarLen(cell.time);
-                tracks[cell.track].data += cell.data;
-                // qDebug() << cell.track << cell.time << cell.data.toHex().constData();
+                st = 0xf0;
+                p++;
+                left--;
             }
+            do
+            {
+                const int n = qMin(left, int(MaxSysexChunk));
+                if( !pushSysex(port, tick, st, p, n) )
+                {
+                    port->sysexLost = true;
+                    port->dropped.fetchAndAddRelaxed(1);
+                    return;
+                }
+                port->sysexOpen = port->inSysex || n < left;
+                st = 0xf7;
+                p += n;
+                left -= n;
+            }while( left > 0 );
+            return;
         }
-
-        for( int i = 0; i < tracks.size(); i++ )
+        // the track name cell is written by the writer thread in front of the first cell of the port
+        MidiSlot* slot = port->ring.reserve();
+        if( slot == 0 )
         {
-            if( tracks[i].data.isEmpty() || tracks[i].name.isEmpty() )
-                continue;
-
-            QByteArray start;
-            start += toVarLen(0);
-            start += char(0xff);
-            start += char(0x03);
-            start += toVarLen(tracks[i].name.size());
-            start += tracks[i].name;
-
-            QByteArray end;
-            end += toVarLen(lastTime);
-            end += char(0xff);
-            end += char(0x2f);
-            end += char(0x00);
-
-            tracks[i].data = start + tracks[i].data + end;
+            port->dropped.fetchAndAddRelaxed(1);
+            return;
         }
-
-        return true;
+        slot->time = tick;
+        slot->more = 0;
+        slot->len = MidiCodec::encodeCell((quint8*)slot->data, diff, // microseconds
+                                          port->track, message->data(), message->size());
+        port->lastTime = tick;
+        port->ring.commit();
     }
 
-    static bool writeStream( const QString& path, const Tracks& tracks )
+    // spreads the cell over as many consecutive slots as needed and commits them at once
+    static bool pushSysex( Port* port, quint64 tick, quint8 status, const quint8* data, int len )
     {
-        QFile out(path);
-        if( !out.open(QIODevice::WriteOnly) )
+        quint8 buf[2 * MidiCodec::MaxVarLen + 2 + MaxSysexChunk];
+        const int size = MidiCodec::encodeSysex(buf, tick - port->lastTime, port->track, status, data, len);
+        const int per = sizeof(MidiSlot::data);
+        const int count = ( size + per - 1 ) / per;
+        if( port->ring.reserve(count - 1) == 0 )
             return false;
-
-        int numTracks = 0;
-        for( int i = 0; i < tracks.size(); i++ )
-        {
-            if( tracks[i].data.isEmpty() || tracks[i].name.isEmpty() )
-                continue;
-            numTracks++;
-        }
-
-        out.write("MThd");
-        QByteArray len(4,char(0));
-        len[3] = 6;
-        out.write(len);
-        QByteArray word(2,char(0));
-        word[1] = 1; // Format 1, one or more simultaneous tracks
-        out.write(word);
-        word[1] = numTracks;
-        out.write(word);
-#if 0
-        // millisecond-based tracks by specifying 25 frames/sec and a resolution of 40 units per frame
-        word[0] = char(0xe7); // twos complement of 25
-        word[1] = 0x28; // 40 units
-#else
-        // 120 pbm = 120 quarter notes per minute = 2 quarter notes per second
-        // so 1 quarter note is 500 ms
-        const short ticks = 500;
-        word[0] = char((ticks >> 8)) & 0xff;
-        word[1] = char(ticks & 0xff);
-        // tempo is assumed to be 120 bpm
-        // optionally add FF 58 and FF 51 to each track
-#endif
-        out.write(word);
-
-        for( int i = 0; i < tracks.size(); i++ )
+        for( int i = 0; i < count; i++ )
         {
-            if( tracks[i].data.isEmpty() || tracks[i].name.isEmpty() )
-                continue;
-            out.write("MTrk"); // 4D 54 72 6B
-            const quint32 len = tracks[i].data.size();
-            QByteArray bytes(4,char(0));
-            bytes[0] = char((len >> 24) & 0xff);
-            bytes[1] = char((len >> 16) & 0xff);
-            bytes[2] = char((len >> 8)) & 0xff;
-            bytes[3] = char(len & 0xff);
-            out.write(bytes);
-            out.write(tracks[i].data);
+            MidiSlot* slot = port->ring.reserve(i);
+            slot->time = tick;
+            slot->more = i == 0 ? count - 1 : 0;
+            slot->len = qMin(per, size - i * per);
+            ::memcpy(slot->data, buf + i * per, slot->len);
         }
-
+        port->ring.commit(count);
+        port->lastTime = tick;
         return true;
     }
 
-    static void gmPrefix(QFile& out, quint32 time, quint8 chan)
-    {
-        QByteArray buf(3,0);
-        buf[0] = char( 0xb0 | chan );
-
-        out.write(toVarLen(time));
-        out.write(buf); // b0 0 0
-
-        buf[1] = 0x20;
-        buf[2] = 0;
-        out.write(toVarLen(0));
-        out.write(buf); // b0 20 0
-
-        buf[1] = 0x7;
-        buf[2] = 0x6e;
-        out.write(toVarLen(0));
-        out.write(buf); // b0 7 6e
-
-        buf[1] = 0xa;
-        buf[2] = 0x39;
-        out.write(toVarLen(0));
-        out.write(buf); // b0 a 39
-
-        buf[1] = 0xb;
-        buf[2] = 0x40;
-        out.write(toVarLen(0));
-        out.write(buf); // b0 b 40
-
-        buf[1] = 0x5b;
-        buf[2] = 0x69;
-        out.write(toVarLen(0));
-        out.write(buf); // b0 5b 69
-
-        buf[1] = 0x5d;
-        buf[2] = 0x1e;
-        out.write(toVarLen(0));
-        out.write(buf); // b0 5d 1e
-    }
-
 };
 
 MidiEngine::MidiEngine(QObject *parent):QObject(parent),d_imp(0)
@@ -417,6 +665,8 @@ MidiEngine::MidiEngine(QObject *parent):QObject(parent),d_imp(0)
     {
         d_imp = new Imp();
         d_imp->fetchPorts();
+        d_imp->startWriter();
+        d_imp->lockMemory();
         startTimer(1000);
     }catch(  const RtMidiError &error )
     {
@@ -432,309 +682,113 @@ MidiEngine::~MidiEngine()
 
 QString MidiEngine::getSinkPath() const
 {
-    return d_imp->out.fileName();
+    return d_imp->out->fileName();
 }
 
-void MidiEngine::timerEvent(QTimerEvent *event)
+bool MidiEngine::isPreroll() const
 {
-    if( d_imp->bytes )
-    {
-        d_imp->out.flush();
-        // qDebug() << "written" << d_imp->bytes << "bytes";
-        emit onWritten(d_imp->bytes);
-        d_imp->bytes = 0;
-    }
+    return d_imp->preroll && !d_imp->preroll->isCommitted();
 }
 
+quint64 MidiEngine::getPrerollUsecs() const
+{
+    return isPreroll() ? d_imp->preroll->bufferedUsecs() : 0;
+}
 
-MidiMonitor::MidiMonitor():d_eng(0),d_written(0)
+bool MidiEngine::commitPreroll()
 {
-    QVBoxLayout* vbox = new QVBoxLayout(this);
-    d_file = new QLabel(this);
-    vbox->addWidget(d_file);
-    d_time = new QLabel(this);
-    vbox->addWidget(d_time);
-    d_bytes = new QLabel(this);
-    vbox->addWidget(d_bytes);
-    QPushButton* pb = new QPushButton("Convert to MIDI file", this);
-    vbox->addWidget(pb);
-    connect(pb,SIGNAL(clicked(bool)),this,SLOT(onConvert()));
-    pb = new QPushButton("Convert to GM file", this);
-    vbox->addWidget(pb);
-    connect(pb,SIGNAL(clicked(bool)),this,SLOT(onConvert2()));
+    if( !isPreroll() )
+        return false;
     try
     {
-        d_eng = new MidiEngine(this);
-        d_file->setText(d_eng->getSinkPath());
-        connect(d_eng,SIGNAL(onWritten(int)),this,SLOT(onWritten(int)));
+        d_imp->commitPreroll();
     }catch( const QString& err )
     {
-        QMessageBox::critical(this,"Error initializing MidiSink", err );
+        qCritical() << err;
+        return false;
     }
-
-    // TEST
-    // const QString path = "/home/me/MidiSink/referenz.midisink";
-    // convert(path, path + ".mid");
+    emit onRecording(getSinkPath());
+    return true;
 }
 
-void MidiMonitor::onWritten(int bytes)
+bool MidiEngine::checkPorts()
 {
-    d_time->setText( QTime::currentTime().toString(Qt::ISODate) );
-    QLocale loc;
-    d_written += bytes;
-    d_bytes->setText(tr("%1 KB").arg(loc.toString(d_written/1024.0,'f',1)));
+    try
+    {
+        return d_imp->checkPorts();
+    }catch( const RtMidiError &error )
+    {
+        qCritical() << error.what();
+        return false;
+    }
 }
 
-void MidiMonitor::onConvert()
+bool MidiEngine::checkTrigger()
 {
-    const QString path = QFileDialog::getOpenFileName(this,tr("Open MidiSink Stream"),
-                                                      QFileInfo(d_eng->getSinkPath()).absolutePath(),
-                                                      "*.midisink");
-    if( path.isEmpty() )
-        return;
-
-    convert(path, path.left(path.size()-8) + "mid");
+    if( d_imp->triggered.testAndSetOrdered(1, 0) )
+        return commitPreroll();
+    return false;
 }
 
-void MidiMonitor::onConvert2()
+MidiEngine::Stats MidiEngine::fetchStats()
 {
-    QString path = QFileDialog::getOpenFileName(this,tr("Open MidiSink Stream"),
-                                                      QFileInfo(d_eng->getSinkPath()).absolutePath(),
-                                                      "*.midisink");
-    if( path.isEmpty() )
-        return;
-
-    QFile in(path);
-    if( !MidiEngine::Imp::checkHeader(in) )
+    Stats s;
+    s.bytes = d_imp->writer->fetchWritten();
+    if( d_imp->preroll )
+        s.bytes = d_imp->preroll->fetchWritten(); // nothing until committed
+    const MidiWriter::FlushStats fs = d_imp->writer->fetchFlushStats();
+    s.flushes = fs.count;
+    s.avgFlushUsecs = fs.avgUsecs;
+    s.maxFlushUsecs = fs.maxUsecs;
+    s.dropped = d_imp->droppedGone;
+    s.backlog = d_imp->writer->fetchBacklog();
+    s.bufferFill = d_imp->queue ? d_imp->queue->fetchFill() : 0;
+    s.bufferBudget = d_imp->queue ? d_imp->queue->budget() : 0;
+    s.spilled = d_imp->queue ? d_imp->queue->spilled() : 0;
+    if( d_imp->mirror )
     {
-        QMessageBox::critical(this,tr("Convert to GM file"), tr("Cannot read stream, invalid file format") );
-        return;
+        Destination primary;
+        primary.path = d_imp->mirror->fileName();
+        primary.lag = s.bufferFill;
+        primary.budget = s.bufferBudget;
+        primary.failed = d_imp->mirror->primaryFailed();
+        s.destinations.append(primary);
+        Destination mirror;
+        mirror.path = d_imp->mirror->mirror()->fileName();
+        mirror.lag = d_imp->mirror->mirror()->fetchFill();
+        mirror.budget = d_imp->mirror->mirror()->budget();
+        mirror.failed = d_imp->mirror->mirrorFailed();
+        s.destinations.append(mirror);
     }
-
-    path = path.left(path.size()-8) + "mid";
-
-    QFile out(path);
-
-    if( !out.open(QIODevice::WriteOnly) )
-    {
-        QMessageBox::critical(this,tr("Convert to GM file"), tr("Cannot open output file for writing") );
-        return;
-    }
-
-    out.write("MThd");
-    QByteArray len(4,char(0));
-    len[3] = 6;
-    out.write(len);
-    QByteArray word(2,char(0));
-    word[1] = 0; // type 0
-    out.write(word);
-    word[1] = 1; // one track
-    out.write(word);
-    const short ticks = 500;
-    // dummy 120 pbm to fake one tick per ms
-    word[0] = char((ticks >> 8)) & 0xff;
-    word[1] = char(ticks & 0xff);
-    out.write(word);
-
-    out.write("MTrk");
-    const int lenpos = out.pos();
-    out.write( QByteArray(4,char(0)) );  // dummy, fix later
-
-    //out.write(MidiEngine::Imp::toVarLen(0));
-    // out.write(QByteArray::fromHex("F0057E7F0901F7")); // turn on GM
-    //out.write(QByteArray::fromHex("f0 0a 41 10 42 12 40 00 7f 00 41 f7"));
-
-    /*
-    out.write(MidiEngine::Imp::toVarLen(0));
-    out.write(QByteArray::fromHex("FF 58 04 04 02 24 08"));
-    out.write(MidiEngine::Imp::toVarLen(0));
-    out.write(QByteArray::fromHex("FF 51 03 50 00 00"));
-    */
-
-    enum Kind { Unknown, Drums, BassPiano, Pedal };
-    struct Track
+    const quint64 now = d_imp->clock.elapsed();
+    s.usecs = now - d_imp->lastStats;
+    d_imp->lastStats = now;
+    for( int i = 0; i < d_imp->ports.size(); i++ )
     {
-        Kind kind;
-        quint32 time;
-        Track():kind(Unknown),time(0){}
-    };
-
-    QHash<quint8,Track> map;
-
-    MidiEngine::Imp::Cell cell;
-    const char splitpoint = 60;
-    quint32 gmtime = 0;
-    quint32 unused = 0;
-    bool first = true;
-    while( !in.atEnd() )
-    {
-        if( !MidiEngine::Imp::readCell(&in,cell) )
-        {
-            QMessageBox::critical(this,tr("Convert to GM file"), tr("Error reading file") );
-            return;
-        }
-
-        Track& t = map[cell.track];
-        t.time +=  cell.time;
-        qint32 diff = t.time - gmtime;
-        if( diff < 0 )
-            diff = 0;
-        gmtime += diff;
-
-        if( cell.meta )
-        {
-            if( cell.data == "YAMAHA MOTIF XF7 Port3" )
-            {
-                t.kind = Drums;
-                //MidiEngine::Imp::gmPrefix(out,diff+unused,10);
-                //unused = 0;
-                // out.write(MidiEngine::Imp::toVarLen(0));
-                // out.write(QByteArray::fromHex("CA5F"));
-            }else if( cell.data == "YAMAHA MOTIF XF7 Port1" )
-            {
-                t.kind = BassPiano;
-
-                //MidiEngine::Imp::gmPrefix(out,diff+unused,0);
-                //unused = 0;
-                //out.write(MidiEngine::Imp::toVarLen(0));
-                //out.write(QByteArray::fromHex("C005")); // Electric Piano 2 (06) on channel 0
-
-                //MidiEngine::Imp::gmPrefix(out,0,1);
-                out.write(MidiEngine::Imp::toVarLen(0));
-                out.write(QByteArray::fromHex("C121")); // Electric Bass (finger, 34) on channel 1
-
-            }else if( cell.data.startsWith("Pico CircuitPython usb_midi") )
-            {
-                t.kind = Pedal;
-            }
-        }else if( cell.data.size() > 1 && (quint8(cell.data[0]) &  0x80) )
-        {
-            quint8 status = (quint8)cell.data[0];
-            switch( map.value(cell.track).kind )
-            {
-            case Drums:
-                out.write(MidiEngine::Imp::toVarLen(diff+unused));
-                unused = 0;
-                if( (status & 0x80) || (status & 0x90) )
-                {
-                    // only interested in NoteOn/Off
-                    status = ( status & 0xf0 ) | 0x9; // redirect to channel 10
-                    cell.data[0] = (char)status;
-                    switch( cell.data[1] )
-                    {
-                    case 39:
-                        cell.data[1] = 38;
-                        break;
-                    case 43:
-                        cell.data[1] = 45;
-                        break;
-                    case 45:
-                        cell.data[1] = 47;
-                        break;
-                    case 47:
-                        cell.data[1] = 50;
-                        break;
-                    case 48:
-                        cell.data[1] = 49;
-                        break;
-                    case 49:
-                        cell.data[1] = 53;
-                        break;
-                    case 50:
-                        cell.data[1] = 57;
-                        break;
-                    case 52:
-                        cell.data[1] = 59;
-                        break;
-                    default:
-                        break;
-                    }
-                    out.write(cell.data);
-                }
-                break;
-            case BassPiano:
-                if( (status & 0x80) || (status & 0x90) ) // noteon/off
-                {
-                    out.write(MidiEngine::Imp::toVarLen(diff+unused));
-                    unused = 0;
-                    if( cell.data[1] >= splitpoint )
-                    {
-                        // Piano
-                        status = ( status & 0xf0 );
-                        cell.data[0] = (char)status;
-                        cell.data[1] = cell.data[1] - char(12);
-                    }else
-                    {
-                        // bass
-                        status = ( status & 0xf0 ) | 0x1;
-                        cell.data[0] = (char)status;
-                        // cell.data[1] = cell.data[1] + char(12);
-                    }
-                    out.write(cell.data);
-                }else if( status & 0xd0 ) // channel pressure
-                {
-                    out.write(MidiEngine::Imp::toVarLen(diff+unused));
-                    unused = 0;
-                    status = ( status & 0xf0 ) | 0x1; // redirect to channel 1
-                    cell.data[0] = (char)status;
-                    out.write(cell.data);
-                }else
-                    unused += diff;
-                break;
-            case Pedal:
-                status = ( status & 0xf0 );
-                cell.data[0] = (char)status;
-                out.write(MidiEngine::Imp::toVarLen(diff+unused));
-                unused = 0;
-                out.write(cell.data);
-                break;
-            default:
-                // don't send it, but increase timestamp for next message
-                unused += diff;
-                break;
-            }
-        }else
-            qCritical() << "running status not supported" << gmtime << cell.data.toHex().constData();
-        first = false;
+        Imp::Port* port = d_imp->ports[i];
+        s.dropped += port->dropped.load();
+        PortStats ps;
+        ps.name = port->name;
+        port->stats.fetch(ps.data);
+        s.ports.append(ps);
     }
-
-    QByteArray end;
-    end += MidiEngine::Imp::toVarLen(0);
-    end += char(0xff);
-    end += char(0x2f);
-    end += char(0x00);
-    out.write(end);
-
-    const quint32 l = out.pos() - lenpos - 4;
-    QByteArray bytes(4,char(0));
-    bytes[0] = char((l >> 24) & 0xff);
-    bytes[1] = char((l >> 16) & 0xff);
-    bytes[2] = char((l >> 8)) & 0xff;
-    bytes[3] = char(l & 0xff);
-    out.seek(lenpos);
-    out.write(bytes);
+    if( d_imp->statsFile )
+        d_imp->writeStats(s, now);
+    return s;
 }
 
-void MidiMonitor::convert(const QString &inpath, const QString &outpath)
+void MidiEngine::timerEvent(QTimerEvent *event)
 {
-    MidiEngine::Imp::Tracks tracks;
-    if( !MidiEngine::Imp::readStream( inpath, tracks ) )
+    // the writer thread does the writing and flushing; here we only report
+    checkTrigger();
+    checkPorts();
+    const Stats s = fetchStats();
+    if( s.bytes )
     {
-        QMessageBox::critical(this,tr("Open MidiSink Stream"), tr("Cannot read stream, invalid file format") );
-        return;
+        // qDebug() << "written" << bytes << "bytes";
+        emit onWritten(s.bytes);
     }
-
-    MidiEngine::Imp::writeStream(outpath, tracks );
-}
-
-int main(int argc, char ** argv)
-{
-    QApplication a(argc,argv);
-
-
-    MidiMonitor w;
-    w.show();
-
-
-    return a.exec();
+    if( s.flushes )
+        emit onFlushed(s.flushes, s.avgFlushUsecs, s.maxFlushUsecs);
+    emit onStats(s);
 }
@@ -20,48 +20,68 @@
 * http://www.gnu.org/copyleft/gpl.html.
 */
 
-#include <QWidget>
+#include <QObject>
+#include <QList>
+#include "MidiStats.h"
 
 class MidiEngine : public QObject
 {
     Q_OBJECT
 public:
-    MidiEngine(QObject* parent);
+    MidiEngine(QObject* parent = 0);
     ~MidiEngine();
 
-    QString getSinkPath() const;
+    QString getSinkPath() const; // empty while in the pre-roll
+
+    // with the PrerollMB setting nothing is written until commitPreroll(), which starts the file
+    // with the last minutes kept in memory
+    bool isPreroll() const;
+    quint64 getPrerollUsecs() const;
+    bool commitPreroll();
+    bool checkTrigger(); // commits if the trigger note came in; the event loop does it once a second
+    // opens the ports plugged in and closes those gone since the last call; the event loop does it
+    // once a second. Set Hotplug to false to record only the ports present at the start.
+    bool checkPorts();
+
+    struct PortStats
+    {
+        QByteArray name;
+        MidiPortStats::Snapshot data;
+    };
+    struct Destination
+    {
+        QString path;
+        quint32 lag; // max bytes not yet handed to the OS since the last fetch
+        quint32 budget; // of the buffer, 0 if there is none
+        bool failed; // write error, or the mirror fell behind by the budget and was given up
+    };
+    struct Stats
+    {
+        int bytes; // written since the last fetch
+        int flushes;
+        int avgFlushUsecs;
+        int maxFlushUsecs;
+        int dropped; // since the start
+        int backlog; // max cells waiting for the writer
+        quint32 bufferFill; // max bytes waiting for the disk, see MidiQueueOutput
+        quint32 bufferBudget; // 0 if there is no such buffer
+        qint64 spilled; // bytes waiting in the spill file
+        quint32 usecs; // since the last fetch
+        QList<Destination> destinations; // the file and its mirror, empty without MirrorPath
+        QList<PortStats> ports;
+    };
+    // can be polled instead of the signals if there is no event loop
+    Stats fetchStats();
 signals:
     void onWritten(int);
+    void onFlushed(int count, int avgUsecs, int maxUsecs);
+    void onStats(const MidiEngine::Stats&);
+    void onRecording(const QString& path); // after commitPreroll()
 protected:
     void timerEvent(QTimerEvent *event);
 private:
     class Imp;
     Imp* d_imp;
-    friend class MidiMonitor;
-};
-
-class QLabel;
-
-class MidiMonitor : public QWidget
-{
-    Q_OBJECT
-public:
-    MidiMonitor();
-
-protected slots:
-    void onWritten(int);
-    void onConvert();
-    void onConvert2();
-
-protected:
-    void convert( const QString& inpath, const QString& outpath );
-
-private:
-    QLabel* d_file;
-    QLabel* d_time;
-    QLabel* d_bytes;
-    quint32 d_written;
-    MidiEngine* d_eng;
 };
 
 #endif // _MIDIENGINE_H
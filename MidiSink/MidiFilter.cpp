@@ -0,0 +1,169 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiFilter.h"
+#include <QSettings>
+#include <QStringList>
+
+// key layout: control change channel * 128 + controller, then poly pressure channel * 128 + note,
+// then channel pressure and pitch bend by channel
+enum { PolyBase = 16 * 128, PressureBase = 2 * 16 * 128, BendBase = PressureBase + 16, KeyCount = BendBase + 16 };
+
+static const char* s_typeNames[] = { "ControlChange", "ChannelPressure", "PolyPressure", "PitchBend" };
+
+MidiFilter::MidiFilter()
+{
+}
+
+bool MidiFilter::setProfile(const QString& name)
+{
+    for( int i = 0; i < TypeCount; i++ )
+        d_rules[i] = Rule();
+    if( name == "off" )
+        ;
+    else if( name == "duplicates" || name == "light" || name == "heavy" )
+    {
+        // the intervals stay below MidiWriter::HoldBack so that the writer can see what follows
+        for( int i = 0; i < TypeCount; i++ )
+        {
+            d_rules[i].enabled = true;
+            if( name == "light" )
+                d_rules[i].interval = 3000;
+            else if( name == "heavy" )
+            {
+                d_rules[i].interval = 8000;
+                d_rules[i].delta = i == PitchBend ? 128 : 2;
+            }
+        }
+    }else
+    {
+        // FilterProfiles/<name>/<type> = "<interval us> <value delta>"; types without entry are not filtered
+        QSettings set;
+        set.beginGroup("FilterProfiles");
+        if( !set.childGroups().contains(name) )
+            return false;
+        set.beginGroup(name);
+        for( int i = 0; i < TypeCount; i++ )
+        {
+            if( !set.contains(s_typeNames[i]) )
+                continue;
+#if QT_VERSION >= QT_VERSION_CHECK(5,14,0)
+            const QStringList values = set.value(s_typeNames[i]).toString().split(' ', Qt::SkipEmptyParts);
+#else
+            const QStringList values = set.value(s_typeNames[i]).toString().split(' ', QString::SkipEmptyParts);
+#endif
+            d_rules[i].enabled = true;
+            if( values.size() > 0 )
+                d_rules[i].interval = values[0].toUInt();
+            if( values.size() > 1 )
+                d_rules[i].delta = values[1].toUInt();
+        }
+    }
+    if( isOn() )
+        d_last.fill(Last(), KeyCount);
+    else
+        d_last.clear();
+    return true;
+}
+
+bool MidiFilter::isOn() const
+{
+    for( int i = 0; i < TypeCount; i++ )
+        if( d_rules[i].enabled )
+            return true;
+    return false;
+}
+
+int MidiFilter::key(const quint8* msg, int len)
+{
+    if( len < 2 )
+        return -1;
+    const int chan = msg[0] & 0x0f;
+    switch( msg[0] >> 4 )
+    {
+    case 0xb:
+        return len == 3 ? chan * 128 + ( msg[1] & 0x7f ) : -1;
+    case 0xa:
+        return len == 3 ? PolyBase + chan * 128 + ( msg[1] & 0x7f ) : -1;
+    case 0xd:
+        return PressureBase + chan;
+    case 0xe:
+        return len == 3 ? BendBase + chan : -1;
+    default:
+        return -1;
+    }
+}
+
+MidiFilter::Type MidiFilter::typeOf(quint8 status)
+{
+    switch( status >> 4 )
+    {
+    case 0xb:
+        return ControlChange;
+    case 0xa:
+        return PolyPressure;
+    case 0xd:
+        return ChannelPressure;
+    default:
+        return PitchBend;
+    }
+}
+
+quint16 MidiFilter::valueOf(const quint8* msg, int len)
+{
+    switch( msg[0] >> 4 )
+    {
+    case 0xd:
+        return msg[1];
+    case 0xe:
+        return msg[1] | ( msg[2] << 7 );
+    default:
+        return len > 2 ? msg[2] : 0;
+    }
+}
+
+MidiFilter::Verdict MidiFilter::check(const quint8* msg, int len, quint64 time) const
+{
+    const int k = key(msg, len);
+    if( k < 0 || d_last.isEmpty() )
+        return Keep;
+    const Rule& r = d_rules[typeOf(msg[0])];
+    const Last& l = d_last[k];
+    if( !r.enabled || !l.valid )
+        return Keep;
+    const quint16 value = valueOf(msg, len);
+    if( value == l.value )
+        return Drop;
+    const int diff = qAbs(int(value) - int(l.value));
+    if( time - l.time < r.interval || diff < r.delta )
+        return DropIfSuperseded;
+    return Keep;
+}
+
+void MidiFilter::kept(const quint8* msg, int len, quint64 time)
+{
+    const int k = key(msg, len);
+    if( k < 0 || d_last.isEmpty() )
+        return;
+    Last& l = d_last[k];
+    l.time = time;
+    l.value = valueOf(msg, len);
+    l.valid = true;
+}
+
@@ -0,0 +1,70 @@
+#ifndef _MIDIFILTER_H
+#define _MIDIFILTER_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QVector>
+#include <QString>
+
+// Thins out dense controller streams of one port before they are written: drops exact
+// duplicates and events closer than an interval or a value delta to the last kept one
+// of the same controller, but never the last one of a burst. Used by the writer thread.
+class MidiFilter
+{
+public:
+    enum Type { ControlChange, ChannelPressure, PolyPressure, PitchBend, TypeCount };
+    enum Verdict { Keep, Drop, DropIfSuperseded };
+
+    struct Rule
+    {
+        bool enabled; // drops exact duplicates
+        quint32 interval; // us, 0 for none
+        quint16 delta; // minimal value change, 0 for none; pitch bend in 14 bit units
+        Rule():enabled(false),interval(0),delta(0){}
+    };
+
+    MidiFilter();
+
+    // built-in profiles "off", "duplicates", "light" and "heavy"; other names are
+    // read from the settings group FilterProfiles/<name>, see MidiFilter.cpp
+    bool setProfile(const QString& name);
+    bool isOn() const;
+    Rule& rule(Type t) { return d_rules[t]; }
+
+    // index of the controller the message belongs to, or -1 if not filtered
+    static int key(const quint8* msg, int len);
+
+    Verdict check(const quint8* msg, int len, quint64 time) const;
+    void kept(const quint8* msg, int len, quint64 time);
+private:
+    static Type typeOf(quint8 status);
+    static quint16 valueOf(const quint8* msg, int len);
+    struct Last
+    {
+        quint64 time;
+        quint16 value;
+        bool valid;
+        Last():time(0),value(0),valid(false){}
+    };
+    Rule d_rules[TypeCount];
+    QVector<Last> d_last; // by key
+};
+
+#endif // _MIDIFILTER_H
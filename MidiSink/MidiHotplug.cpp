@@ -0,0 +1,102 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiHotplug.h"
+#include <QtDebug>
+#ifdef __LINUX_ALSA__
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <QVector>
+#endif
+
+MidiHotplug::MidiHotplug():d_changed(0),d_stop(0)
+{
+}
+
+MidiHotplug::~MidiHotplug()
+{
+    stop();
+}
+
+bool MidiHotplug::changed()
+{
+    return d_changed.testAndSetOrdered(1, 0);
+}
+
+void MidiHotplug::stop()
+{
+    d_stop.storeRelease(1);
+    wait();
+}
+
+void MidiHotplug::run()
+{
+#ifdef __LINUX_ALSA__
+    snd_seq_t* seq = 0;
+    if( snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0 )
+    {
+        qWarning() << "cannot open the ALSA sequencer, ports plugged in later are not recorded";
+        return;
+    }
+    snd_seq_set_client_name(seq, "MidiSink Hotplug");
+    const int port = snd_seq_create_simple_port(seq, "Announce", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+                                                SND_SEQ_PORT_TYPE_APPLICATION);
+    if( port < 0 || snd_seq_connect_from(seq, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE) < 0 )
+    {
+        qWarning() << "cannot subscribe to System:Announce, ports plugged in later are not recorded";
+        snd_seq_close(seq);
+        return;
+    }
+    QVector<pollfd> fds(snd_seq_poll_descriptors_count(seq, POLLIN));
+    snd_seq_poll_descriptors(seq, fds.data(), fds.size(), POLLIN);
+    while( !d_stop.loadAcquire() )
+    {
+        // the timeout only bounds the time stop() waits
+        if( ::poll(fds.data(), fds.size(), 200) <= 0 )
+            continue;
+        snd_seq_event_t* ev = 0;
+        while( snd_seq_event_input(seq, &ev) >= 0 && ev != 0 )
+        {
+            switch( ev->type )
+            {
+            case SND_SEQ_EVENT_CLIENT_START:
+            case SND_SEQ_EVENT_CLIENT_EXIT:
+            case SND_SEQ_EVENT_PORT_START:
+            case SND_SEQ_EVENT_PORT_EXIT:
+            case SND_SEQ_EVENT_PORT_CHANGE:
+                d_changed.storeRelease(1);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    snd_seq_close(seq);
+#else
+    for( int waited = 0; !d_stop.loadAcquire(); waited += 200 )
+    {
+        msleep(200);
+        if( waited >= RescanMsecs )
+        {
+            d_changed.storeRelease(1);
+            waited = 0;
+        }
+    }
+#endif
+}
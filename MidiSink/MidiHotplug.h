@@ -0,0 +1,44 @@
+#ifndef _MIDIHOTPLUG_H
+#define _MIDIHOTPLUG_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QThread>
+
+// Watches the ports of the ALSA sequencer coming and going by the announcements of its
+// System:Announce port; on other platforms it requests a rescan every RescanMsecs.
+// The engine polls changed() and enumerates the ports again.
+class MidiHotplug : public QThread
+{
+public:
+    enum { RescanMsecs = 2000 };
+
+    MidiHotplug();
+    ~MidiHotplug();
+    bool changed(); // since the last call
+    void stop();
+protected:
+    void run();
+private:
+    QAtomicInt d_changed;
+    QAtomicInt d_stop;
+};
+
+#endif // _MIDIHOTPLUG_H
@@ -0,0 +1,355 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiIndex.h"
+#include "MidiReader.h"
+#include <QVector>
+#include <QtDebug>
+#include <string.h>
+
+static const char s_tag[] = "MidiSinkIndex"; // with the terminating zero
+enum { TagSize = sizeof(s_tag), SessionSize = 16 };
+
+static inline void putU64(uchar* p, quint64 v)
+{
+    for( int i = 0; i < 8; i++ )
+        p[i] = quint8(v >> ( 8 * i ));
+}
+
+static inline quint64 getU64(const uchar* p)
+{
+    quint64 v = 0;
+    for( int i = 7; i >= 0; i-- )
+        v = ( v << 8 ) | p[i];
+    return v;
+}
+
+static QByteArray sessionField(const QByteArray& session)
+{
+    QByteArray f(SessionSize, char(0));
+    ::memcpy(f.data(), session.constData(), qMin(session.size(), int(SessionSize)));
+    return f;
+}
+
+MidiIndex::MidiIndex():d_table(0),d_tracks(0),d_tracksSize(0),d_count(0)
+{
+}
+
+MidiIndex::~MidiIndex()
+{
+    close();
+}
+
+bool MidiIndex::load(const QString& path)
+{
+    close();
+    d_entries.setFileName(path + ".idx");
+    d_states.setFileName(path + ".ids");
+    if( !d_entries.open(QIODevice::ReadOnly) || !d_states.open(QIODevice::ReadOnly) || !map() )
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MidiIndex::close()
+{
+    if( d_table )
+        d_entries.unmap((uchar*)d_table);
+    if( d_tracks )
+        d_states.unmap((uchar*)d_tracks);
+    d_table = 0;
+    d_tracks = 0;
+    d_tracksSize = 0;
+    d_count = 0;
+    d_session.clear();
+    d_entries.close();
+    d_states.close();
+}
+
+bool MidiIndex::map()
+{
+    // only the pages actually searched or read are loaded, whatever the length of the recording
+    const qint64 size = d_entries.size();
+    if( size < HeaderSize )
+        return false;
+    d_table = d_entries.map(0, size);
+    if( d_table == 0 || ::memcmp(d_table, s_tag, TagSize) != 0 || d_table[TagSize] != Version )
+        return false;
+    d_session = QByteArray((const char*)d_table + HeaderSize - SessionSize, SessionSize);
+    d_count = ( size - HeaderSize ) / EntrySize;
+    d_tracksSize = d_states.size();
+    if( d_tracksSize )
+    {
+        d_tracks = d_states.map(0, d_tracksSize);
+        if( d_tracks == 0 )
+            return false;
+    }
+    return true;
+}
+
+quint64 MidiIndex::offset(int i) const
+{
+    return getU64(d_table + HeaderSize + qint64(i) * EntrySize);
+}
+
+quint64 MidiIndex::time(int i) const
+{
+    return getU64(d_table + HeaderSize + qint64(i) * EntrySize + 8);
+}
+
+bool MidiIndex::entry(int i, Entry& e) const
+{
+    return read(i, e, 0);
+}
+
+bool MidiIndex::read(int i, Entry& e, quint64* end) const
+{
+    if( i < 0 || i >= d_count )
+        return false;
+    const uchar* p = d_table + HeaderSize + qint64(i) * EntrySize;
+    e.offset = getU64(p);
+    e.time = getU64(p + 8);
+    e.leading = p[24] != 0;
+    e.tracks.clear();
+    // count (2), then per track id (1), status (1), delta (4), time (8), base (8), name size (2), name
+    quint64 pos = getU64(p + 16);
+    if( pos + 2 > d_tracksSize )
+        return false;
+    const int n = d_tracks[pos] | ( d_tracks[pos + 1] << 8 );
+    pos += 2;
+    for( int j = 0; j < n; j++ )
+    {
+        if( pos + 24 > d_tracksSize )
+            return false;
+        const uchar* t = d_tracks + pos;
+        Track track;
+        track.id = t[0];
+        track.state.status = t[1];
+        track.state.delta = t[2] | ( t[3] << 8 ) | ( t[4] << 16 ) | ( quint32(t[5]) << 24 );
+        track.time = getU64(t + 6);
+        track.base = getU64(t + 14);
+        const int len = t[22] | ( t[23] << 8 );
+        pos += 24;
+        if( pos + len > d_tracksSize )
+            return false;
+        track.name = QByteArray((const char*)d_tracks + pos, len);
+        pos += len;
+        e.tracks.append(track);
+    }
+    if( end )
+        *end = pos;
+    return true;
+}
+
+bool MidiIndex::append(const Entry& e)
+{
+    QByteArray states(2, char(0));
+    states[0] = char(e.tracks.size());
+    states[1] = char(e.tracks.size() >> 8);
+    for( int i = 0; i < e.tracks.size(); i++ )
+    {
+        const Track& t = e.tracks[i];
+        const int len = qMin(t.name.size(), 0xffff);
+        uchar buf[24];
+        buf[0] = t.id;
+        buf[1] = t.state.status;
+        for( int j = 0; j < 4; j++ )
+            buf[2 + j] = quint8(t.state.delta >> ( 8 * j ));
+        putU64(buf + 6, t.time);
+        putU64(buf + 14, t.base);
+        buf[22] = quint8(len);
+        buf[23] = quint8(len >> 8);
+        states.append((const char*)buf, sizeof(buf));
+        states.append(t.name.constData(), len);
+    }
+    uchar entry[EntrySize];
+    ::memset(entry, 0, sizeof(entry));
+    putU64(entry, e.offset);
+    putU64(entry + 8, e.time);
+    putU64(entry + 16, d_states.pos());
+    entry[24] = e.leading;
+    // the states first, so that an entry never points beyond them
+    return d_states.write(states) == states.size() &&
+            d_entries.write((const char*)entry, sizeof(entry)) == sizeof(entry);
+}
+
+static MidiIndex::Entry snapshot(quint64 pos, quint64 time, const MidiReader::Clock& clock, const MidiReader& in,
+                                 const QVector<QByteArray>& names)
+{
+    MidiIndex::Entry e;
+    e.offset = pos;
+    e.time = time;
+    e.leading = clock.leading;
+    for( int i = 0; i < 256; i++ )
+    {
+        if( !clock.seen[i] )
+            continue;
+        MidiIndex::Track t;
+        t.id = i;
+        t.state = in.state(i);
+        t.time = clock.times[i];
+        t.base = clock.bases[i];
+        t.name = names[i];
+        e.tracks.append(t);
+    }
+    return e;
+}
+
+bool MidiIndex::update(const QString& path, quint32 events, quint32 msecs)
+{
+    MidiReader in;
+    if( !in.open(path) || in.isSmf() )
+        return false;
+    const MidiStream::Header& h = in.header();
+    close();
+    d_entries.setFileName(path + ".idx");
+    d_states.setFileName(path + ".ids");
+    if( !d_entries.open(QIODevice::ReadWrite) || !d_states.open(QIODevice::ReadWrite) )
+    {
+        close();
+        return false;
+    }
+
+    // only the last entry is read; the index continues from there, since it is at the end of the
+    // stream when the index was written
+    const QByteArray session = sessionField(h.session);
+    Entry last;
+    quint64 statesEnd = 0;
+    const bool valid = map() && d_session == session && read(d_count - 1, last, &statesEnd) &&
+            last.offset <= in.size();
+    const int count = valid ? d_count : 0;
+    close();
+    if( !d_entries.open(QIODevice::ReadWrite) || !d_states.open(QIODevice::ReadWrite) )
+        return false;
+    bool written = true;
+    if( valid )
+    {
+        // drops whatever a torn update left behind the last complete entry
+        d_entries.resize(HeaderSize + qint64(count) * EntrySize);
+        d_states.resize(statesEnd);
+        d_entries.seek(d_entries.size());
+        d_states.seek(statesEnd);
+    }else
+    {
+        // missing, of an other recording or corrupt
+        d_entries.resize(0);
+        d_states.resize(0);
+        QByteArray header(s_tag, TagSize);
+        header += char(Version);
+        header += char(0);
+        header += session;
+        written = d_entries.write(header) == header.size();
+        last = Entry();
+        last.offset = in.pos();
+        written = append(last) && written;
+    }
+
+    if( !in.seek(last.offset) )
+    {
+        close();
+        return false;
+    }
+    MidiReader::Clock clock(h.timeBase);
+    clock.leading = last.leading;
+    QVector<QByteArray> names(256);
+    for( int i = 0; i < last.tracks.size(); i++ )
+    {
+        const Track& t = last.tracks[i];
+        clock.seen[t.id] = true;
+        clock.times[t.id] = t.time;
+        clock.bases[t.id] = t.base;
+        in.setState(t.id, t.state);
+        names[t.id] = t.name;
+    }
+
+    MidiReader::Event e;
+    quint64 pos = last.offset;
+    quint64 indexed = last.offset;
+    quint64 latest = last.time;
+    quint64 mark = last.time;
+    quint32 n = 0;
+    bool ok = true;
+    while( in.next(e) )
+    {
+        quint64 time;
+        if( !clock.advance(e, time) )
+        {
+            ok = false;
+            break;
+        }
+        if( e.kind == MidiReader::Meta && e.type == 0x03 )
+            names[e.track] = QByteArray((const char*)e.data, e.size);
+        latest = qMax(latest, time * h.unit);
+        pos = in.pos();
+        if( ++n >= events || latest >= mark + msecs * 1000ULL )
+        {
+            written = append(snapshot(pos, latest, clock, in, names)) && written;
+            indexed = pos;
+            n = 0;
+            mark = latest;
+        }
+    }
+    if( in.failed() )
+        ok = false;
+    // the end of the indexed cells, where the next update continues
+    if( indexed != pos )
+        written = append(snapshot(pos, latest, clock, in, names)) && written;
+    written = d_states.flush() && d_entries.flush() && written;
+    if( !written )
+        qCritical() << "cannot write" << d_entries.fileName();
+    if( !map() )
+    {
+        close();
+        return false;
+    }
+    return ok;
+}
+
+int MidiIndex::find(quint64 time) const
+{
+    // the entries are in time order, since each has the latest time of the cells before it
+    int lo = 0;
+    int hi = d_count;
+    while( lo < hi )
+    {
+        const int mid = ( lo + hi ) / 2;
+        if( this->time(mid) < time )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 ? lo - 1 : 0;
+}
+
+int MidiIndex::findAfter(quint64 time) const
+{
+    int lo = 0;
+    int hi = d_count;
+    while( lo < hi )
+    {
+        const int mid = ( lo + hi ) / 2;
+        if( this->time(mid) <= time )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
@@ -0,0 +1,86 @@
+#ifndef _MIDIINDEX_H
+#define _MIDIINDEX_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QList>
+#include <QByteArray>
+#include <QFile>
+#include "MidiCodec.h"
+
+// Sidecar time index of a .midisink stream: every few thousand events or every second it records
+// the offset of a cell together with the state needed to continue decoding there, i.e. the
+// absolute time, base, compact state and name of each track seen so far, so a time range can be
+// read without decoding the stream from the start (see MidiSmfWriter::extract).
+// path.idx has a 32 byte header (tag, version, session) and fixed size entries of offset, time,
+// position of the track states and leading flag, all little endian, so an entry is found by binary
+// search in the mapped file; path.ids has the track states each entry points to. Both files are
+// only appended to, the states first, so a torn update leaves a consistent index.
+class MidiIndex
+{
+public:
+    enum { DefaultEvents = 4096, DefaultMsecs = 1000, Version = 2, HeaderSize = 32, EntrySize = 32 };
+    struct Track
+    {
+        quint8 id;
+        MidiCompactState state;
+        quint64 time; // in units, see MidiReader::Clock
+        quint64 base;
+        QByteArray name;
+        Track():id(0),time(0),base(0){}
+    };
+    struct Entry
+    {
+        quint64 offset; // of a cell
+        quint64 time; // microseconds, the latest time of the cells before offset
+        bool leading;
+        QList<Track> tracks;
+        Entry():offset(0),time(0),leading(true){}
+    };
+
+    MidiIndex();
+    ~MidiIndex();
+    bool load(const QString& path); // of the stream; maps the index, the entries are read on demand
+    void close();
+    // builds the index of the stream or continues it from the last entry if the stream grew;
+    // the last entry is always at the end of the decodable cells
+    bool update(const QString& path, quint32 events = DefaultEvents, quint32 msecs = DefaultMsecs);
+    const QByteArray& session() const { return d_session; }
+    int count() const { return d_count; }
+    quint64 offset(int i) const;
+    quint64 time(int i) const;
+    bool entry(int i, Entry& e) const; // with the track states
+    int find(quint64 time) const; // the last entry before time, or the first one
+    int findAfter(quint64 time) const; // the first entry after time, or count()
+private:
+    Q_DISABLE_COPY(MidiIndex)
+    bool map();
+    bool read(int i, Entry& e, quint64* end) const;
+    bool append(const Entry& e);
+    QFile d_entries;
+    QFile d_states;
+    const uchar* d_table;
+    const uchar* d_tracks;
+    quint64 d_tracksSize;
+    int d_count;
+    QByteArray d_session;
+};
+
+#endif // _MIDIINDEX_H
@@ -0,0 +1,263 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiMonitor.h"
+#include "MidiStream.h"
+#include "MidiSmf.h"
+#include "MidiRemap.h"
+#include "MidiOutput.h"
+#include "MidiCodec.h"
+#include <QtDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QTime>
+#include <QLocale>
+#include <QMessageBox>
+#include <QVBoxLayout>
+#include <QPushButton>
+#include <QLabel>
+#include <QTreeWidget>
+#include <QFileDialog>
+#include <QInputDialog>
+#include <QApplication>
+#include <QSettings>
+
+MidiMonitor::MidiMonitor():d_eng(0),d_written(0)
+{
+    QVBoxLayout* vbox = new QVBoxLayout(this);
+    d_file = new QLabel(this);
+    vbox->addWidget(d_file);
+    d_time = new QLabel(this);
+    vbox->addWidget(d_time);
+    d_bytes = new QLabel(this);
+    vbox->addWidget(d_bytes);
+    d_flush = new QLabel(this);
+    vbox->addWidget(d_flush);
+    d_backlog = new QLabel(this);
+    vbox->addWidget(d_backlog);
+    d_buffer = new QLabel(this);
+    vbox->addWidget(d_buffer);
+    d_buffer->hide();
+    d_mirror = new QLabel(this);
+    vbox->addWidget(d_mirror);
+    d_mirror->hide();
+    d_ports = new QTreeWidget(this);
+    d_ports->setRootIsDecorated(false);
+    d_ports->setHeaderLabels( QStringList() << tr("Port") << tr("Events/s") << tr("Bytes/s") << tr("Max Burst")
+                              << tr("Max Queue") << tr("Callback p99") << tr("Latency p50") << tr("Latency p99")
+                              << tr("Filtered/s") );
+    vbox->addWidget(d_ports);
+    QPushButton* pb = new QPushButton("Convert to MIDI file", this);
+    vbox->addWidget(pb);
+    connect(pb,SIGNAL(clicked(bool)),this,SLOT(onConvert()));
+    pb = new QPushButton("Convert to GM file", this);
+    vbox->addWidget(pb);
+    connect(pb,SIGNAL(clicked(bool)),this,SLOT(onConvert2()));
+    d_commit = new QPushButton("Record with pre-roll", this);
+    vbox->addWidget(d_commit);
+    connect(d_commit,SIGNAL(clicked(bool)),this,SLOT(onCommit()));
+    d_commit->hide();
+    try
+    {
+        d_eng = new MidiEngine(this);
+        d_file->setText(d_eng->getSinkPath());
+        d_commit->setVisible(d_eng->isPreroll());
+        connect(d_eng,SIGNAL(onRecording(QString)),this,SLOT(onRecording(QString)));
+        connect(d_eng,SIGNAL(onWritten(int)),this,SLOT(onWritten(int)));
+        connect(d_eng,SIGNAL(onFlushed(int,int,int)),this,SLOT(onFlushed(int,int,int)));
+        connect(d_eng,SIGNAL(onStats(MidiEngine::Stats)),this,SLOT(onStats(MidiEngine::Stats)));
+    }catch( const QString& err )
+    {
+        QMessageBox::critical(this,"Error initializing MidiSink", err );
+    }
+
+    // TEST
+    // const QString path = "/home/me/MidiSink/referenz.midisink";
+    // convert(path, path + ".mid");
+}
+
+void MidiMonitor::onWritten(int bytes)
+{
+    d_time->setText( QTime::currentTime().toString(Qt::ISODate) );
+    QLocale loc;
+    d_written += bytes;
+    d_bytes->setText(tr("%1 KB").arg(loc.toString(d_written/1024.0,'f',1)));
+}
+
+void MidiMonitor::onFlushed(int count, int avgUsecs, int maxUsecs)
+{
+    d_flush->setText(tr("%1 flushes/s, avg %2 us, max %3 us").arg(count).arg(avgUsecs).arg(maxUsecs));
+}
+
+static QString formatTime(quint64 usecs)
+{
+    if( usecs == 0 )
+        return "-";
+    else if( usecs < 1000 )
+        return QString("%1 us").arg(usecs);
+    else
+        return QString("%1 ms").arg(usecs / 1000.0, 0, 'f', 1);
+}
+
+static QString formatNsecs(quint64 nsecs)
+{
+    // a callback usually takes less than a microsecond
+    if( nsecs != 0 && nsecs < 1000 )
+        return QString("%1 ns").arg(nsecs);
+    else
+        return formatTime(( nsecs + 500 ) / 1000);
+}
+
+void MidiMonitor::onStats(const MidiEngine::Stats& s)
+{
+    if( d_eng->isPreroll() )
+        d_file->setText(tr("pre-roll, last %1 kept in memory")
+                        .arg(QTime(0,0).addMSecs(d_eng->getPrerollUsecs() / 1000).toString("hh:mm:ss")));
+    d_backlog->setText(tr("writer backlog max %1 cells, %2 dropped").arg(s.backlog).arg(s.dropped));
+    if( s.bufferBudget )
+    {
+        d_buffer->setText(tr("disk buffer max %1% of %2 KB, %3 KB spilled")
+                          .arg(100.0 * s.bufferFill / s.bufferBudget, 0, 'f', 1)
+                          .arg(s.bufferBudget / 1024).arg(s.spilled / 1024));
+        d_buffer->show();
+    }
+    if( !s.destinations.isEmpty() )
+    {
+        QStringList lines;
+        for( int i = 0; i < s.destinations.size(); i++ )
+        {
+            const MidiEngine::Destination& d = s.destinations[i];
+            QString line = tr("%1: lag max %2 KB").arg(d.path).arg(d.lag / 1024);
+            if( d.budget )
+                line += tr(" of %1 KB").arg(d.budget / 1024);
+            if( d.failed )
+                line += tr(", FAILED");
+            lines << line;
+        }
+        d_mirror->setText(lines.join("\n"));
+        d_mirror->show();
+    }
+    const double secs = s.usecs ? s.usecs / 1000000.0 : 1.0;
+    QLocale loc;
+    for( int i = 0; i < s.ports.size(); i++ )
+    {
+        QTreeWidgetItem* item = d_ports->topLevelItem(i);
+        if( item == 0 )
+            item = new QTreeWidgetItem(d_ports);
+        const MidiPortStats::Snapshot& p = s.ports[i].data;
+        item->setText(0, QString::fromUtf8(s.ports[i].name));
+        item->setText(1, loc.toString(p.events / secs, 'f', 1));
+        item->setText(2, loc.toString(p.bytes / secs, 'f', 0));
+        item->setText(3, QString::number(p.maxBurst));
+        item->setText(4, QString::number(p.maxQueue));
+        // histogram bucket bounds, i.e. at most twice the actual value
+        item->setText(5, formatNsecs(MidiHistogram::percentile(p.callback, MidiPortStats::CallbackShift, 0.99)));
+        item->setText(6, formatTime(MidiHistogram::percentile(p.latency, MidiPortStats::LatencyShift, 0.5)));
+        item->setText(7, formatTime(MidiHistogram::percentile(p.latency, MidiPortStats::LatencyShift, 0.99)));
+        item->setText(8, loc.toString(p.filtered / secs, 'f', 1));
+    }
+    // ports unplugged since
+    while( d_ports->topLevelItemCount() > s.ports.size() )
+        delete d_ports->topLevelItem(s.ports.size());
+}
+
+void MidiMonitor::onCommit()
+{
+    if( !d_eng->commitPreroll() )
+        QMessageBox::critical(this,tr("Record with pre-roll"), tr("Cannot open the file for writing") );
+}
+
+void MidiMonitor::onRecording(const QString& path)
+{
+    d_file->setText(path);
+    d_commit->hide();
+}
+
+void MidiMonitor::onConvert()
+{
+    const QString path = QFileDialog::getOpenFileName(this,tr("Open MidiSink Stream"),
+                                                      QFileInfo(d_eng->getSinkPath()).absolutePath(),
+                                                      "*.midisink");
+    if( path.isEmpty() )
+        return;
+
+    const QString base = path.left(path.size()-9);
+    MidiStream::Takes takes;
+    if( MidiStream::readTakes(path, takes) && takes.size() > 1 )
+    {
+        // only the cells of the selected take are read
+        QStringList items;
+        items << tr("All takes");
+        for( int i = 0; i < takes.size(); i++ )
+            items << tr("Take %1 at %2, %3").arg(i + 1)
+                     .arg(QTime(0,0).addMSecs(takes[i].start / 1000).toString("hh:mm:ss"))
+                     .arg(QTime(0,0).addMSecs(takes[i].duration / 1000).toString("hh:mm:ss"));
+        bool ok;
+        const QString item = QInputDialog::getItem(this, tr("Convert to MIDI file"), tr("Take:"), items, 0, false, &ok);
+        if( !ok )
+            return;
+        const int i = items.indexOf(item) - 1;
+        if( i >= 0 )
+        {
+            convert(path, base + QString(".take%1.mid").arg(i + 1), &takes[i]);
+            return;
+        }
+    }
+    convert(path, base + ".mid");
+}
+
+void MidiMonitor::onConvert2()
+{
+    QString path = QFileDialog::getOpenFileName(this,tr("Open MidiSink Stream"),
+                                                      QFileInfo(d_eng->getSinkPath()).absolutePath(),
+                                                      "*.midisink");
+    if( path.isEmpty() )
+        return;
+
+    // a profile file as described in MidiRemap.h, or the built-in one
+    MidiRemap remap;
+    const QString profile = QSettings().value("RemapProfile").toString();
+    QString error;
+    if( profile.isEmpty() ? !remap.parse(MidiRemap::gmProfile()) : !remap.load(profile, &error) )
+    {
+        QMessageBox::critical(this,tr("Convert to GM file"), tr("Invalid remap profile %1: %2").arg(profile).arg(error) );
+        return;
+    }
+    if( !MidiSmfWriter::convertGm(path, path.left(path.size()-9) + ".gm.mid", &remap) )
+        QMessageBox::critical(this,tr("Convert to GM file"), tr("Cannot convert, invalid file format or output not writable") );
+}
+
+void MidiMonitor::convert(const QString &inpath, const QString &outpath, const MidiStream::Take* take)
+{
+    if( !MidiSmfWriter::convert( inpath, outpath, take ) )
+        QMessageBox::critical(this,tr("Open MidiSink Stream"), tr("Cannot read stream, invalid file format") );
+}
+
+int main(int argc, char ** argv)
+{
+    QApplication a(argc,argv);
+    a.setOrganizationName("me@rochus-keller.ch");
+    a.setOrganizationDomain("github.com/rochus-keller/MusicTools");
+    a.setApplicationName("MidiSink");
+
+    MidiMonitor w;
+    w.show();
+
+    return a.exec();
+}
@@ -0,0 +1,63 @@
+#ifndef _MIDIMONITOR_H
+#define _MIDIMONITOR_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QWidget>
+#include "MidiEngine.h"
+#include "MidiStream.h"
+
+class QLabel;
+class QTreeWidget;
+class QPushButton;
+
+class MidiMonitor : public QWidget
+{
+    Q_OBJECT
+public:
+    MidiMonitor();
+
+protected slots:
+    void onWritten(int);
+    void onFlushed(int count, int avgUsecs, int maxUsecs);
+    void onStats(const MidiEngine::Stats&);
+    void onConvert();
+    void onConvert2();
+    void onCommit();
+    void onRecording(const QString&);
+
+protected:
+    void convert( const QString& inpath, const QString& outpath, const MidiStream::Take* take = 0 );
+
+private:
+    QLabel* d_file;
+    QLabel* d_time;
+    QLabel* d_bytes;
+    QLabel* d_flush;
+    QLabel* d_backlog;
+    QLabel* d_buffer;
+    QLabel* d_mirror;
+    QTreeWidget* d_ports;
+    QPushButton* d_commit;
+    quint32 d_written;
+    MidiEngine* d_eng;
+};
+
+#endif // _MIDIMONITOR_H
@@ -0,0 +1,1069 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiOutput.h"
+#include "MidiStream.h"
+#include <QtDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifdef Q_OS_LINUX
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+static inline void dataSync(int fd)
+{
+#ifdef Q_OS_LINUX
+    ::fdatasync(fd);
+#else
+    ::fsync(fd);
+#endif
+}
+
+MidiFileOutput::MidiFileOutput(const QString& path, Durability d):d_out(path),d_durability(d)
+{
+}
+
+bool MidiFileOutput::open()
+{
+    if( d_durability == OpenDSync )
+    {
+        const int fd = ::open(QFile::encodeName(d_out.fileName()).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_DSYNC, 0644);
+        if( fd < 0 )
+            return false;
+        if( !d_out.open(fd, QIODevice::WriteOnly, QFileDevice::AutoCloseHandle) )
+        {
+            ::close(fd);
+            return false;
+        }
+        return true;
+    }else
+        return d_out.open(QIODevice::WriteOnly);
+}
+
+qint64 MidiFileOutput::write(const char* data, qint64 len)
+{
+    return d_out.write(data, len);
+}
+
+bool MidiFileOutput::flush()
+{
+    const bool res = d_out.flush(); // with O_DSYNC the write itself is synchronous
+    if( d_durability == DataSync )
+        dataSync(d_out.handle());
+    return res;
+}
+
+void MidiFileOutput::close()
+{
+    d_out.close();
+}
+
+qint64 MidiFileOutput::size() const
+{
+    return d_out.size();
+}
+
+bool MidiFileOutput::remove()
+{
+    return d_out.remove();
+}
+
+MidiSegmentOutput::MidiSegmentOutput(const QString& path, qint64 segmentSize, Durability d):
+    d_path(path),d_segSize(segmentSize),d_done(0),d_pos(0),d_synced(0),d_map(0),d_fd(-1),d_index(0),d_durability(d)
+{
+    const qint64 page = ::sysconf(_SC_PAGESIZE);
+    d_segSize = qMax( ( d_segSize + page - 1 ) / page * page, page );
+}
+
+MidiSegmentOutput::~MidiSegmentOutput()
+{
+    close();
+}
+
+QString MidiSegmentOutput::segmentName(const QString& path, int index)
+{
+    if( index == 0 )
+        return path;
+    else
+        return path + "." + QString::number(index);
+}
+
+QStringList MidiSegmentOutput::segments(const QString& path)
+{
+    QStringList res;
+    res << path;
+    while( QFile::exists(segmentName(path, res.size())) )
+        res << segmentName(path, res.size());
+    return res;
+}
+
+bool MidiSegmentOutput::open()
+{
+    d_index = 0;
+    d_done = 0;
+    return openSegment();
+}
+
+bool MidiSegmentOutput::openSegment()
+{
+    const QByteArray name = QFile::encodeName(segmentName(d_path, d_index));
+    d_fd = ::open(name.constData(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( d_fd < 0 )
+        return false;
+#ifdef Q_OS_LINUX
+    // reserve the blocks now so that later stores into the map can't fail with SIGBUS
+    // and the file system doesn't have to update the metadata on every page
+    const int res = ::posix_fallocate(d_fd, 0, d_segSize);
+#else
+    const int res = ::ftruncate(d_fd, d_segSize);
+#endif
+    if( res == 0 )
+        d_map = (uchar*)::mmap(0, d_segSize, PROT_READ | PROT_WRITE, MAP_SHARED, d_fd, 0);
+    if( res != 0 || d_map == MAP_FAILED )
+    {
+        qCritical() << "cannot allocate segment" << name;
+        d_map = 0;
+        ::close(d_fd);
+        d_fd = -1;
+        return false;
+    }
+    d_pos = 0;
+    d_synced = 0;
+    return true;
+}
+
+void MidiSegmentOutput::closeSegment(bool truncate)
+{
+    if( d_map )
+    {
+        if( d_durability != NoSync )
+            ::msync(d_map, d_pos, MS_SYNC);
+        ::munmap(d_map, d_segSize);
+        d_map = 0;
+    }
+    if( d_fd >= 0 )
+    {
+        if( truncate && ::ftruncate(d_fd, d_pos) != 0 )
+            qCritical() << "cannot truncate segment" << segmentName(d_path, d_index);
+        ::close(d_fd);
+        d_fd = -1;
+    }
+}
+
+qint64 MidiSegmentOutput::write(const char* data, qint64 len)
+{
+    qint64 done = 0;
+    while( done < len )
+    {
+        if( d_map == 0 )
+            break;
+        if( d_pos == d_segSize )
+        {
+            closeSegment(false);
+            d_done += d_segSize;
+            d_pos = 0;
+            d_index++;
+            if( !openSegment() )
+                break;
+        }
+        const qint64 n = qMin(len - done, d_segSize - d_pos);
+        ::memcpy(d_map + d_pos, data + done, n);
+        d_pos += n;
+        done += n;
+    }
+    return done > 0 || len == 0 ? done : -1;
+}
+
+bool MidiSegmentOutput::flush()
+{
+    // the data is in the page cache as soon as it is stored; only sync if asked to
+    if( d_map == 0 || d_durability == NoSync || d_synced == d_pos )
+        return true;
+    const qint64 page = ::sysconf(_SC_PAGESIZE);
+    const qint64 from = d_synced / page * page;
+    const bool res = ::msync(d_map + from, d_pos - from, MS_SYNC) == 0;
+    d_synced = d_pos;
+    return res;
+}
+
+void MidiSegmentOutput::close()
+{
+    closeSegment(true);
+}
+
+bool MidiSegmentOutput::remove()
+{
+    close();
+    bool res = true;
+    for( int i = 0; i <= d_index; i++ )
+        res = QFile::remove(segmentName(d_path, i)) && res;
+    return res;
+}
+
+#ifdef Q_OS_LINUX
+static int uringSetup(unsigned entries, io_uring_params* p)
+{
+    return ::syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int ring, unsigned submit, unsigned minComplete, unsigned flags)
+{
+    return ::syscall(__NR_io_uring_enter, ring, submit, minComplete, flags, 0, 0);
+}
+#endif
+
+MidiUringOutput::MidiUringOutput(const QString& path, Durability d, bool direct, int blockCount, quint32 blockSize):
+    d_path(path),d_cur(0),d_size(0),d_durability(d),d_direct(direct),d_failed(false),d_fd(-1),d_ring(-1),
+    d_sqMap(0),d_sqMapLen(0),d_cqMap(0),d_cqMapLen(0),d_sqes(0),d_sqesLen(0),
+    d_sqHead(0),d_sqTail(0),d_sqMask(0),d_sqArray(0),d_cqHead(0),d_cqTail(0),d_cqMask(0),d_cqes(0)
+{
+    d_blockSize = qMax(quint32(Align), ( blockSize + Align - 1 ) / Align * Align);
+    d_blocks.resize(qMax(2, blockCount));
+    for( int i = 0; i < d_blocks.size(); i++ )
+    {
+        Block& b = d_blocks[i];
+        b.data = 0;
+        b.offset = 0;
+        b.len = 0;
+        b.kept = 0;
+        b.inFlight = 0;
+        b.drain = false;
+        b.vec = 0;
+    }
+}
+
+MidiUringOutput::~MidiUringOutput()
+{
+    close();
+    for( int i = 0; i < d_blocks.size(); i++ )
+    {
+        ::free(d_blocks[i].data);
+        delete d_blocks[i].vec;
+    }
+}
+
+bool MidiUringOutput::isAvailable()
+{
+#ifdef Q_OS_LINUX
+    // ENOSYS on old kernels, EPERM if disabled by sysctl or seccomp
+    io_uring_params p;
+    ::memset(&p, 0, sizeof(p));
+    const int ring = uringSetup(1, &p);
+    if( ring < 0 )
+        return false;
+    ::close(ring);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool MidiUringOutput::open()
+{
+#ifdef Q_OS_LINUX
+    if( d_fd >= 0 )
+        return true; // already opened by MidiEngine to see whether io_uring works
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if( d_durability == OpenDSync )
+        flags |= O_DSYNC;
+    if( d_direct )
+        flags |= O_DIRECT;
+    d_fd = ::open(QFile::encodeName(d_path).constData(), flags, 0644);
+    if( d_fd < 0 && d_direct && errno == EINVAL )
+    {
+        // e.g. tmpfs
+        qWarning() << "O_DIRECT not supported for" << d_path << "writing through the page cache";
+        d_direct = false;
+        d_fd = ::open(QFile::encodeName(d_path).constData(), flags & ~O_DIRECT, 0644);
+    }
+    if( d_fd < 0 )
+        return false;
+    io_uring_params p;
+    ::memset(&p, 0, sizeof(p));
+    // each block has at most a write and an fsync in flight
+    d_ring = uringSetup(2 * d_blocks.size(), &p);
+    // the fsync is linked to its write, which needs Linux 5.3; features are reported since 5.4
+    if( d_ring < 0 || ( d_durability == DataSync && p.features == 0 ) )
+    {
+        close();
+        return false;
+    }
+    d_sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    d_cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if( single )
+        d_sqMapLen = d_cqMapLen = qMax(d_sqMapLen, d_cqMapLen);
+    d_sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+    d_sqMap = ::mmap(0, d_sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ring, IORING_OFF_SQ_RING);
+    if( d_sqMap == MAP_FAILED )
+        d_sqMap = 0;
+    d_cqMap = single ? d_sqMap :
+                       ::mmap(0, d_cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ring, IORING_OFF_CQ_RING);
+    if( d_cqMap == MAP_FAILED )
+        d_cqMap = 0;
+    d_sqes = ::mmap(0, d_sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_ring, IORING_OFF_SQES);
+    if( d_sqes == MAP_FAILED )
+        d_sqes = 0;
+    if( d_sqMap == 0 || d_cqMap == 0 || d_sqes == 0 )
+    {
+        close();
+        return false;
+    }
+    char* sq = (char*)d_sqMap;
+    d_sqHead = (unsigned*)( sq + p.sq_off.head );
+    d_sqTail = (unsigned*)( sq + p.sq_off.tail );
+    d_sqMask = (unsigned*)( sq + p.sq_off.ring_mask );
+    d_sqArray = (unsigned*)( sq + p.sq_off.array );
+    char* cq = (char*)d_cqMap;
+    d_cqHead = (unsigned*)( cq + p.cq_off.head );
+    d_cqTail = (unsigned*)( cq + p.cq_off.tail );
+    d_cqMask = (unsigned*)( cq + p.cq_off.ring_mask );
+    d_cqes = cq + p.cq_off.cqes;
+    for( int i = 0; i < d_blocks.size(); i++ )
+    {
+        Block& b = d_blocks[i];
+        if( b.data == 0 && ::posix_memalign((void**)&b.data, Align, d_blockSize) != 0 )
+        {
+            b.data = 0;
+            close();
+            return false;
+        }
+        if( b.vec == 0 )
+            b.vec = new iovec();
+        b.offset = 0;
+        b.len = 0;
+        b.kept = 0;
+        b.inFlight = 0;
+        b.drain = false;
+    }
+    d_cur = 0;
+    d_size = 0;
+    d_failed = false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+qint64 MidiUringOutput::write(const char* data, qint64 len)
+{
+    if( d_fd < 0 || d_failed )
+        return -1;
+    qint64 done = 0;
+    while( done < len )
+    {
+        Block& b = d_blocks[d_cur];
+        const quint32 n = qMin(qint64(d_blockSize - b.len), len - done);
+        ::memcpy(b.data + b.len, data + done, n);
+        b.len += n;
+        done += n;
+        d_size += n;
+        if( b.len == d_blockSize && ( !submit(b, false) || !next() ) )
+            break;
+    }
+    reap(false);
+    return d_failed ? -1 : done;
+}
+
+bool MidiUringOutput::flush()
+{
+    if( d_fd < 0 )
+        return false;
+    Block& b = d_blocks[d_cur];
+    if( b.len > b.kept && ( !submit(b, d_durability == DataSync) || !next() ) )
+        return false;
+    reap(false);
+    return !d_failed;
+}
+
+bool MidiUringOutput::submit(Block& b, bool sync)
+{
+#ifdef Q_OS_LINUX
+    quint32 len = b.len;
+    if( d_direct )
+    {
+        len = ( b.len + Align - 1 ) / Align * Align;
+        ::memset(b.data + b.len, 0, len - b.len);
+    }
+    b.vec->iov_base = b.data;
+    b.vec->iov_len = len;
+    const quint64 index = &b - d_blocks.data();
+    unsigned tail = *d_sqTail; // only this thread moves it
+    io_uring_sqe* sqe = (io_uring_sqe*)d_sqes + ( tail & *d_sqMask );
+    ::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = d_fd;
+    sqe->addr = (quint64)b.vec;
+    sqe->len = 1;
+    sqe->off = b.offset;
+    sqe->user_data = index * 2;
+    if( b.drain )
+        sqe->flags |= IOSQE_IO_DRAIN;
+    if( sync )
+        sqe->flags |= IOSQE_IO_LINK; // the fsync starts after the write
+    d_sqArray[tail & *d_sqMask] = tail & *d_sqMask;
+    tail++;
+    int count = 1;
+    if( sync )
+    {
+        sqe = (io_uring_sqe*)d_sqes + ( tail & *d_sqMask );
+        ::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = d_fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = index * 2 + 1;
+        d_sqArray[tail & *d_sqMask] = tail & *d_sqMask;
+        tail++;
+        count++;
+    }
+    __atomic_store_n(d_sqTail, tail, __ATOMIC_RELEASE);
+    b.inFlight += count;
+    if( uringEnter(d_ring, count, 0, 0) != count )
+    {
+        if( !d_failed )
+            qCritical() << "cannot submit write to" << d_path << strerror(errno);
+        d_failed = true;
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(b);
+    Q_UNUSED(sync);
+    return false;
+#endif
+}
+
+bool MidiUringOutput::reap(bool wait)
+{
+#ifdef Q_OS_LINUX
+    if( wait && uringEnter(d_ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR )
+    {
+        if( !d_failed )
+            qCritical() << "cannot wait for writes to" << d_path << strerror(errno);
+        d_failed = true;
+        return false;
+    }
+    unsigned head = *d_cqHead;
+    const unsigned tail = __atomic_load_n(d_cqTail, __ATOMIC_ACQUIRE);
+    for( ; head != tail; head++ )
+    {
+        const io_uring_cqe* cqe = (const io_uring_cqe*)d_cqes + ( head & *d_cqMask );
+        Block& b = d_blocks[cqe->user_data / 2];
+        b.inFlight--;
+        const bool write = ( cqe->user_data & 1 ) == 0;
+        if( ( cqe->res < 0 || ( write && size_t(cqe->res) != b.vec->iov_len ) ) && !d_failed )
+        {
+            qCritical() << "error writing to" << d_path << ( cqe->res < 0 ? strerror(-cqe->res) : "short write" );
+            d_failed = true;
+        }
+    }
+    __atomic_store_n(d_cqHead, head, __ATOMIC_RELEASE);
+    return !d_failed;
+#else
+    Q_UNUSED(wait);
+    return false;
+#endif
+}
+
+bool MidiUringOutput::next()
+{
+    // with O_DIRECT the unaligned end of the padded write is written again as the start of
+    // the next block, once the padded write is done
+    Block& b = d_blocks[d_cur];
+    const quint32 keep = d_direct ? b.len % Align : 0;
+    d_cur = ( d_cur + 1 ) % d_blocks.size();
+    Block& n = d_blocks[d_cur];
+    while( n.inFlight > 0 )
+        if( !reap(true) )
+            return false;
+    n.offset = b.offset + b.len - keep;
+    ::memcpy(n.data, b.data + b.len - keep, keep);
+    n.len = n.kept = keep;
+    n.drain = keep != 0;
+    return true;
+}
+
+void MidiUringOutput::close()
+{
+#ifdef Q_OS_LINUX
+    if( d_fd >= 0 && d_ring >= 0 && !d_failed )
+    {
+        Block& b = d_blocks[d_cur];
+        if( b.len > b.kept )
+            submit(b, false);
+        for( int i = 0; i < d_blocks.size(); i++ )
+            while( d_blocks[i].inFlight > 0 && reap(true) )
+                ;
+    }
+    if( d_fd >= 0 )
+    {
+        // the padding of the last direct write
+        if( ::ftruncate(d_fd, d_size) != 0 )
+            qCritical() << "cannot truncate" << d_path;
+        if( d_durability != NoSync )
+            dataSync(d_fd);
+        ::close(d_fd);
+        d_fd = -1;
+    }
+    if( d_sqes )
+        ::munmap(d_sqes, d_sqesLen);
+    if( d_cqMap && d_cqMap != d_sqMap )
+        ::munmap(d_cqMap, d_cqMapLen);
+    if( d_sqMap )
+        ::munmap(d_sqMap, d_sqMapLen);
+    d_sqes = d_cqMap = d_sqMap = 0;
+    if( d_ring >= 0 )
+        ::close(d_ring);
+    d_ring = -1;
+#endif
+}
+
+bool MidiUringOutput::remove()
+{
+    close();
+    return QFile::remove(d_path);
+}
+
+MidiQueueOutput::MidiQueueOutput(MidiOutput* inner, quint32 budget, Policy p, const QString& spillPath):
+    d_inner(inner),d_spillOut(spillPath),d_spillIn(spillPath),d_size(0),d_spillRead(0),d_spillWritten(0),
+    d_budget(budget),d_busy(0),d_maxFill(0),d_policy(p),d_flush(false),d_stop(false),d_failed(false),d_detached(false)
+{
+    d_queue.reserve(budget);
+}
+
+MidiQueueOutput::~MidiQueueOutput()
+{
+    stopThread();
+    if( d_spillOut.isOpen() )
+    {
+        d_spillOut.close();
+        d_spillIn.close();
+        d_spillOut.remove();
+    }
+    delete d_inner;
+}
+
+bool MidiQueueOutput::open()
+{
+    if( !d_inner->open() )
+        return false;
+    if( d_policy == Spill && ( !d_spillOut.open(QIODevice::WriteOnly) || !d_spillIn.open(QIODevice::ReadOnly) ) )
+    {
+        qWarning() << "cannot open spill file" << d_spillOut.fileName() << ", blocking instead";
+        d_spillOut.close();
+        d_policy = Block;
+    }
+    d_stop = false;
+    start(QThread::HighPriority);
+    return true;
+}
+
+qint64 MidiQueueOutput::write(const char* data, qint64 len)
+{
+    QMutexLocker lock(&d_lock);
+    if( d_detached )
+        return -1;
+    if( d_policy == Detach && d_queue.size() + d_busy > 0 && d_queue.size() + d_busy + len > d_budget )
+    {
+        // what is taken ends with a complete chunk, i.e. with complete cells
+        qCritical() << "giving up" << d_inner->fileName() << "after" << d_size << "bytes, it fell"
+                    << d_budget / 1024 << "KB behind";
+        d_detached = true;
+        d_failed = true;
+        return -1;
+    }
+    if( d_policy == Spill && ( d_spillRead < d_spillWritten || d_queue.size() + d_busy + len > d_budget ) )
+    {
+        // once spilling, everything goes to the spill file until the thread has caught up, so the order is kept
+        if( d_spillOut.write(data, len) == len && d_spillOut.flush() )
+        {
+            d_spillWritten += len;
+            d_size += len;
+            d_more.wakeOne();
+            return len;
+        }
+        qCritical() << "error writing to" << d_spillOut.fileName() << ", blocking instead";
+        d_policy = Block;
+    }
+    // a chunk larger than the budget is taken when the queue is empty
+    while( !d_stop && ( d_spillRead < d_spillWritten ||
+                        ( d_queue.size() + d_busy > 0 && d_queue.size() + d_busy + len > d_budget ) ) )
+        d_room.wait(&d_lock);
+    d_queue.append(data, len);
+    d_size += len;
+    d_maxFill = qMax(d_maxFill, quint32(d_queue.size() + d_busy));
+    d_more.wakeOne();
+    return len;
+}
+
+bool MidiQueueOutput::flush()
+{
+    QMutexLocker lock(&d_lock);
+    d_flush = true;
+    d_more.wakeOne();
+    return !d_failed;
+}
+
+void MidiQueueOutput::close()
+{
+    stopThread();
+    d_inner->close();
+}
+
+bool MidiQueueOutput::closeWithin(unsigned long msecs)
+{
+    d_lock.lock();
+    d_stop = true;
+    d_more.wakeOne();
+    d_lock.unlock();
+    if( !wait(msecs) )
+    {
+        QMutexLocker lock(&d_lock);
+        d_detached = true;
+        d_failed = true;
+        return false;
+    }
+    d_inner->close();
+    return true;
+}
+
+qint64 MidiQueueOutput::size() const
+{
+    QMutexLocker lock(&d_lock);
+    return d_size;
+}
+
+bool MidiQueueOutput::remove()
+{
+    stopThread();
+    return d_inner->remove();
+}
+
+qint64 MidiQueueOutput::room() const
+{
+    QMutexLocker lock(&d_lock);
+    if( d_spillRead < d_spillWritten )
+        return 0;
+    return qMax(qint64(0), qint64(d_budget) - d_queue.size() - d_busy);
+}
+
+quint32 MidiQueueOutput::fetchFill()
+{
+    QMutexLocker lock(&d_lock);
+    const quint32 res = qMax(d_maxFill, quint32(d_queue.size() + d_busy));
+    d_maxFill = 0;
+    return res;
+}
+
+qint64 MidiQueueOutput::spilled() const
+{
+    QMutexLocker lock(&d_lock);
+    return d_spillWritten - d_spillRead;
+}
+
+bool MidiQueueOutput::failed() const
+{
+    QMutexLocker lock(&d_lock);
+    return d_failed;
+}
+
+void MidiQueueOutput::stopThread()
+{
+    d_lock.lock();
+    d_stop = true;
+    d_more.wakeOne();
+    d_lock.unlock();
+    wait();
+}
+
+void MidiQueueOutput::run()
+{
+    QByteArray buf;
+    buf.reserve(d_budget);
+    d_lock.lock();
+    while( true )
+    {
+        while( d_queue.isEmpty() && d_spillRead == d_spillWritten && !d_flush && !d_stop )
+            d_more.wait(&d_lock);
+        // the spill file is only read when the queue is empty, because everything in it is younger
+        const bool spill = d_queue.isEmpty() && d_spillRead < d_spillWritten;
+        if( !spill && d_queue.isEmpty() && !d_flush )
+            break; // stopped and done
+        const bool flush = d_flush && !spill;
+        if( flush )
+            d_flush = false;
+        const qint64 from = d_spillRead;
+        const qint64 len = qMin(qint64(ChunkSize), d_spillWritten - d_spillRead);
+        if( !spill )
+        {
+            buf.resize(0);
+            qSwap(buf, d_queue);
+            d_busy = buf.size();
+        }
+        d_lock.unlock();
+        if( spill && ( !d_spillIn.seek(from) || ( buf = d_spillIn.read(len) ).size() != len ) )
+        {
+            qCritical() << "error reading" << d_spillIn.fileName();
+            buf.clear();
+        }
+        const bool failed = !buf.isEmpty() && d_inner->write(buf.constData(), buf.size()) != buf.size();
+        if( flush )
+            d_inner->flush();
+        d_lock.lock();
+        if( failed && !d_failed )
+        {
+            qCritical() << "error writing to" << d_inner->fileName();
+            d_failed = true;
+        }
+        if( spill )
+        {
+            d_spillRead = buf.isEmpty() ? d_spillWritten : d_spillRead + buf.size();
+            if( d_spillRead == d_spillWritten )
+            {
+                // caught up; start over with an empty file
+                d_spillOut.resize(0);
+                d_spillOut.seek(0);
+                d_spillRead = d_spillWritten = 0;
+            }
+        }else
+            d_busy = 0;
+        d_room.wakeAll();
+    }
+    d_lock.unlock();
+}
+
+MidiMirrorOutput::MidiMirrorOutput(MidiOutput* primary, MidiQueueOutput* mirror):
+    d_primary(primary),d_mirror(mirror),d_primaryFailed(0),d_mirrorOpen(false),d_mirrorHung(false)
+{
+}
+
+MidiMirrorOutput::~MidiMirrorOutput()
+{
+    if( !d_mirrorHung )
+        delete d_mirror; // otherwise its thread still uses it
+    delete d_primary;
+}
+
+bool MidiMirrorOutput::open()
+{
+    if( !d_primary->open() )
+        return false;
+    d_mirrorOpen = d_mirror->open();
+    if( !d_mirrorOpen )
+        qCritical() << "cannot open mirror" << d_mirror->fileName() << ", recording without";
+    return true;
+}
+
+qint64 MidiMirrorOutput::write(const char* data, qint64 len)
+{
+    if( d_mirrorOpen )
+        d_mirror->write(data, len); // doesn't wait, see MidiQueueOutput::Detach
+    const qint64 res = d_primary->write(data, len);
+    if( res != len )
+        d_primaryFailed.store(1);
+    return res;
+}
+
+bool MidiMirrorOutput::flush()
+{
+    if( d_mirrorOpen )
+        d_mirror->flush();
+    const bool res = d_primary->flush();
+    if( !res )
+        d_primaryFailed.store(1);
+    return res;
+}
+
+void MidiMirrorOutput::close()
+{
+    d_primary->close();
+    closeMirror();
+}
+
+bool MidiMirrorOutput::closeMirror()
+{
+    if( !d_mirrorOpen )
+        return false;
+    if( d_mirror->closeWithin(CloseTimeout) )
+        return true;
+    // e.g. a network share which doesn't answer; the recording is complete on the primary
+    qCritical() << "giving up" << d_mirror->fileName() << ", still not written after"
+                << CloseTimeout / 1000 << "s";
+    d_mirrorOpen = false;
+    d_mirrorHung = true;
+    return false;
+}
+
+bool MidiMirrorOutput::remove()
+{
+    const bool res = d_primary->remove();
+    if( closeMirror() )
+        d_mirror->remove();
+    return res;
+}
+
+void MidiMirrorOutput::syncPoint(quint64 time)
+{
+    d_primary->syncPoint(time);
+    if( d_mirrorOpen )
+        d_mirror->syncPoint(time);
+}
+
+MidiPrerollOutput::MidiPrerollOutput(quint32 budgetMB, quint32 windowSecs):
+    d_first(0),d_count(0),d_window(windowSecs * 1000000ULL),d_target(0),d_written(0)
+{
+    // all memory is taken now, so that the footprint doesn't grow however long it runs
+    d_blocks.resize(qMax(2ULL, budgetMB * 1024ULL * 1024 / ( BlockSize + 4096 )));
+    for( int i = 0; i < d_blocks.size(); i++ )
+        d_blocks[i].data.reserve(BlockSize + 4096);
+}
+
+MidiPrerollOutput::~MidiPrerollOutput()
+{
+    delete d_target;
+}
+
+qint64 MidiPrerollOutput::write(const char* data, qint64 len)
+{
+    d_lock.lock();
+    if( d_target == 0 )
+    {
+        // before the first sync point, there is nothing to read it with
+        if( d_count )
+            d_blocks[( d_first + d_count - 1 ) % d_blocks.size()].data.append(data, len);
+        d_lock.unlock();
+        return len;
+    }
+    d_lock.unlock();
+    if( !drain() )
+        return -1;
+    const qint64 res = d_target->write(data, len);
+    if( res > 0 )
+        d_written.fetchAndAddOrdered(res);
+    return res;
+}
+
+bool MidiPrerollOutput::drain()
+{
+    QList<QByteArray> pending;
+    d_lock.lock();
+    pending.swap(d_pending);
+    d_lock.unlock();
+    bool ok = true;
+    for( int i = 0; i < pending.size(); i++ )
+    {
+        const qint64 res = d_target->write(pending[i].constData(), pending[i].size());
+        if( res > 0 )
+            d_written.fetchAndAddOrdered(res);
+        ok = res == pending[i].size() && ok;
+    }
+    if( !ok )
+        qCritical() << "error writing the pre-roll to" << d_target->fileName();
+    return ok;
+}
+
+bool MidiPrerollOutput::flush()
+{
+    if( !isCommitted() )
+        return true;
+    const bool ok = drain();
+    return d_target->flush() && ok;
+}
+
+void MidiPrerollOutput::close()
+{
+    if( !isCommitted() )
+        return;
+    drain();
+    d_target->close();
+}
+
+qint64 MidiPrerollOutput::size() const
+{
+    QMutexLocker lock(&d_lock);
+    return d_target ? d_target->size() : 0;
+}
+
+QString MidiPrerollOutput::fileName() const
+{
+    QMutexLocker lock(&d_lock);
+    return d_target ? d_target->fileName() : QString();
+}
+
+bool MidiPrerollOutput::remove()
+{
+    QMutexLocker lock(&d_lock);
+    d_count = 0;
+    return d_target ? d_target->remove() : true;
+}
+
+qint64 MidiPrerollOutput::room() const
+{
+    QMutexLocker lock(&d_lock);
+    return d_target ? d_target->room() : -1;
+}
+
+void MidiPrerollOutput::syncPoint(quint64 time)
+{
+    QMutexLocker lock(&d_lock);
+    if( d_target )
+        return;
+    // drop the oldest blocks if all are used or if the next one starts before the window
+    while( d_count == d_blocks.size() || ( d_window && d_count > 1 &&
+                                            d_blocks[( d_first + 1 ) % d_blocks.size()].start + d_window <= time ) )
+    {
+        d_first = ( d_first + 1 ) % d_blocks.size();
+        d_count--;
+    }
+    Block& b = d_blocks[( d_first + d_count ) % d_blocks.size()];
+    b.data.resize(0); // keeps the capacity
+    b.start = time;
+    d_count++;
+}
+
+bool MidiPrerollOutput::commit(MidiOutput* target, const QByteArray& header)
+{
+    QMutexLocker lock(&d_lock);
+    if( d_target )
+        return false;
+    d_target = target;
+    // the oldest block starts with a sync point, so the stream starts at its time; the blocks
+    // are shared, not copied, and written by the writer thread so it doesn't wait for us
+    QByteArray h = header;
+    h += MidiStream::timeBaseRecord(d_count ? d_blocks[d_first].start : 0);
+    h += char(0); // end of extension records
+    d_pending.append(h);
+    for( int i = 0; i < d_count; i++ )
+        d_pending.append(d_blocks[( d_first + i ) % d_blocks.size()].data);
+    d_count = 0;
+    d_blocks.clear(); // not needed anymore
+    return true;
+}
+
+bool MidiPrerollOutput::isCommitted() const
+{
+    QMutexLocker lock(&d_lock);
+    return d_target != 0;
+}
+
+quint64 MidiPrerollOutput::bufferedUsecs() const
+{
+    QMutexLocker lock(&d_lock);
+    if( d_count < 2 )
+        return 0;
+    return d_blocks[( d_first + d_count - 1 ) % d_blocks.size()].start - d_blocks[d_first].start;
+}
+
+int MidiPrerollOutput::fetchWritten()
+{
+    return d_written.fetchAndStoreOrdered(0);
+}
+
+MidiSegmentDevice::MidiSegmentDevice(const QString& path):d_path(path),d_size(0),d_cur(0)
+{
+}
+
+MidiSegmentDevice::~MidiSegmentDevice()
+{
+    close();
+}
+
+bool MidiSegmentDevice::open(QIODevice::OpenMode mode)
+{
+    if( mode != QIODevice::ReadOnly )
+        return false;
+    const QStringList names = MidiSegmentOutput::segments(d_path);
+    d_size = 0;
+    for( int i = 0; i < names.size(); i++ )
+    {
+        QFile* f = new QFile(names[i]);
+        if( !f->open(QIODevice::ReadOnly) )
+        {
+            delete f;
+            if( i == 0 )
+                return false;
+            break;
+        }
+        d_files.append(f);
+        d_starts.append(d_size);
+        d_size += f->size();
+    }
+    d_cur = 0;
+    return QIODevice::open(mode);
+}
+
+void MidiSegmentDevice::close()
+{
+    for( int i = 0; i < d_files.size(); i++ )
+        delete d_files[i];
+    d_files.clear();
+    d_starts.clear();
+    d_size = 0;
+    QIODevice::close();
+}
+
+bool MidiSegmentDevice::select(qint64 pos)
+{
+    int i = d_files.size() - 1;
+    while( i > 0 && d_starts[i] > pos )
+        i--;
+    if( i < 0 )
+        return false;
+    d_cur = i;
+    return d_files[i]->seek(pos - d_starts[i]);
+}
+
+bool MidiSegmentDevice::seek(qint64 pos)
+{
+    if( !QIODevice::seek(pos) )
+        return false;
+    return select(pos);
+}
+
+bool MidiSegmentDevice::atPadding()
+{
+    const QByteArray next = peek(3);
+    return next.size() == 3 && next[0] == 0 && next[1] == 0 && next[2] == 0;
+}
+
+qint64 MidiSegmentDevice::readData(char* data, qint64 maxlen)
+{
+    qint64 done = 0;
+    while( done < maxlen && d_cur < d_files.size() )
+    {
+        const qint64 n = d_files[d_cur]->read(data + done, maxlen - done);
+        if( n < 0 )
+            return done > 0 ? done : -1;
+        done += n;
+        if( n == 0 || d_files[d_cur]->atEnd() )
+        {
+            if( d_cur + 1 >= d_files.size() )
+                break;
+            d_cur++;
+            d_files[d_cur]->seek(0);
+        }
+    }
+    return done;
+}
@@ -0,0 +1,319 @@
+#ifndef _MIDIOUTPUT_H
+#define _MIDIOUTPUT_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QFile>
+#include <QStringList>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
+
+// Destination of the .midisink byte stream; only used by one thread at a time.
+class MidiOutput
+{
+public:
+    enum Durability { NoSync, DataSync, OpenDSync }; // OpenDSync: file opened with O_DSYNC
+
+    virtual ~MidiOutput() {}
+    virtual bool open() = 0;
+    virtual qint64 write(const char* data, qint64 len) = 0;
+    virtual bool flush() = 0; // hand everything written so far to the OS, durably if so configured
+    virtual void close() = 0;
+    virtual qint64 size() const = 0; // logical size of the stream
+    virtual QString fileName() const = 0;
+    virtual bool remove() = 0; // close and delete all files
+    virtual qint64 room() const { return -1; } // bytes write() takes without waiting, -1 if unknown
+    // the stream can be read by itself from here on with all track times relative to time;
+    // see MidiWriter::setSyncInterval
+    virtual void syncPoint(quint64 time) { Q_UNUSED(time); }
+};
+
+// Buffered QFile, optionally with fdatasync or O_DSYNC.
+class MidiFileOutput : public MidiOutput
+{
+public:
+    MidiFileOutput(const QString& path, Durability d = NoSync);
+    bool open();
+    qint64 write(const char* data, qint64 len);
+    bool flush();
+    void close();
+    qint64 size() const;
+    QString fileName() const { return d_out.fileName(); }
+    bool remove();
+private:
+    QFile d_out;
+    Durability d_durability;
+};
+
+// Writes the stream into a chain of preallocated, memory mapped segments of fixed size:
+// path, path.1, path.2 etc. Cells are appended with plain stores and may span segments;
+// on close the last segment is truncated to the logical size.
+class MidiSegmentOutput : public MidiOutput
+{
+public:
+    MidiSegmentOutput(const QString& path, qint64 segmentSize, Durability d = NoSync);
+    ~MidiSegmentOutput();
+    bool open();
+    qint64 write(const char* data, qint64 len);
+    bool flush();
+    void close();
+    qint64 size() const { return d_done + d_pos; }
+    QString fileName() const { return d_path; }
+    bool remove();
+
+    static QString segmentName(const QString& path, int index);
+    static QStringList segments(const QString& path); // existing segments of a chain, first is path
+protected:
+    bool openSegment();
+    void closeSegment(bool truncate);
+private:
+    QString d_path;
+    qint64 d_segSize;
+    qint64 d_done; // bytes in the closed segments
+    qint64 d_pos; // in the current segment
+    qint64 d_synced;
+    uchar* d_map;
+    int d_fd;
+    int d_index;
+    Durability d_durability;
+};
+
+struct iovec;
+
+// Linux io_uring: write() fills aligned memory blocks which are submitted as they are full and
+// on flush(); the writer only waits if the next block is still in flight. With direct the file is
+// opened with O_DIRECT and the writes are padded to Align; close() truncates to the logical size.
+// DataSync links an fdatasync to the write of each flush. See isAvailable() for the fallback.
+class MidiUringOutput : public MidiOutput
+{
+public:
+    enum { Align = 4096, DefaultBlockSize = 256 * 1024 };
+
+    MidiUringOutput(const QString& path, Durability d = NoSync, bool direct = false,
+                    int blockCount = 2, quint32 blockSize = DefaultBlockSize);
+    ~MidiUringOutput();
+    bool open();
+    qint64 write(const char* data, qint64 len);
+    bool flush();
+    void close();
+    qint64 size() const { return d_size; }
+    QString fileName() const { return d_path; }
+    bool remove();
+
+    static bool isAvailable(); // the kernel has io_uring and we may use it
+protected:
+    struct Block
+    {
+        char* data; // Align aligned
+        qint64 offset; // in the file, Align aligned if direct
+        quint32 len;
+        quint32 kept; // bytes of the last padded write of the previous block, written again
+        int inFlight; // write and fsync operations
+        bool drain; // the write overlaps the one of the previous block and must wait for it
+        iovec* vec; // must live until the write completes
+    };
+    bool submit(Block& b, bool sync);
+    bool reap(bool wait);
+    bool next(); // the current block was submitted, continue in the next one
+private:
+    QString d_path;
+    QVector<Block> d_blocks;
+    int d_cur;
+    quint32 d_blockSize;
+    qint64 d_size;
+    Durability d_durability;
+    bool d_direct;
+    bool d_failed;
+    int d_fd;
+    int d_ring;
+    // the mapped rings, see io_uring_setup(2)
+    void* d_sqMap;
+    size_t d_sqMapLen;
+    void* d_cqMap;
+    size_t d_cqMapLen;
+    void* d_sqes;
+    size_t d_sqesLen;
+    unsigned* d_sqHead;
+    unsigned* d_sqTail;
+    unsigned* d_sqMask;
+    unsigned* d_sqArray;
+    unsigned* d_cqHead;
+    unsigned* d_cqTail;
+    unsigned* d_cqMask;
+    void* d_cqes;
+};
+
+// Decouples the writer from a stalling disk: write() appends to a memory queue of bounded size
+// which a thread of its own hands to the inner output. If the queue is full, write() waits (Block),
+// or continues in a spill file on another path until the thread has caught up (Spill), or gives
+// the output up, which then ends after the last chunk taken (Detach).
+class MidiQueueOutput : public QThread, public MidiOutput
+{
+public:
+    enum Policy { Block, Spill, Detach };
+    enum { ChunkSize = 64 * 1024 }; // read from the spill file at once
+
+    MidiQueueOutput(MidiOutput* inner, quint32 budget, Policy p = Block, const QString& spillPath = QString());
+    ~MidiQueueOutput(); // deletes inner
+    bool open();
+    qint64 write(const char* data, qint64 len);
+    bool flush(); // doesn't wait; the inner output is flushed once everything written before is with it
+    void close(); // waits until everything is written
+    // false if the thread is still writing after msecs; it is then detached and must not be deleted
+    bool closeWithin(unsigned long msecs);
+    qint64 size() const;
+    QString fileName() const { return d_inner->fileName(); }
+    bool remove();
+    qint64 room() const;
+
+    quint32 budget() const { return d_budget; }
+    quint32 fetchFill(); // max bytes in memory since the last call
+    qint64 spilled() const; // bytes in the spill file not yet written
+    bool failed() const; // write error or detached
+protected:
+    void run();
+    void stopThread();
+private:
+    MidiOutput* d_inner;
+    QFile d_spillOut; // appended by write()
+    QFile d_spillIn; // read by the thread
+    mutable QMutex d_lock;
+    QWaitCondition d_more; // for the thread
+    QWaitCondition d_room; // for write()
+    QByteArray d_queue;
+    qint64 d_size; // all bytes taken by write()
+    qint64 d_spillRead;
+    qint64 d_spillWritten;
+    quint32 d_budget;
+    quint32 d_busy; // taken from the queue by the thread and not yet written
+    quint32 d_maxFill;
+    Policy d_policy;
+    bool d_flush;
+    bool d_stop;
+    bool d_failed;
+    bool d_detached;
+};
+
+// Writes the stream to a primary output and a mirror, e.g. on another disk; the mirror has a
+// thread and a buffer of its own and is detached when it falls behind, so it never stalls the
+// primary. Both get the same header with the same Session record.
+class MidiMirrorOutput : public MidiOutput
+{
+public:
+    enum { CloseTimeout = 10000 }; // ms the mirror may take to write what is left when closing
+
+    MidiMirrorOutput(MidiOutput* primary, MidiQueueOutput* mirror); // takes ownership
+    ~MidiMirrorOutput();
+    bool open(); // fails only if the primary fails
+    qint64 write(const char* data, qint64 len);
+    bool flush();
+    void close();
+    qint64 size() const { return d_primary->size(); }
+    QString fileName() const { return d_primary->fileName(); }
+    bool remove();
+    qint64 room() const { return d_primary->room(); }
+    void syncPoint(quint64 time);
+
+    MidiQueueOutput* mirror() const { return d_mirror; }
+    bool primaryFailed() const { return d_primaryFailed.load(); }
+    bool mirrorFailed() const { return !d_mirrorOpen || d_mirror->failed(); }
+private:
+    bool closeMirror(); // false if not open or hung
+    MidiOutput* d_primary;
+    MidiQueueOutput* d_mirror;
+    QAtomicInt d_primaryFailed;
+    bool d_mirrorOpen;
+    bool d_mirrorHung; // left behind by close()
+};
+
+// Keeps the last minutes of a stream in a fixed number of memory blocks, each starting at a
+// sync point, and drops the oldest block when a new one is needed. commit() hands a header and
+// the kept blocks to a real output; the writer thread writes them with its next write() or
+// flush(), followed by everything else.
+class MidiPrerollOutput : public MidiOutput
+{
+public:
+    enum { BlockSize = 64 * 1024, SyncInterval = BlockSize - 4096 }; // the writer may overshoot a bit
+
+    MidiPrerollOutput(quint32 budgetMB, quint32 windowSecs = 0); // 0: as much as fits
+    ~MidiPrerollOutput(); // deletes the target
+    bool open() { return true; }
+    qint64 write(const char* data, qint64 len);
+    bool flush();
+    void close();
+    qint64 size() const; // 0 until committed
+    QString fileName() const;
+    bool remove();
+    qint64 room() const;
+    void syncPoint(quint64 time);
+
+    // target must be open; takes ownership. header ends with the extension records, commit()
+    // adds the TimeBase of the oldest block and terminates them
+    bool commit(MidiOutput* target, const QByteArray& header);
+    bool isCommitted() const;
+    quint64 bufferedUsecs() const; // up to the start of the newest block
+    int fetchWritten(); // bytes which went to the target since the last call
+private:
+    bool drain();
+    struct Block
+    {
+        QByteArray data;
+        quint64 start;
+        Block():start(0){}
+    };
+    QVector<Block> d_blocks; // ring
+    int d_first;
+    int d_count;
+    quint64 d_window; // us
+    MidiOutput* d_target; // once set, only the writer thread writes to it
+    QList<QByteArray> d_pending; // header and blocks handed over by commit()
+    QAtomicInt d_written;
+    mutable QMutex d_lock; // commit() comes from another thread than the writer
+};
+
+// Reads a segment chain (or a plain file) as one random access stream.
+class MidiSegmentDevice : public QIODevice
+{
+public:
+    MidiSegmentDevice(const QString& path);
+    ~MidiSegmentDevice();
+    bool open(OpenMode);
+    void close();
+    qint64 size() const { return d_size; }
+    bool seek(qint64 pos);
+    QString fileName() const { return d_path; }
+
+    // true if the rest of the stream is the zero padding of an unfinished segment
+    bool atPadding();
+protected:
+    qint64 readData(char* data, qint64 maxlen);
+    qint64 writeData(const char*, qint64) { return -1; }
+    bool select(qint64 pos);
+private:
+    QString d_path;
+    QList<QFile*> d_files;
+    QList<qint64> d_starts;
+    qint64 d_size;
+    int d_cur;
+};
+
+#endif // _MIDIOUTPUT_H
@@ -0,0 +1,252 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiReader.h"
+#include "MidiOutput.h"
+#include "MidiSmf.h"
+#include <QFile>
+#include <QBuffer>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+MidiReader::MidiReader():d_begin(0),d_cur(0),d_end(0),d_released(0),d_map(0),d_mapLen(0),d_smf(0),d_failed(false)
+{
+}
+
+MidiReader::~MidiReader()
+{
+    close();
+}
+
+bool MidiReader::open(const QString& path)
+{
+    close();
+    if( MidiSmfReader::isSmf(path) )
+    {
+        // the merged tracks of the file in microseconds
+        d_smf = new MidiSmfReader();
+        if( !d_smf->open(path) )
+        {
+            close();
+            return false;
+        }
+        d_header = MidiStream::Header();
+        d_header.unit = 1;
+        d_failed = false;
+        return true;
+    }
+    const QStringList files = MidiSegmentOutput::segments(path);
+    QList<qint64> sizes;
+    qint64 total = 0;
+    for( int i = 0; i < files.size(); i++ )
+    {
+        sizes << QFile(files[i]).size();
+        total += sizes.last();
+    }
+    if( total == 0 )
+        return false;
+    // reserve one range and map the segments into it, so cells spanning segments are contiguous;
+    // all but the last segment have a size of a multiple of the page size
+    const size_t page = ::sysconf(_SC_PAGESIZE);
+    d_mapLen = ( total + page - 1 ) / page * page;
+    d_map = ::mmap(0, d_mapLen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( d_map == MAP_FAILED )
+    {
+        d_map = 0;
+        return false;
+    }
+    qint64 offset = 0;
+    for( int i = 0; i < files.size(); i++ )
+    {
+        if( offset % page != 0 )
+        {
+            close();
+            return false;
+        }
+        const int fd = ::open(QFile::encodeName(files[i]).constData(), O_RDONLY);
+        if( fd < 0 )
+        {
+            close();
+            return false;
+        }
+        void* p = sizes[i] == 0 ? 0 : ::mmap((char*)d_map + offset, sizes[i], PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0);
+        ::close(fd);
+        if( p == MAP_FAILED )
+        {
+            close();
+            return false;
+        }
+        offset += sizes[i];
+    }
+    ::madvise(d_map, d_mapLen, MADV_SEQUENTIAL);
+    d_begin = d_released = (const quint8*)d_map;
+    d_end = d_begin + total;
+
+    QBuffer in;
+    in.setData(QByteArray::fromRawData((const char*)d_begin, total));
+    if( !in.open(QIODevice::ReadOnly) || !MidiStream::readHeader(&in, d_header) )
+    {
+        close();
+        return false;
+    }
+    d_cur = d_begin + in.pos();
+    d_failed = false;
+    return true;
+}
+
+void MidiReader::close()
+{
+    if( d_map )
+        ::munmap(d_map, d_mapLen);
+    d_map = 0;
+    d_mapLen = 0;
+    d_begin = d_cur = d_end = d_released = 0;
+    delete d_smf;
+    d_smf = 0;
+}
+
+bool MidiReader::seek(quint64 offset)
+{
+    if( d_smf || offset > size() )
+        return false;
+    d_cur = d_begin + offset;
+    if( d_cur < d_released )
+        d_released = d_begin + offset / ::sysconf(_SC_PAGESIZE) * ::sysconf(_SC_PAGESIZE);
+    for( int i = 0; i < 256; i++ )
+        d_states[i] = MidiCompactState();
+    d_failed = false;
+    return true;
+}
+
+static inline int dataLen(quint8 status)
+{
+    switch( status )
+    {
+    case 0xf2: // song position
+        return 2;
+    case 0xf1: // time code
+    case 0xf3: // song select
+        return 1;
+    default:
+        if( status >= 0xf0 )
+            return 0; // other system messages have no data
+        if( ( status >> 4 ) == 0xc || ( status >> 4 ) == 0xd )
+            return 1;
+        return 2;
+    }
+}
+
+bool MidiReader::next(Event& e)
+{
+    if( d_smf )
+    {
+        if( d_smf->next(e) )
+            return true;
+        d_failed = d_smf->failed();
+        return false;
+    }
+    const quint8* p = d_cur;
+    const quint8* const end = d_end;
+    if( p >= end )
+        return false;
+    quint8 status = 0;
+    if( d_header.compact() )
+    {
+        if( !MidiCodec::expandHeader(p, end, d_states, e.delta, e.track, status) )
+            p = 0;
+        else if( status == 0 ) // otherwise running status
+            status = p < end ? *p++ : 0;
+    }else
+    {
+        e.delta = MidiCodec::fromVarLen(p, end);
+        e.track = p < end ? *p++ : 0;
+        status = p < end ? *p++ : 0;
+    }
+    if( p && status == 0xff )
+    {
+        e.kind = Meta;
+        e.type = p < end ? *p++ : 0;
+        e.size = MidiCodec::fromVarLen(p, end);
+        e.data = p;
+        e.len = 0;
+        if( e.size > quint32(end - p) )
+            p = 0;
+        else
+        {
+            p += e.size;
+            if( e.type == 0x03 )
+                d_states[e.track] = MidiCompactState(); // see MidiCodec::compactCell
+        }
+    }else if( p && ( status == 0xf0 || status == 0xf7 ) )
+    {
+        e.kind = Sysex;
+        e.type = status;
+        e.size = MidiCodec::fromVarLen(p, end);
+        e.data = p;
+        e.len = 0;
+        if( e.size > quint32(end - p) )
+            p = 0;
+        else
+            p += e.size;
+    }else if( p && ( status & 0x80 ) )
+    {
+        const int n = dataLen(status);
+        if( n > end - p )
+            p = 0;
+        else
+        {
+            e.kind = Message;
+            e.type = 0;
+            e.msg[0] = status;
+            if( n > 0 )
+                e.msg[1] = p[0];
+            if( n > 1 )
+                e.msg[2] = p[1];
+            e.len = 1 + n;
+            e.size = 0;
+            e.data = 0;
+            p += n;
+        }
+    }else
+        p = 0; // running status isn't supported in plain cells
+    if( p == 0 )
+    {
+        // the zero padding of an unfinished segment chain or file ends the stream
+        for( p = d_cur; p < end && *p == 0; p++ )
+            ;
+        d_failed = p < end;
+        d_cur = end;
+        return false;
+    }
+    d_cur = p;
+    if( d_cur - d_released >= ReleaseBytes )
+        release();
+    return true;
+}
+
+void MidiReader::release()
+{
+    // MADV_SEQUENTIAL only makes the pages behind cheap to reclaim, they still count as resident;
+    // the file pages are read again if the reader seeks back
+    const size_t page = ::sysconf(_SC_PAGESIZE);
+    const quint8* to = d_begin + ( d_cur - d_begin ) / page * page;
+    ::madvise((void*)d_released, to - d_released, MADV_DONTNEED);
+    d_released = to;
+}
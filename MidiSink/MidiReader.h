@@ -0,0 +1,118 @@
+#ifndef _MIDIREADER_H
+#define _MIDIREADER_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiStream.h"
+#include "MidiCodec.h"
+
+class MidiSmfReader;
+
+// Sequential reader of a .midisink stream (or segment chain) without per event allocations:
+// the files are mapped into one contiguous view and the cells decoded with a pointer cursor
+// into an Event which points into the mapping. Replaces MidiStream::readCell where speed matters.
+// Also reads MIDI files through MidiSmfReader, though without seek(), pos() and size().
+class MidiReader
+{
+public:
+    enum Kind { Message, Meta, Sysex };
+    struct Event
+    {
+        quint32 delta;
+        quint8 track;
+        quint8 kind;
+        quint8 type; // meta type, or 0xf0/0xf7 for a SysEx chunk
+        quint8 len; // of msg
+        quint8 msg[3]; // channel and system messages incl. status, even if the cell has running status
+        quint32 size; // of data
+        const quint8* data; // meta and SysEx payload, valid while the reader is open
+    };
+
+    // The absolute time of each track as MidiStream::readStream computes it: the name cells of
+    // a sync point bring the tracks to the start, a track first seen after them counts from start;
+    // an End of Track cell (port closed) makes the next cell of the track count as first seen.
+    struct Clock
+    {
+        quint64 times[256]; // in units
+        quint64 bases[256];
+        bool seen[256];
+        quint64 start; // e.g. Header::timeBase or Take::start
+        bool leading; // still in the name cells the stream or take starts with
+        Clock(quint64 s = 0):start(s),leading(true)
+        {
+            ::memset(times, 0, sizeof(times));
+            ::memset(bases, 0, sizeof(bases));
+            ::memset(seen, 0, sizeof(seen));
+        }
+        // sets time in units since the start; false if a track doesn't start with a meta cell
+        bool advance(const Event& e, quint64& time)
+        {
+            const bool meta = e.kind == Meta;
+            if( !meta || e.type != 0x03 )
+                leading = false;
+            if( !seen[e.track] )
+            {
+                if( !meta )
+                    return false;
+                seen[e.track] = true;
+                bases[e.track] = leading ? 0 : start;
+            }
+            times[e.track] += e.delta;
+            time = times[e.track] > bases[e.track] ? times[e.track] - bases[e.track] : 0;
+            if( meta && e.type == 0x2f )
+            {
+                seen[e.track] = false;
+                times[e.track] = 0;
+            }
+            return true;
+        }
+    };
+
+    MidiReader();
+    ~MidiReader();
+    bool open(const QString& path); // maps the stream and reads the header; or a MIDI file
+    bool isSmf() const { return d_smf != 0; }
+    void close();
+    const MidiStream::Header& header() const { return d_header; }
+
+    bool next(Event& e); // false at the end of the stream or of the data; see failed()
+    bool failed() const { return d_failed; } // an invalid or truncated cell stopped next()
+    bool seek(quint64 offset); // e.g. a take; must be at a cell, the states are reset
+    // the compact state of a track, to continue at a cell other than a name cell, see MidiIndex
+    const MidiCompactState& state(quint8 track) const { return d_states[track]; }
+    void setState(quint8 track, const MidiCompactState& s) { d_states[track] = s; }
+    quint64 pos() const { return d_cur - d_begin; }
+    quint64 size() const { return d_end - d_begin; }
+private:
+    enum { ReleaseBytes = 4 * 1024 * 1024 }; // pages already read are dropped in chunks of this size
+    void release();
+    MidiStream::Header d_header;
+    MidiCompactState d_states[256];
+    const quint8* d_begin;
+    const quint8* d_cur;
+    const quint8* d_end;
+    const quint8* d_released; // page aligned, the pages before are given back
+    void* d_map;
+    size_t d_mapLen;
+    MidiSmfReader* d_smf;
+    bool d_failed;
+};
+
+#endif // _MIDIREADER_H
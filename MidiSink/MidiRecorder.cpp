@@ -0,0 +1,139 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+// Headless recorder: streams all MIDI in ports to a .midisink file like MidiSink, but without
+// widgets and without an event loop; prints statistics to stdout and stops on SIGTERM/SIGINT.
+
+#include "MidiEngine.h"
+#include "MidiClock.h"
+#include "MidiStream.h"
+#include <QCoreApplication>
+#include <QStringList>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t s_stop = 0;
+static volatile sig_atomic_t s_commit = 0;
+
+static void onSignal(int)
+{
+    s_stop = 1;
+}
+
+static void onCommit(int)
+{
+    s_commit = 1;
+}
+
+int main(int argc, char ** argv)
+{
+    const quint64 launch = MidiClock::monotonic();
+    QCoreApplication a(argc,argv);
+    // the same settings as the monitor
+    a.setOrganizationName("me@rochus-keller.ch");
+    a.setOrganizationDomain("github.com/rochus-keller/MusicTools");
+    a.setApplicationName("MidiSink");
+
+    struct sigaction sa;
+    sa.sa_handler = onSignal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGTERM, &sa, 0);
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGHUP, &sa, 0);
+    sa.sa_handler = onCommit;
+    sigaction(SIGUSR1, &sa, 0); // starts the file with the pre-roll
+
+    // MidiRecorder -verify a.midisink b.midisink: checks a mirror against its primary
+    const int verify = a.arguments().indexOf("-verify");
+    if( verify > 0 )
+    {
+        if( a.arguments().size() < verify + 3 )
+        {
+            fprintf(stderr, "usage: MidiRecorder -verify <file> <mirror>\n");
+            return -1;
+        }
+        QString result;
+        const bool ok = MidiStream::verifyMirror(a.arguments()[verify + 1], a.arguments()[verify + 2], result);
+        printf("%s\n", result.toUtf8().constData());
+        return ok ? 0 : 1;
+    }
+
+    const bool quiet = a.arguments().contains("-q");
+    const bool verbose = a.arguments().contains("-v"); // per port statistics
+
+    MidiEngine* eng = 0;
+    try
+    {
+        eng = new MidiEngine();
+    }catch( const QString& err )
+    {
+        fprintf(stderr, "Error initializing MidiSink: %s\n", err.toUtf8().constData());
+        return -1;
+    }
+    if( eng->isPreroll() )
+        printf("keeping a pre-roll, send SIGUSR1 or the trigger note to record, ready after %.1f ms\n",
+               ( MidiClock::monotonic() - launch ) / 1000.0 );
+    else
+        printf("recording to %s, ready after %.1f ms\n", eng->getSinkPath().toUtf8().constData(),
+               ( MidiClock::monotonic() - launch ) / 1000.0 );
+    fflush(stdout);
+
+    quint64 total = 0;
+    int ticks = 0;
+    while( !s_stop )
+    {
+        ::usleep(100000); // interrupted by the signals
+        if( ( s_commit && eng->commitPreroll() ) || eng->checkTrigger() )
+            printf("recording to %s with a pre-roll\n", eng->getSinkPath().toUtf8().constData());
+        s_commit = 0;
+        eng->checkPorts();
+        if( s_stop || ++ticks < 10 )
+            continue;
+        ticks = 0;
+        const MidiEngine::Stats s = eng->fetchStats();
+        total += s.bytes;
+        if( !quiet )
+        {
+            printf("%llu bytes (+%d), %d flushes/s avg %d us max %d us, backlog %d, %d dropped\n",
+                   total, s.bytes, s.flushes, s.avgFlushUsecs, s.maxFlushUsecs, s.backlog, s.dropped);
+            if( s.bufferBudget )
+                printf("    disk buffer max %.1f%% of %u KB, %lld KB spilled\n",
+                       100.0 * s.bufferFill / s.bufferBudget, s.bufferBudget / 1024, s.spilled / 1024);
+            for( int i = 0; i < s.destinations.size(); i++ )
+                printf("    %s: lag max %u KB of %u KB%s\n", s.destinations[i].path.toUtf8().constData(),
+                       s.destinations[i].lag / 1024, s.destinations[i].budget / 1024,
+                       s.destinations[i].failed ? ", FAILED" : "");
+            for( int i = 0; verbose && i < s.ports.size(); i++ )
+            {
+                const MidiPortStats::Snapshot& p = s.ports[i].data;
+                printf("    %s: %u events, %u filtered, max burst %u, max queue %u, callback p99 %llu ns, latency p99 %llu us\n",
+                       s.ports[i].name.constData(), p.events, p.filtered, p.maxBurst, p.maxQueue,
+                       MidiHistogram::percentile(p.callback, MidiPortStats::CallbackShift, 0.99),
+                       MidiHistogram::percentile(p.latency, MidiPortStats::LatencyShift, 0.99));
+            }
+            fflush(stdout);
+        }
+    }
+    // closes the ports, drains the rings and closes the file
+    delete eng;
+    printf("stopped\n");
+    return 0;
+}
@@ -0,0 +1,229 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiRemap.h"
+#include <QFile>
+#include <string.h>
+
+MidiRemap::Table::Table()
+{
+    ::memset(status, 0, sizeof(status));
+    ::memset(channel, 0xff, sizeof(channel));
+    ::memset(control, 0xff, sizeof(control));
+    for( int c = 0; c < 16; c++ )
+        for( int n = 0; n < 128; n++ )
+            note[c][n] = n;
+}
+
+MidiRemap::MidiRemap()
+{
+}
+
+MidiRemap::~MidiRemap()
+{
+    clear();
+}
+
+void MidiRemap::clear()
+{
+    for( int i = 0; i < d_sections.size(); i++ )
+        delete d_sections[i].table;
+    d_sections.clear();
+}
+
+// "*", "n" or "lo-hi"; numbers count from base, i.e. 1 for channels and 0 for notes
+static bool parseRange(const QByteArray& str, int max, int base, int& lo, int& hi)
+{
+    if( str == "*" )
+    {
+        lo = 0;
+        hi = max - 1;
+        return true;
+    }
+    const int dash = str.indexOf('-', 1);
+    bool ok1, ok2 = true;
+    lo = str.left(dash < 0 ? str.size() : dash).toInt(&ok1) - base;
+    hi = dash < 0 ? lo : str.mid(dash + 1).toInt(&ok2) - base;
+    return ok1 && ok2 && lo >= 0 && lo <= hi && hi < max;
+}
+
+static bool parseChannel(const QByteArray& str, int& chan)
+{
+    int hi;
+    return str != "*" && parseRange(str, 16, 1, chan, hi);
+}
+
+static QString compile(MidiRemap::Table* t, const QList<QByteArray>& f)
+{
+    int c0, c1;
+    if( f.size() < 3 || !parseRange(f[1], 16, 1, c0, c1) )
+        return "expecting a rule and the channels it applies to";
+    bool ok = true;
+    if( f[0] == "notes" )
+    {
+        int n0, n1;
+        if( !parseRange(f[2], 128, 0, n0, n1) )
+            return "invalid notes";
+        int chan = 0xff;
+        int transpose = 0;
+        if( f.size() == 4 && f[3] == "drop" )
+            ;
+        else if( ( f.size() == 5 || ( f.size() == 7 && f[5] == "transpose" ) ) && f[3] == "channel" )
+        {
+            if( !parseChannel(f[4], chan) )
+                return "invalid channel";
+            if( f.size() == 7 )
+                transpose = f[6].toInt(&ok);
+            if( !ok )
+                return "invalid transposition";
+        }else
+            return "expecting channel or drop";
+        for( int c = c0; c <= c1; c++ )
+            for( int n = n0; n <= n1; n++ )
+            {
+                const int m = n + transpose;
+                const bool inRange = m >= 0 && m < 128;
+                t->channel[c][n] = inRange ? chan : 0xff;
+                t->note[c][n] = inRange ? m : n;
+            }
+    }else if( f[0] == "note" )
+    {
+        int n, m, hi;
+        if( f.size() != 4 || !parseRange(f[2], 128, 0, n, hi) || n != hi || !parseRange(f[3], 128, 0, m, hi) || m != hi )
+            return "expecting two note numbers";
+        for( int c = c0; c <= c1; c++ )
+            t->note[c][n] = m;
+    }else if( f[0] == "other" )
+    {
+        int chan = -1;
+        if( !( f.size() == 3 && f[2] == "drop" ) && !( f.size() == 4 && f[2] == "channel" && parseChannel(f[3], chan) ) )
+            return "expecting channel or drop";
+        for( int c = c0; c <= c1; c++ )
+        {
+            for( int kind = 0xb; kind <= 0xe; kind++ )
+                t->status[( kind << 4 ) | c] = chan < 0 ? 0 : ( kind << 4 ) | chan;
+            ::memset(t->control[c], chan < 0 ? 0xff : chan, sizeof(t->control[c]));
+        }
+    }else if( f[0] == "controls" )
+    {
+        int n0, n1;
+        if( !parseRange(f[2], 128, 0, n0, n1) )
+            return "invalid controllers";
+        int chan = 0xff;
+        if( !( f.size() == 4 && f[3] == "drop" ) && !( f.size() == 5 && f[3] == "channel" && parseChannel(f[4], chan) ) )
+            return "expecting channel or drop";
+        for( int c = c0; c <= c1; c++ )
+            for( int n = n0; n <= n1; n++ )
+                t->control[c][n] = chan;
+    }else if( f[0] == "program" )
+    {
+        const int program = f.size() == 3 ? f[2].toInt(&ok) : 0;
+        if( c0 != c1 || !ok || program < 1 || program > 128 )
+            return "expecting a channel and a program";
+        t->init += char(0xc0 | c0);
+        t->init += char(program - 1);
+    }else
+        return "unknown rule";
+    return QString();
+}
+
+bool MidiRemap::parse(const QByteArray& profile, QString* error)
+{
+    clear();
+    const QList<QByteArray> lines = profile.split('\n');
+    for( int i = 0; i < lines.size(); i++ )
+    {
+        QByteArray line = lines[i];
+        const int comment = line.indexOf('#');
+        if( comment >= 0 )
+            line.truncate(comment);
+        line = line.trimmed();
+        if( line.isEmpty() )
+            continue;
+        const QList<QByteArray> fields = line.simplified().split(' ');
+        QString err;
+        if( fields[0] == "port" && fields.size() > 1 )
+        {
+            // the pattern keeps the spaces of the port name
+            Section s;
+            s.pattern = QRegExp(QString::fromUtf8(line.mid(4).trimmed()), Qt::CaseSensitive, QRegExp::Wildcard);
+            s.table = new Table();
+            d_sections.append(s);
+        }else if( d_sections.isEmpty() )
+            err = "rule before the first port";
+        else
+            err = compile(d_sections.last().table, fields);
+        if( !err.isEmpty() )
+        {
+            if( error )
+                *error = QString("line %1: %2").arg(i + 1).arg(err);
+            clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MidiRemap::load(const QString& path, QString* error)
+{
+    QFile in(path);
+    if( !in.open(QIODevice::ReadOnly) )
+    {
+        if( error )
+            *error = QString("cannot open %1").arg(path);
+        return false;
+    }
+    return parse(in.readAll(), error);
+}
+
+QByteArray MidiRemap::gmProfile()
+{
+    return "port YAMAHA MOTIF XF7 Port3\n"
+           "notes * * channel 10\n"
+           "note * 39 38\n"
+           "note * 43 45\n"
+           "note * 45 47\n"
+           "note * 47 50\n"
+           "note * 48 49\n"
+           "note * 49 53\n"
+           "note * 50 57\n"
+           "note * 52 59\n"
+           "other * channel 10\n"
+           "port YAMAHA MOTIF XF7 Port1\n"
+           "program 2 34 # Electric Bass (finger)\n"
+           "notes * 60-127 channel 1 transpose -12 # piano\n"
+           "notes * 0-59 channel 2 # bass\n"
+           "other * channel 2 # pitch bend, pressure and programs\n"
+           "controls * 60-127 channel 1 # sustain (64) and the upper controllers to the piano\n"
+           "port Pico CircuitPython usb_midi*\n"
+           "notes * * channel 1\n"
+           "other * channel 1\n";
+}
+
+const MidiRemap::Table* MidiRemap::match(const QByteArray& port) const
+{
+    const QString name = QString::fromUtf8(port);
+    for( int i = 0; i < d_sections.size(); i++ )
+    {
+        QRegExp rx = d_sections[i].pattern; // QRegExp keeps the match state, so threads share a copy
+        if( rx.exactMatch(name) )
+            return d_sections[i].table;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef _MIDIREMAP_H
+#define _MIDIREMAP_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QList>
+#include <QRegExp>
+#include <QByteArray>
+
+// Maps the tracks of a recording to the channels of a General MIDI file by port name, e.g. to
+// play a performance on a GM synth. A profile is a text of port sections, one rule per line:
+//
+//   port <wildcard pattern>                     the first section matching the port name applies
+//   notes <chan> <note|lo-hi|*> channel <chan> [transpose <n>] or drop
+//   note <chan> <note> <note>                   replaces a note number after the notes rules
+//   other <chan> channel <chan> or drop         controllers, programs, pressure and pitch bend
+//   controls <chan> <ctrl|lo-hi|*> channel <chan> or drop   controllers by number, after other
+//   program <chan> <program>                    sent when the track is named
+//
+// Channels and programs count from 1, * means all channels or notes, # starts a comment; later
+// rules override earlier ones. Everything not covered, SysEx and system messages are dropped.
+// Each section is compiled to flat lookup tables, so mapping an event is a few table reads.
+class MidiRemap
+{
+public:
+    struct Table
+    {
+        quint8 status[256]; // of the messages other than notes, 0 to drop
+        quint8 channel[16][128]; // of notes by channel and note, 0xff to drop
+        quint8 note[16][128];
+        quint8 control[16][128]; // channel of control changes by channel and controller, 0xff to drop
+        QByteArray init; // program changes
+        Table();
+    };
+
+    MidiRemap();
+    ~MidiRemap();
+    bool parse(const QByteArray& profile, QString* error = 0);
+    bool load(const QString& path, QString* error = 0);
+    static QByteArray gmProfile(); // the built-in profile of the studio setup
+    const Table* match(const QByteArray& port) const; // 0 if no section matches
+
+    // maps a channel message in place; false if it is dropped
+    static inline bool map(const Table* t, quint8* msg, int len)
+    {
+        const quint8 status = msg[0];
+        if( status < 0xb0 && len > 1 )
+        {
+            // note off, note on and poly pressure
+            const quint8 chan = t->channel[status & 0xf][msg[1] & 0x7f];
+            msg[0] = ( status & 0xf0 ) | chan;
+            msg[1] = t->note[status & 0xf][msg[1] & 0x7f];
+            return chan != 0xff;
+        }
+        if( status < 0xc0 && len > 1 )
+        {
+            const quint8 chan = t->control[status & 0xf][msg[1] & 0x7f];
+            msg[0] = 0xb0 | chan;
+            return chan != 0xff;
+        }
+        msg[0] = t->status[status];
+        return msg[0] != 0;
+    }
+private:
+    Q_DISABLE_COPY(MidiRemap)
+    void clear();
+    struct Section
+    {
+        QRegExp pattern;
+        Table* table;
+    };
+    QList<Section> d_sections;
+};
+
+#endif // _MIDIREMAP_H
@@ -0,0 +1,84 @@
+#ifndef _MIDIRING_H
+#define _MIDIRING_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QAtomicInt>
+
+// Wait-free single producer, single consumer ring of fixed size slots.
+// The producer is the RtMidi callback thread of a port, the consumer is the writer thread.
+// Head and tail are free running counters; capacity is a power of two.
+template<class T>
+class MidiRing
+{
+public:
+    MidiRing(quint32 capacity = 4096):d_head(0),d_tail(0)
+    {
+        d_cap = 16;
+        while( d_cap < capacity )
+            d_cap <<= 1;
+        d_mask = d_cap - 1;
+        d_slots = new T[d_cap];
+    }
+    ~MidiRing()
+    {
+        delete[] d_slots;
+    }
+
+    // producer side; reserve(i) returns the i-th free slot, or 0 if there are not i + 1 free slots;
+    // commit(n) publishes the n reserved slots at once
+    T* reserve(quint32 i = 0)
+    {
+        const quint32 tail = d_tail.load();
+        if( tail + i - quint32(d_head.loadAcquire()) >= d_cap )
+            return 0; // full
+        return &d_slots[( tail + i ) & d_mask];
+    }
+    void commit(quint32 n = 1)
+    {
+        d_tail.storeRelease(d_tail.load() + n);
+    }
+
+    // consumer side; front(i) returns the i-th used slot or 0
+    const T* front(quint32 i = 0) const
+    {
+        const quint32 head = d_head.load();
+        if( quint32(d_tail.loadAcquire()) - head <= i )
+            return 0; // empty
+        return &d_slots[( head + i ) & d_mask];
+    }
+    void pop(quint32 n = 1)
+    {
+        d_head.storeRelease(d_head.load() + n);
+    }
+
+    quint32 size() const { return quint32(d_tail.loadAcquire()) - quint32(d_head.loadAcquire()); }
+    quint32 capacity() const { return d_cap; }
+private:
+    Q_DISABLE_COPY(MidiRing)
+    QAtomicInt d_head; // written by consumer only
+    char d_pad[64]; // keep head and tail on separate cache lines
+    QAtomicInt d_tail; // written by producer only
+    quint32 d_cap;
+    quint32 d_mask;
+    T* d_slots;
+};
+
+#endif // _MIDIRING_H
@@ -1,14 +1,36 @@
-QT       += core gui widgets
+QT       += core
 
 TARGET = MidiSink
 TEMPLATE = app
 
 HEADERS += \
     MidiEngine.h \
+    MidiStream.h \
+    MidiClock.h \
+    MidiCodec.h \
+    MidiFilter.h \
+    MidiHotplug.h \
+    MidiIndex.h \
+    MidiSmf.h \
+    MidiOutput.h \
+    MidiReader.h \
+    MidiRemap.h \
+    MidiRing.h \
+    MidiStats.h \
+    MidiWriter.h \
     ../rtmidi/RtMidi.h
 
 SOURCES += \
     MidiEngine.cpp \
+    MidiFilter.cpp \
+    MidiHotplug.cpp \
+    MidiIndex.cpp \
+    MidiSmf.cpp \
+    MidiReader.cpp \
+    MidiRemap.cpp \
+    MidiStream.cpp \
+    MidiOutput.cpp \
+    MidiWriter.cpp \
     ../rtmidi/RtMidi.cpp
 
 LIBS += -lasound
@@ -18,3 +40,16 @@ CONFIG += c++11
 INCLUDEPATH += ../rtmidi
 
 DEFINES += __LINUX_ALSA__
+
+# qmake CONFIG+=headless builds the console recorder MidiRecorder instead of the monitor
+headless {
+    TARGET = MidiRecorder
+    CONFIG += console
+    CONFIG -= app_bundle
+    SOURCES += MidiRecorder.cpp
+    message(headless recorder)
+} else {
+    QT += gui widgets
+    HEADERS += MidiMonitor.h
+    SOURCES += MidiMonitor.cpp
+}
@@ -0,0 +1,737 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiSmf.h"
+#include "MidiStream.h"
+#include "MidiCodec.h"
+#include "MidiReader.h"
+#include "MidiIndex.h"
+#include "MidiRemap.h"
+#include <QtDebug>
+#include <QThread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+MidiSmfWriter::MidiSmfWriter(const QString& path, quint16 division):d_path(path),d_division(division),d_failed(false)
+{
+    d_tracks.fill(0, 256);
+}
+
+MidiSmfWriter::~MidiSmfWriter()
+{
+    remove();
+}
+
+void MidiSmfWriter::addTrack(quint8 track, const QByteArray& name)
+{
+    if( d_tracks[track] )
+    {
+        d_tracks[track]->name = name;
+        return;
+    }
+    Track* t = new Track();
+    t->name = name;
+    t->spill.setFileName(d_path + "." + QString::number(track));
+    // the spill file is created with the first event, so silent ports leave nothing behind
+    d_tracks[track] = t;
+}
+
+void MidiSmfWriter::add(quint8 track, quint64 time, const quint8* msg, int len)
+{
+    Track* t = d_tracks[track];
+    if( t == 0 || len <= 0 || ( msg[0] == 0xff && ( len < 2 || msg[1] != 0x06 ) ) )
+        return;
+    if( !t->spill.isOpen() && !t->spill.open(QIODevice::WriteOnly) )
+    {
+        if( !d_failed )
+            qCritical() << "cannot open" << t->spill.fileName();
+        d_failed = true;
+        return;
+    }
+    // the MIDI file assumes 120 bpm, i.e. 500000 us per quarter note
+    const quint64 ticks = ( time * d_division + 250000 ) / 500000;
+    const quint64 delta = ticks > t->ticks ? ticks - t->ticks : 0;
+    t->ticks = qMax(ticks, t->ticks);
+    quint8 buf[2 * MidiCodec::MaxVarLen + 1];
+    quint8* p = MidiCodec::toVarLen(buf, MidiStream::smfDelta(&t->spill, delta));
+    if( msg[0] > 0xf0 && msg[0] != 0xf7 )
+    {
+        // MIDI files have no system common nor real-time events; store them escaped
+        *p++ = 0xf7;
+        p = MidiCodec::toVarLen(p, len);
+    }
+    // SysEx chunks are stored in .midisink cells exactly like in MIDI files
+    if( t->spill.write((const char*)buf, p - buf) < 0 || t->spill.write((const char*)msg, len) < 0 )
+    {
+        if( !d_failed )
+            qCritical() << "error writing to" << t->spill.fileName();
+        d_failed = true;
+    }
+}
+
+bool MidiSmfWriter::close()
+{
+    QFile out(d_path);
+    if( !out.open(QIODevice::WriteOnly) )
+    {
+        remove();
+        return false;
+    }
+    int count = 0;
+    for( int i = 0; i < d_tracks.size(); i++ )
+    {
+        if( d_tracks[i] == 0 )
+            continue;
+        d_tracks[i]->spill.close();
+        if( d_tracks[i]->spill.exists() )
+            count++;
+    }
+    MidiStream::writeFileHeader(&out, count, d_division);
+    bool ok = !d_failed;
+    QByteArray buf;
+    for( int i = 0; i < d_tracks.size(); i++ )
+    {
+        Track* t = d_tracks[i];
+        if( t == 0 || !t->spill.exists() )
+            continue;
+        QByteArray start;
+        start += MidiStream::toVarLen(0);
+        start += char(0xff);
+        start += char(0x03);
+        start += MidiStream::toVarLen(t->name.size());
+        start += t->name;
+        const char end[] = { 0, char(0xff), 0x2f, 0 };
+        MidiStream::writeChunkHeader(&out, "MTrk", start.size() + t->spill.size() + sizeof(end));
+        out.write(start);
+        if( !t->spill.open(QIODevice::ReadOnly) )
+            ok = false;
+        while( !t->spill.atEnd() )
+        {
+            buf = t->spill.read(1024 * 1024);
+            if( buf.isEmpty() || out.write(buf) != buf.size() )
+            {
+                ok = false;
+                break;
+            }
+        }
+        out.write(end, sizeof(end));
+        t->spill.close();
+    }
+    ok = out.flush() && ok;
+    out.close();
+    remove();
+    if( !ok )
+        qCritical() << "error writing" << d_path;
+    return ok;
+}
+
+void MidiSmfWriter::remove()
+{
+    for( int i = 0; i < d_tracks.size(); i++ )
+    {
+        if( d_tracks[i] )
+        {
+            d_tracks[i]->spill.remove();
+            delete d_tracks[i];
+            d_tracks[i] = 0;
+        }
+    }
+}
+
+// markers and SysEx chunks go through cell, which keeps its capacity
+static inline void addEvent(MidiSmfWriter& smf, const MidiReader::Event& e, quint64 time, QByteArray& cell)
+{
+    if( e.kind == MidiReader::Message )
+        smf.add(e.track, time, e.msg, e.len);
+    else if( e.kind == MidiReader::Sysex || e.type == 0x06 )
+    {
+        quint8 buf[MidiCodec::MaxVarLen];
+        cell.resize(0);
+        if( e.kind == MidiReader::Meta )
+            cell += char(0xff);
+        cell += char(e.type);
+        cell.append((const char*)buf, MidiCodec::toVarLen(buf, e.size) - buf);
+        cell.append((const char*)e.data, e.size);
+        smf.add(e.track, time, (const quint8*)cell.constData(), cell.size());
+    }
+}
+
+bool MidiSmfWriter::convert(const QString& inPath, const QString& outPath, const MidiStream::Take* take, quint64* events)
+{
+    MidiReader in;
+    if( !in.open(inPath) )
+        return false;
+    const MidiStream::Header& h = in.header();
+    if( take && !in.seek(take->offset) )
+        return false;
+    const quint64 end = take ? take->offset + take->size : 0;
+
+    // each track goes to its spill file through the QFile buffer, so the memory doesn't grow
+    // with the recording
+    MidiSmfWriter smf(outPath, h.division());
+    MidiReader::Event e;
+    QByteArray cell;
+    MidiReader::Clock clock(take ? take->start : h.timeBase);
+    quint64 count = 0;
+    while( ( take == 0 || in.pos() < end ) && in.next(e) )
+    {
+        count++;
+        const bool first = !clock.seen[e.track];
+        quint64 time;
+        if( !clock.advance(e, time) )
+            return false;
+        if( first )
+            smf.addTrack(e.track, QByteArray());
+        if( e.kind == MidiReader::Meta && e.type == 0x03 )
+            smf.addTrack(e.track, QByteArray((const char*)e.data, e.size));
+        else
+            addEvent(smf, e, time * h.unit, cell);
+    }
+    if( in.failed() )
+        return false;
+    if( events )
+        *events = count;
+    return smf.close();
+}
+
+bool MidiSmfWriter::extract(const QString& inPath, const QString& outPath, quint64 from, quint64 to, quint64* events)
+{
+    MidiReader in;
+    if( !in.open(inPath) )
+        return false;
+    const MidiStream::Header& h = in.header();
+    // MIDI files are decoded as a whole anyway and have no index
+    MidiIndex index;
+    MidiIndex::Entry start;
+    quint64 stop = ~quint64(0);
+    if( !in.isSmf() )
+    {
+        if( !index.update(inPath) || !index.entry(index.find(from), start) || !in.seek(start.offset) )
+            return false;
+        // the writer merges the ports in time order only within its hold back, so a cell after
+        // the first one beyond the range may still be in it; an index entry is far enough
+        const int after = index.findAfter(to);
+        if( after < index.count() )
+            stop = index.offset(after);
+    }
+
+    // continue decoding with the state of the index entry before the range
+    MidiSmfWriter smf(outPath, h.division());
+    MidiReader::Clock clock(h.timeBase);
+    clock.leading = start.leading;
+    for( int i = 0; i < start.tracks.size(); i++ )
+    {
+        const MidiIndex::Track& t = start.tracks[i];
+        clock.seen[t.id] = true;
+        clock.times[t.id] = t.time;
+        clock.bases[t.id] = t.base;
+        in.setState(t.id, t.state);
+        smf.addTrack(t.id, t.name);
+    }
+    MidiReader::Event e;
+    QByteArray cell;
+    quint64 count = 0;
+    while( in.pos() < stop && in.next(e) )
+    {
+        const bool first = !clock.seen[e.track];
+        quint64 time;
+        if( !clock.advance(e, time) )
+            return false;
+        time *= h.unit;
+        if( in.isSmf() && time > to )
+            break; // the MIDI file reader merges the tracks in strict time order
+        if( first )
+            smf.addTrack(e.track, QByteArray());
+        if( e.kind == MidiReader::Meta && e.type == 0x03 )
+            smf.addTrack(e.track, QByteArray((const char*)e.data, e.size));
+        else if( time >= from && time <= to )
+        {
+            addEvent(smf, e, time - from, cell);
+            count++;
+        }
+    }
+    if( in.failed() )
+        return false;
+    if( events )
+        *events = count;
+    return smf.close();
+}
+
+static inline void writeDelta(QFile& out, quint64 delta)
+{
+    quint8 buf[MidiCodec::MaxVarLen];
+    out.write((const char*)buf, MidiCodec::toVarLen(buf, MidiStream::smfDelta(&out, delta)) - buf);
+}
+
+bool MidiSmfWriter::convertGm(const QString& inPath, const QString& outPath, const MidiRemap* profile, quint64* events)
+{
+    MidiRemap gm;
+    if( profile == 0 && !gm.parse(MidiRemap::gmProfile()) )
+        return false;
+    const MidiRemap& remap = profile ? *profile : gm;
+    MidiReader in;
+    if( !in.open(inPath) )
+        return false;
+    const MidiStream::Header& header = in.header();
+
+    QFile out(outPath);
+    if( !out.open(QIODevice::WriteOnly) )
+        return false;
+
+    out.write("MThd");
+    QByteArray len(4,char(0));
+    len[3] = 6;
+    out.write(len);
+    QByteArray word(2,char(0));
+    word[1] = 0; // type 0
+    out.write(word);
+    word[1] = 1; // one track
+    out.write(word);
+    const short ticks = header.division();
+    // dummy 120 pbm to fake one tick per ms (or per 50 us)
+    word[0] = char((ticks >> 8)) & 0xff;
+    word[1] = char(ticks & 0xff);
+    out.write(word);
+
+    out.write("MTrk");
+    const int lenpos = out.pos();
+    out.write( QByteArray(4,char(0)) );  // dummy, fix later
+
+    // the table of each track is looked up once when the track is named
+    QVector<const MidiRemap::Table*> tables(256);
+    MidiReader::Clock clock(header.timeBase);
+    MidiReader::Event e;
+    quint64 gmtime = 0;
+    quint64 unused = 0;
+    quint64 count = 0;
+    while( in.next(e) )
+    {
+        count++;
+        quint64 time;
+        if( !clock.advance(e, time) )
+            return false;
+        qint64 diff = header.toTicks(time, ticks) - gmtime;
+        if( diff < 0 )
+            diff = 0;
+        gmtime += diff;
+        unused += diff;
+
+        if( e.kind == MidiReader::Meta )
+        {
+            if( e.type != 0x03 )
+                continue;
+            const MidiRemap::Table* t = remap.match(QByteArray::fromRawData((const char*)e.data, e.size));
+            // the name cells are repeated at each sync point, but the programs are only sent once
+            if( t && t != tables[e.track] && !t->init.isEmpty() )
+            {
+                writeDelta(out, unused);
+                unused = 0;
+                for( int i = 0; i + 1 < t->init.size(); i += 2 )
+                {
+                    if( i != 0 )
+                        writeDelta(out, 0);
+                    out.write(t->init.constData() + i, 2);
+                }
+            }
+            tables[e.track] = t;
+        }else if( e.kind == MidiReader::Message && tables[e.track] && MidiRemap::map(tables[e.track], e.msg, e.len) )
+        {
+            writeDelta(out, unused);
+            unused = 0;
+            out.write((const char*)e.msg, e.len);
+        }
+        // else dropped, but the time goes to the next event
+    }
+    if( in.failed() )
+        return false;
+
+    QByteArray end;
+    end += MidiStream::toVarLen(0);
+    end += char(0xff);
+    end += char(0x2f);
+    end += char(0x00);
+    out.write(end);
+
+    const quint32 l = out.pos() - lenpos - 4;
+    QByteArray bytes(4,char(0));
+    bytes[0] = char((l >> 24) & 0xff);
+    bytes[1] = char((l >> 16) & 0xff);
+    bytes[2] = char((l >> 8)) & 0xff;
+    bytes[3] = char(l & 0xff);
+    out.seek(lenpos);
+    out.write(bytes);
+    if( events )
+        *events = count;
+    return out.error() == QFile::NoError;
+}
+
+class MidiSmfDecoder : public QThread
+{
+public:
+    MidiSmfDecoder(MidiSmfReader* r, int phase):d_reader(r),d_phase(phase){}
+protected:
+    void run()
+    {
+        d_reader->work(d_phase);
+    }
+private:
+    MidiSmfReader* d_reader;
+    int d_phase;
+};
+
+static inline quint32 readBE(const quint8* p, int n)
+{
+    quint32 res = 0;
+    for( int i = 0; i < n; i++ )
+        res = ( res << 8 ) | p[i];
+    return res;
+}
+
+MidiSmfReader::MidiSmfReader():d_division(0),d_named(0),d_map(0),d_mapLen(0),d_failed(false)
+{
+}
+
+MidiSmfReader::~MidiSmfReader()
+{
+    close();
+}
+
+bool MidiSmfReader::isSmf(const QString& path)
+{
+    QFile in(path);
+    return in.open(QIODevice::ReadOnly) && in.read(4) == "MThd";
+}
+
+bool MidiSmfReader::open(const QString& path, int threads)
+{
+    close();
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if( fd < 0 )
+        return false;
+    struct stat st;
+    if( ::fstat(fd, &st) != 0 || st.st_size < 14 )
+    {
+        ::close(fd);
+        return false;
+    }
+    d_mapLen = st.st_size;
+    d_map = ::mmap(0, d_mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if( d_map == MAP_FAILED )
+    {
+        d_map = 0;
+        return false;
+    }
+    ::madvise(d_map, d_mapLen, MADV_WILLNEED);
+    const quint8* p = (const quint8*)d_map;
+    const quint8* const end = p + d_mapLen;
+    const quint32 headLen = readBE(p + 4, 4);
+    d_division = readBE(p + 12, 2);
+    if( ::memcmp(p, "MThd", 4) != 0 || headLen < 6 || headLen > d_mapLen - 8 || ( d_division & 0x7fff ) == 0 ||
+            ( ( d_division & 0x8000 ) && ( d_division & 0xff ) == 0 ) )
+    {
+        close();
+        return false;
+    }
+    p += 8 + headLen;
+    while( end - p >= 8 )
+    {
+        // a truncated last chunk is read as far as it goes; unknown chunks are skipped
+        const quint32 len = readBE(p + 4, 4);
+        const quint8* data = p + 8;
+        const quint8* next = len > quint32(end - data) ? end : data + len;
+        if( ::memcmp(p, "MTrk", 4) == 0 )
+        {
+            Track t;
+            t.begin = data;
+            t.end = next;
+            d_tracks.append(t);
+        }
+        p = next;
+    }
+    if( d_tracks.isEmpty() || d_tracks.size() > 256 )
+    {
+        close();
+        return false;
+    }
+
+    run(threads, 0);
+
+    // the tempo changes of all tracks, though format 1 files have them in the first one
+    Tempo tempo;
+    tempo.tick = 0;
+    tempo.time = 0;
+    tempo.usecs = 500000;
+    d_tempos.append(tempo);
+    for( int i = 0; i < d_tracks.size(); i++ )
+    {
+        const QVector<Item>& items = d_tracks[i].items;
+        for( int j = 0; j < items.size(); j++ )
+        {
+            if( items[j].kind != MidiReader::Meta || items[j].type != 0x51 || items[j].size != 3 )
+                continue;
+            tempo.tick = items[j].tick;
+            tempo.usecs = readBE(items[j].data, 3);
+            d_tempos.append(tempo);
+        }
+    }
+    std::stable_sort(d_tempos.begin(), d_tempos.end(), byTick);
+    for( int i = 1; i < d_tempos.size(); i++ )
+    {
+        const Tempo& prev = d_tempos[i - 1];
+        d_tempos[i].time = prev.time + ( d_tempos[i].tick - prev.tick ) * prev.usecs / d_division;
+    }
+
+    run(threads, 1);
+
+    for( int i = 0; i < d_tracks.size(); i++ )
+    {
+        Track& t = d_tracks[i];
+        for( int j = 0; j < t.items.size() && t.items[j].tick == 0 && t.name.isNull(); j++ )
+            if( t.items[j].kind == MidiReader::Meta && t.items[j].type == 0x03 )
+                t.name = QByteArray((const char*)t.items[j].data, t.items[j].size);
+        if( t.name.isNull() )
+            t.name = "Track " + QByteArray::number(i + 1);
+        if( t.failed )
+            d_failed = true;
+    }
+    return true;
+}
+
+void MidiSmfReader::close()
+{
+    if( d_map )
+        ::munmap(d_map, d_mapLen);
+    d_map = 0;
+    d_mapLen = 0;
+    d_tracks.clear();
+    d_tempos.clear();
+    d_named = 0;
+    d_failed = false;
+}
+
+void MidiSmfReader::run(int threads, int phase)
+{
+    if( threads <= 0 )
+        threads = QThread::idealThreadCount();
+    threads = qMin(threads, d_tracks.size());
+    d_claimed.store(0);
+    QList<MidiSmfDecoder*> decoders;
+    for( int i = 1; i < threads; i++ )
+    {
+        decoders << new MidiSmfDecoder(this, phase);
+        decoders.last()->start();
+    }
+    work(phase);
+    for( int i = 0; i < decoders.size(); i++ )
+    {
+        decoders[i]->wait();
+        delete decoders[i];
+    }
+}
+
+void MidiSmfReader::work(int phase)
+{
+    // the tracks are claimed one by one, so a long track doesn't hold up the others
+    Track* tracks = d_tracks.data();
+    int i;
+    while( ( i = d_claimed.fetchAndAddRelaxed(1) ) < d_tracks.size() )
+    {
+        if( phase == 0 )
+            decode(tracks[i]);
+        else
+            convert(tracks[i]);
+    }
+}
+
+void MidiSmfReader::decode(Track& t)
+{
+    const quint8* p = t.begin;
+    const quint8* const end = t.end;
+    quint64 tick = 0;
+    quint8 running = 0;
+    t.items.reserve(( end - p ) / 4);
+    while( p < end )
+    {
+        tick += MidiCodec::fromVarLen(p, end);
+        if( p >= end )
+            break; // padding after the last event
+        Item it;
+        it.tick = tick;
+        it.time = 0;
+        it.data = 0;
+        it.size = 0;
+        it.type = 0;
+        it.len = 0;
+        const quint8 status = *p;
+        if( status == 0xff || status == 0xf0 || status == 0xf7 )
+        {
+            p++;
+            if( status == 0xff )
+                it.type = p < end ? *p++ : 0;
+            it.size = MidiCodec::fromVarLen(p, end);
+            it.data = p;
+            if( it.size > quint32(end - p) )
+            {
+                t.failed = true;
+                return;
+            }
+            p += it.size;
+            if( status == 0xff )
+            {
+                if( it.type == 0x2f )
+                    return; // end of track
+                it.kind = MidiReader::Meta;
+            }else if( status == 0xf7 && it.size > 0 && it.size <= 3 && it.data[0] > 0xf0 && it.data[0] != 0xf7 )
+            {
+                // a system message escaped by MidiStream::writeStream
+                it.kind = MidiReader::Message;
+                it.len = it.size;
+                ::memcpy(it.msg, it.data, it.size);
+                it.data = 0;
+                it.size = 0;
+            }else
+            {
+                it.kind = MidiReader::Sysex;
+                it.type = status;
+                running = 0;
+            }
+        }else
+        {
+            if( status & 0x80 )
+            {
+                if( status > 0xef )
+                {
+                    t.failed = true;
+                    return;
+                }
+                running = status;
+                p++;
+            }else if( running == 0 )
+            {
+                t.failed = true;
+                return;
+            }
+            const int n = ( running >> 4 ) == 0xc || ( running >> 4 ) == 0xd ? 1 : 2;
+            if( n > end - p )
+            {
+                t.failed = true;
+                return;
+            }
+            it.kind = MidiReader::Message;
+            it.len = 1 + n;
+            it.msg[0] = running;
+            it.msg[1] = p[0];
+            it.msg[2] = n > 1 ? p[1] : 0;
+            p += n;
+        }
+        t.items.append(it);
+    }
+}
+
+void MidiSmfReader::convert(Track& t) const
+{
+    Item* items = t.items.data();
+    const int count = t.items.size();
+    if( d_division & 0x8000 )
+    {
+        // SMPTE frames per second and ticks per frame, tempo independent
+        const int fps = -qint8(d_division >> 8);
+        const double tickUsecs = 1000000.0 / ( ( fps == 29 ? 29.97 : fps ) * ( d_division & 0xff ) );
+        for( int i = 0; i < count; i++ )
+            items[i].time = items[i].tick * tickUsecs;
+        return;
+    }
+    int k = 0; // the tempo in effect
+    for( int i = 0; i < count; i++ )
+    {
+        while( k + 1 < d_tempos.size() && d_tempos[k + 1].tick <= items[i].tick )
+            k++;
+        const Tempo& tempo = d_tempos[k];
+        items[i].time = tempo.time + ( items[i].tick - tempo.tick ) * tempo.usecs / d_division;
+    }
+}
+
+bool MidiSmfReader::next(MidiReader::Event& e)
+{
+    if( d_named < d_tracks.size() )
+    {
+        // all tracks start with their name, like a .midisink stream
+        const Track& t = d_tracks[d_named];
+        e.delta = 0;
+        e.track = d_named++;
+        e.kind = MidiReader::Meta;
+        e.type = 0x03;
+        e.len = 0;
+        e.size = t.name.size();
+        e.data = (const quint8*)t.name.constData();
+        return true;
+    }
+    // like MidiWriter::drain, a k-way merge of the track fronts
+    const Track* tracks = d_tracks.constData();
+    int next = -1;
+    quint64 time = 0;
+    for( int i = 0; i < d_tracks.size(); i++ )
+    {
+        const Track& t = tracks[i];
+        if( t.next < t.items.size() && ( next < 0 || t.items.constData()[t.next].time < time ) )
+        {
+            next = i;
+            time = t.items.constData()[t.next].time;
+        }
+    }
+    if( next < 0 )
+        return false;
+    Track& t = d_tracks[next];
+    e.track = next;
+    if( time - t.last > MidiCodec::MaxDelta )
+    {
+        // bridge a pause longer than a delta can hold by repeating the name
+        t.last += MidiCodec::MaxDelta;
+        e.delta = MidiCodec::MaxDelta;
+        e.kind = MidiReader::Meta;
+        e.type = 0x03;
+        e.len = 0;
+        e.size = t.name.size();
+        e.data = (const quint8*)t.name.constData();
+        return true;
+    }
+    const Item& it = t.items.constData()[t.next++];
+    e.delta = time - t.last;
+    t.last = time;
+    e.kind = it.kind;
+    e.type = it.type;
+    e.len = it.len;
+    ::memcpy(e.msg, it.msg, sizeof(e.msg));
+    e.size = it.size;
+    e.data = it.data;
+    return true;
+}
+
+quint64 MidiSmfReader::eventCount() const
+{
+    quint64 count = 0;
+    for( int i = 0; i < d_tracks.size(); i++ )
+        count += d_tracks[i].items.size();
+    return count;
+}
@@ -0,0 +1,134 @@
+#ifndef _MIDISMF_H
+#define _MIDISMF_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QFile>
+#include <QVector>
+#include <QAtomicInt>
+#include "MidiStream.h"
+#include "MidiReader.h"
+
+class MidiRemap;
+
+// Writes a Format 1 MIDI file while capturing: the events of each track go to a spill
+// file (path.N) as MIDI file events; close() writes the header and appends the tracks with
+// their names and end-of-track events, so no second pass over the capture is needed.
+// Used by the writer thread only, and by the owner after that thread has stopped.
+class MidiSmfWriter
+{
+public:
+    MidiSmfWriter(const QString& path, quint16 division = 10000); // division as in MidiStream::Header
+    ~MidiSmfWriter();
+
+    void addTrack(quint8 track, const QByteArray& name); // call before the first add(); again to rename
+    // msg is the part of a .midisink cell after the track byte; time in microseconds,
+    // see MidiClock; meta cells other than markers are ignored
+    void add(quint8 track, quint64 time, const quint8* msg, int len);
+    bool close(); // assembles the file and removes the spill files
+    void remove(); // removes the spill files without writing a file
+    QString fileName() const { return d_path; }
+
+    // converts a .midisink stream (or a take of it) in one pass with constant memory, the
+    // replacement of MidiStream::readStream and writeStream for long recordings
+    static bool convert(const QString& in, const QString& out, const MidiStream::Take* take = 0, quint64* events = 0);
+    // converts the events from..to (microseconds since the start) with the help of the index,
+    // which is built or brought up to date first, see MidiIndex
+    static bool extract(const QString& in, const QString& out, quint64 from, quint64 to, quint64* events = 0);
+    // converts to a type 0 General MIDI file mapped by port name, by default with the built-in
+    // profile of the studio setup, see MidiRemap
+    static bool convertGm(const QString& in, const QString& out, const MidiRemap* profile = 0, quint64* events = 0);
+private:
+    struct Track
+    {
+        QByteArray name;
+        QFile spill;
+        quint64 ticks;
+        Track():ticks(0){}
+    };
+    QString d_path;
+    QVector<Track*> d_tracks; // by track byte
+    quint16 d_division;
+    bool d_failed;
+};
+
+// Reads a Standard MIDI File of format 0, 1 or 2 from a mapping: the MTrk chunks are decoded in
+// parallel into per track event lists pointing into the mapping, the ticks converted to
+// microseconds with the tempo map of all tracks, and next() merges the tracks in time order
+// into the events MidiReader yields for a stream with a unit of 1 us, preceded by a name cell
+// of each track; thus everything built on MidiReader also reads MIDI files, see MidiReader::open.
+class MidiSmfReader
+{
+public:
+    MidiSmfReader();
+    ~MidiSmfReader();
+    bool open(const QString& path, int threads = 0); // 0 for one per core
+    void close();
+    bool next(MidiReader::Event& e);
+    bool failed() const { return d_failed; }
+    int trackCount() const { return d_tracks.size(); }
+    quint64 eventCount() const; // without the name cells
+    static bool isSmf(const QString& path);
+private:
+    friend class MidiSmfDecoder;
+    struct Item
+    {
+        quint64 tick;
+        quint64 time; // us
+        const quint8* data;
+        quint32 size;
+        quint8 kind;
+        quint8 type;
+        quint8 len;
+        quint8 msg[3];
+    };
+    struct Track
+    {
+        const quint8* begin;
+        const quint8* end;
+        QVector<Item> items;
+        int next;
+        quint64 last;
+        QByteArray name;
+        bool failed;
+        Track():begin(0),end(0),next(0),last(0),failed(false){}
+    };
+    struct Tempo
+    {
+        quint64 tick;
+        quint64 time;
+        quint32 usecs; // per quarter note
+    };
+    static bool byTick(const Tempo& a, const Tempo& b) { return a.tick < b.tick; }
+    static void decode(Track& t);
+    void convert(Track& t) const;
+    void run(int threads, int phase);
+    void work(int phase);
+    QVector<Track> d_tracks;
+    QVector<Tempo> d_tempos;
+    QAtomicInt d_claimed; // tracks taken by the decoders
+    quint16 d_division;
+    int d_named; // name cells delivered
+    void* d_map;
+    size_t d_mapLen;
+    bool d_failed;
+};
+
+#endif // _MIDISMF_H
@@ -0,0 +1,154 @@
+#ifndef _MIDISTATS_H
+#define _MIDISTATS_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QAtomicInt>
+
+// Lock-free histogram with power of two buckets; bucket i counts values below 1 << (shift + i),
+// the last bucket everything above. Any thread may add, one thread fetches.
+class MidiHistogram
+{
+public:
+    enum { Buckets = 16 };
+
+    MidiHistogram(int shift):d_shift(shift)
+    {
+        for( int i = 0; i < Buckets; i++ )
+            d_counts[i].store(0);
+    }
+
+    void add(quint64 value)
+    {
+        value >>= d_shift;
+        int i = 0;
+        while( value && i < Buckets - 1 )
+        {
+            value >>= 1;
+            i++;
+        }
+        d_counts[i].fetchAndAddRelaxed(1);
+    }
+
+    // moves the counts since the last call to counts
+    void fetch(quint32* counts)
+    {
+        for( int i = 0; i < Buckets; i++ )
+            counts[i] = d_counts[i].fetchAndStoreRelaxed(0);
+    }
+
+    static quint64 upperBound(int shift, int bucket) { return quint64(1) << ( shift + bucket ); }
+
+    // upper bound of the bucket which contains the given fraction of the values; 0 if empty
+    static quint64 percentile(const quint32* counts, int shift, double fraction)
+    {
+        quint64 total = 0;
+        for( int i = 0; i < Buckets; i++ )
+            total += counts[i];
+        if( total == 0 )
+            return 0;
+        const quint64 limit = qMax(quint64(1), quint64(total * fraction + 0.5));
+        quint64 sum = 0;
+        for( int i = 0; i < Buckets; i++ )
+        {
+            sum += counts[i];
+            if( sum >= limit )
+                return upperBound(shift, i);
+        }
+        return upperBound(shift, Buckets - 1);
+    }
+private:
+    Q_DISABLE_COPY(MidiHistogram)
+    QAtomicInt d_counts[Buckets];
+    int d_shift;
+};
+
+// Counters of one MIDI in port; the first group is only written by the callback thread,
+// the second only by the writer thread, and the monitor fetches and resets them.
+class MidiPortStats
+{
+public:
+    enum { BurstGap = 1000 }; // us; events closer than this count as one burst
+    enum { CallbackShift = 8, LatencyShift = 8 }; // first buckets: 256 ns and 256 us
+
+    struct Snapshot
+    {
+        quint32 events;
+        quint32 bytes;
+        quint32 maxBurst;
+        quint32 maxQueue; // cells waiting in the ring
+        quint32 filtered; // dropped by the MidiFilter
+        quint32 callback[MidiHistogram::Buckets]; // callback duration in ns
+        quint32 latency[MidiHistogram::Buckets]; // driver time stamp to output in us
+    };
+
+    MidiHistogram callback;
+    MidiHistogram latency;
+
+    MidiPortStats():callback(CallbackShift),latency(LatencyShift),d_events(0),d_bytes(0),d_maxBurst(0),d_maxQueue(0),d_filtered(0),
+        d_burst(0),d_last(0) {}
+
+    // callback thread
+    void received(quint64 time, int bytes)
+    {
+        d_events.fetchAndAddRelaxed(1);
+        d_bytes.fetchAndAddRelaxed(bytes);
+        if( d_burst && time - d_last < BurstGap )
+            d_burst++;
+        else
+            d_burst = 1;
+        d_last = time;
+        if( int(d_burst) > d_maxBurst.load() )
+            d_maxBurst.store(d_burst);
+    }
+
+    // writer thread
+    void queued(quint32 cells)
+    {
+        if( int(cells) > d_maxQueue.load() )
+            d_maxQueue.store(cells);
+    }
+    void filtered()
+    {
+        d_filtered.fetchAndAddRelaxed(1);
+    }
+
+    void fetch(Snapshot& s)
+    {
+        s.events = d_events.fetchAndStoreRelaxed(0);
+        s.bytes = d_bytes.fetchAndStoreRelaxed(0);
+        s.maxBurst = d_maxBurst.fetchAndStoreRelaxed(0);
+        s.maxQueue = d_maxQueue.fetchAndStoreRelaxed(0);
+        s.filtered = d_filtered.fetchAndStoreRelaxed(0);
+        callback.fetch(s.callback);
+        latency.fetch(s.latency);
+    }
+private:
+    Q_DISABLE_COPY(MidiPortStats)
+    QAtomicInt d_events;
+    QAtomicInt d_bytes;
+    QAtomicInt d_maxBurst;
+    QAtomicInt d_maxQueue;
+    QAtomicInt d_filtered;
+    quint32 d_burst; // callback thread only
+    quint64 d_last;
+};
+
+#endif // _MIDISTATS_H
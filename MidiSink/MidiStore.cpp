@@ -0,0 +1,282 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiStore.h"
+#include "MidiReader.h"
+#include <algorithm>
+
+struct ByTime
+{
+    const quint64* times;
+    ByTime(const quint64* t):times(t){}
+    bool operator()(quint32 a, quint32 b) const { return times[a] < times[b]; }
+};
+
+template<class T>
+static void permute(QVector<T>& column, const QVector<quint32>& order)
+{
+    QVector<T> res(column.size());
+    for( int i = 0; i < order.size(); i++ )
+        res[i] = column[order[i]];
+    column = res;
+}
+
+bool MidiStore::load(const QString& path)
+{
+    clear();
+    MidiReader in;
+    if( !in.open(path) )
+        return false;
+    const MidiStream::Header& h = in.header();
+    if( !in.isSmf() )
+    {
+        // about a message per four bytes of the stream
+        const int rows = in.size() / 4;
+        d_times.reserve(rows);
+        d_tracks.reserve(rows);
+        d_status.reserve(rows);
+        d_data1.reserve(rows);
+        d_data2.reserve(rows);
+    }
+    d_names.resize(256);
+    MidiReader::Clock clock(h.timeBase);
+    MidiReader::Event e;
+    bool sorted = true;
+    while( in.next(e) )
+    {
+        quint64 time;
+        if( !clock.advance(e, time) )
+        {
+            clear();
+            return false;
+        }
+        if( e.kind == MidiReader::Meta && e.type == 0x03 )
+            d_names[e.track] = QByteArray((const char*)e.data, e.size);
+        if( e.kind != MidiReader::Message || e.msg[0] >= 0xf0 )
+            continue;
+        time *= h.unit;
+        quint8 status = e.msg[0];
+        const quint8 d1 = e.len > 1 ? e.msg[1] : 0;
+        const quint8 d2 = e.len > 2 ? e.msg[2] : 0;
+        if( ( status & 0xf0 ) == 0x90 && d2 == 0 )
+            status = 0x80 | ( status & 0xf );
+        if( !d_times.isEmpty() && time < d_times.last() )
+            sorted = false;
+        d_times.append(time);
+        d_tracks.append(e.track);
+        d_status.append(status);
+        d_data1.append(d1);
+        d_data2.append(d2);
+    }
+    if( in.failed() )
+    {
+        clear();
+        return false;
+    }
+    if( !sorted )
+    {
+        // e.g. a track first seen after the sync point, which counts from the recording start
+        QVector<quint32> order(d_times.size());
+        for( int i = 0; i < order.size(); i++ )
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), ByTime(d_times.constData()));
+        permute(d_times, order);
+        permute(d_tracks, order);
+        permute(d_status, order);
+        permute(d_data1, order);
+        permute(d_data2, order);
+    }
+    index(d_tracks, 256, d_trackOffsets, d_trackRows);
+    QVector<quint8> channels(d_status.size());
+    for( int i = 0; i < channels.size(); i++ )
+        channels[i] = d_status[i] & 0xf;
+    index(channels, 16, d_channelOffsets, d_channelRows);
+    return true;
+}
+
+void MidiStore::clear()
+{
+    d_times.clear();
+    d_tracks.clear();
+    d_status.clear();
+    d_data1.clear();
+    d_data2.clear();
+    d_trackOffsets.clear();
+    d_trackRows.clear();
+    d_channelOffsets.clear();
+    d_channelRows.clear();
+    d_names.clear();
+}
+
+void MidiStore::index(const QVector<quint8>& keys, int keyCount, QVector<quint32>& offsets, QVector<quint32>& rows) const
+{
+    // counting sort, which keeps the rows of a key in time order
+    offsets = QVector<quint32>(keyCount + 1, 0);
+    for( int i = 0; i < keys.size(); i++ )
+        offsets[keys[i] + 1]++;
+    for( int k = 0; k < keyCount; k++ )
+        offsets[k + 1] += offsets[k];
+    rows.resize(keys.size());
+    QVector<quint32> next = offsets;
+    for( int i = 0; i < keys.size(); i++ )
+        rows[next[keys[i]]++] = i;
+}
+
+const quint32* MidiStore::trackRows(quint8 track, int& count) const
+{
+    if( d_trackOffsets.isEmpty() )
+    {
+        count = 0;
+        return 0;
+    }
+    count = d_trackOffsets[track + 1] - d_trackOffsets[track];
+    return d_trackRows.constData() + d_trackOffsets[track];
+}
+
+const quint32* MidiStore::channelRows(quint8 chan, int& count) const
+{
+    if( d_channelOffsets.isEmpty() || chan > 15 )
+    {
+        count = 0;
+        return 0;
+    }
+    count = d_channelOffsets[chan + 1] - d_channelOffsets[chan];
+    return d_channelRows.constData() + d_channelOffsets[chan];
+}
+
+int MidiStore::lowerBound(quint64 time) const
+{
+    return std::lower_bound(d_times.constData(), d_times.constData() + d_times.size(), time) - d_times.constData();
+}
+
+void MidiStore::range(const Query& q, const quint32*& rows, int& first, int& last) const
+{
+    if( q.track < 0 )
+    {
+        rows = 0;
+        first = lowerBound(q.from);
+        last = q.to == ~quint64(0) ? size() : lowerBound(q.to + 1);
+        return;
+    }
+    int count = 0;
+    rows = q.track < 256 ? trackRows(q.track, count) : 0;
+    // the rows of a track are in time order too
+    const quint64* times = d_times.constData();
+    int lo = 0, hi = count;
+    while( lo < hi )
+    {
+        const int mid = ( lo + hi ) / 2;
+        if( times[rows[mid]] < q.from )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    first = lo;
+    hi = count;
+    while( lo < hi )
+    {
+        const int mid = ( lo + hi ) / 2;
+        if( times[rows[mid]] <= q.to )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    last = lo;
+}
+
+// 1 if the row matches, without branches so the loops over the columns vectorize
+static inline quint32 matches(const MidiStore::Query& q, quint8 span, quint8 status, quint8 d1)
+{
+    const int type = ( status >> 4 ) & 7;
+    return ( quint32(q.types) >> type ) & ( quint32(q.channels) >> ( status & 0xf ) ) &
+            ( quint32( quint8(d1 - q.lo) <= span ) | ( quint32(~MidiStore::Ranged) >> type ) ) & 1;
+}
+
+int MidiStore::count(const Query& q) const
+{
+    const quint32* rows;
+    int first, last;
+    range(q, rows, first, last);
+    if( q.lo > q.hi )
+        return 0;
+    const quint8 span = q.hi - q.lo;
+    const quint8* status = d_status.constData();
+    const quint8* d1 = d_data1.constData();
+    int n = 0;
+    if( rows == 0 )
+        for( int i = first; i < last; i++ )
+            n += matches(q, span, status[i], d1[i]);
+    else
+        for( int k = first; k < last; k++ )
+            n += matches(q, span, status[rows[k]], d1[rows[k]]);
+    return n;
+}
+
+QVector<quint32> MidiStore::select(const Query& q) const
+{
+    const quint32* rows;
+    int first, last;
+    range(q, rows, first, last);
+    if( q.lo > q.hi || first >= last )
+        return QVector<quint32>();
+    const quint8 span = q.hi - q.lo;
+    const quint8* status = d_status.constData();
+    const quint8* d1 = d_data1.constData();
+    QVector<quint32> res(last - first);
+    quint32* out = res.data();
+    int n = 0;
+    // every row is written, but only the matching ones advance
+    if( rows == 0 )
+        for( int i = first; i < last; i++ )
+        {
+            out[n] = i;
+            n += matches(q, span, status[i], d1[i]);
+        }
+    else
+        for( int k = first; k < last; k++ )
+        {
+            out[n] = rows[k];
+            n += matches(q, span, status[rows[k]], d1[rows[k]]);
+        }
+    res.resize(n);
+    return res;
+}
+
+QVector<quint32> MidiStore::histogram(const Query& q, Field f) const
+{
+    QVector<quint32> bins(f == Channel ? 16 : 128);
+    const quint32* rows;
+    int first, last;
+    range(q, rows, first, last);
+    if( q.lo > q.hi )
+        return bins;
+    const quint8 span = q.hi - q.lo;
+    const quint8* status = d_status.constData();
+    const quint8* d1 = d_data1.constData();
+    const quint8* values = f == Data1 ? d1 : f == Data2 ? d_data2.constData() : status;
+    const quint8 mask = f == Channel ? 0xf : 0x7f;
+    quint32* out = bins.data();
+    if( rows == 0 )
+        for( int i = first; i < last; i++ )
+            out[values[i] & mask] += matches(q, span, status[i], d1[i]);
+    else
+        for( int k = first; k < last; k++ )
+            out[values[rows[k]] & mask] += matches(q, span, status[rows[k]], d1[rows[k]]);
+    return bins;
+}
@@ -0,0 +1,80 @@
+#ifndef _MIDISTORE_H
+#define _MIDISTORE_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QVector>
+#include <QByteArray>
+
+// Columnar in-memory copy of the channel messages of a recording or MIDI file for analysis:
+// time, track, status and data bytes each in a contiguous array in time order, plus the rows of
+// each track and each channel, so queries are tight loops over a few byte arrays which the
+// compiler vectorizes instead of passes over cells with QByteArray payloads. A note on with
+// velocity 0 is stored as a note off; SysEx, system and meta messages are not stored.
+class MidiStore
+{
+public:
+    enum Type { NoteOff = 1, NoteOn = 2, PolyPressure = 4, ControlChange = 8, ProgramChange = 16,
+                ChannelPressure = 32, PitchBend = 64, Notes = NoteOff | NoteOn, AllTypes = 127, // by status >> 4 - 8
+                Ranged = Notes | PolyPressure | ControlChange }; // the types with a note or controller number
+    enum Field { Data1, Data2, Channel };
+    struct Query
+    {
+        quint8 types;
+        quint16 channels; // bit per channel
+        quint8 lo, hi; // range of data1, i.e. notes or controllers; only applies to Ranged types
+        quint64 from, to; // us, inclusive
+        int track; // -1 for all
+        Query():types(AllTypes),channels(0xffff),lo(0),hi(127),from(0),to(~quint64(0)),track(-1){}
+    };
+
+    bool load(const QString& path); // anything MidiReader reads
+    void clear();
+    int size() const { return d_times.size(); }
+    const quint64* times() const { return d_times.constData(); } // us since the start, see MidiReader::Clock
+    const quint8* tracks() const { return d_tracks.constData(); }
+    const quint8* statuses() const { return d_status.constData(); }
+    const quint8* data1() const { return d_data1.constData(); }
+    const quint8* data2() const { return d_data2.constData(); }
+    QByteArray trackName(quint8 track) const { return d_names.value(track); }
+    // the rows of a track or a channel in time order
+    const quint32* trackRows(quint8 track, int& count) const;
+    const quint32* channelRows(quint8 chan, int& count) const;
+    int lowerBound(quint64 time) const; // the first row at or after time
+
+    int count(const Query& q) const;
+    QVector<quint32> select(const Query& q) const; // rows
+    QVector<quint32> histogram(const Query& q, Field f) const; // 128 bins, 16 for channels
+private:
+    void index(const QVector<quint8>& keys, int keyCount, QVector<quint32>& offsets, QVector<quint32>& rows) const;
+    void range(const Query& q, const quint32*& rows, int& first, int& last) const;
+    QVector<quint64> d_times;
+    QVector<quint8> d_tracks;
+    QVector<quint8> d_status;
+    QVector<quint8> d_data1;
+    QVector<quint8> d_data2;
+    QVector<quint32> d_trackOffsets; // 257, into d_trackRows
+    QVector<quint32> d_trackRows;
+    QVector<quint32> d_channelOffsets; // 17, into d_channelRows
+    QVector<quint32> d_channelRows;
+    QVector<QByteArray> d_names;
+};
+
+#endif // _MIDISTORE_H
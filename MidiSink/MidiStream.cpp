@@ -0,0 +1,556 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiStream.h"
+#include "MidiOutput.h"
+#include "MidiCodec.h"
+#include "MidiReader.h"
+#include <QtDebug>
+#include <QFile>
+#include <QBuffer>
+
+QByteArray MidiStream::toVarLen(quint32 value)
+{
+    quint8 buf[MidiCodec::MaxVarLen];
+    return QByteArray((const char*)buf, MidiCodec::toVarLen(buf,value) - buf);
+}
+
+// MaxSmfDelta followed by an empty text event
+static const char s_smfFiller[] = { char(0xff), char(0xff), char(0xff), 0x7f, char(0xff), 0x01, 0x00 };
+
+quint32 MidiStream::smfDelta(QIODevice* out, quint64 delta)
+{
+    for( ; delta > MaxSmfDelta; delta -= MaxSmfDelta )
+        out->write(s_smfFiller, sizeof(s_smfFiller));
+    return delta;
+}
+
+quint32 MidiStream::smfDelta(QByteArray& out, quint64 delta)
+{
+    for( ; delta > MaxSmfDelta; delta -= MaxSmfDelta )
+        out.append(s_smfFiller, sizeof(s_smfFiller));
+    return delta;
+}
+
+quint32 MidiStream::fromVarLen(QIODevice* in)
+{
+    quint32 value;
+    char ch;
+    if( !in->getChar(&ch) )
+        ch = 0;
+    value = (quint8) ch;
+    if ( value & 0x80 )
+    {
+        value &= 0x7f;
+        quint8 c = 0;
+        do
+        {
+            if( !in->getChar(&ch) )
+                ch = 0;
+            c = ch;
+            value = (value << 7) + ( c & 0x7f);
+        } while (c & 0x80);
+    }
+    return value;
+}
+
+QByteArray MidiStream::timeBaseRecord(quint64 usecs)
+{
+    QByteArray rec;
+    rec += char(TimeBase);
+    rec += toVarLen(8);
+    for( int shift = 56; shift >= 0; shift -= 8 )
+        rec += char(usecs >> shift);
+    return rec;
+}
+
+QByteArray MidiStream::readString( QIODevice* in)
+{
+    QByteArray str;
+    while( !in->atEnd() )
+    {
+        char ch = 0;
+        in->getChar(&ch);
+        if( ch == 0 )
+            break;
+        else
+            str += ch;
+    }
+    return str;
+}
+
+bool MidiStream::readCell( QIODevice* in, Cell& cell, MidiCompactState* states )
+{
+    char ch;
+    quint8 type = 0;
+    if( states )
+    {
+        char buf[MidiCodec::MaxCompactHeader + 1]; // incl. the status byte
+        const qint64 n = in->peek(buf, sizeof(buf));
+        const quint8* p = (const quint8*)buf;
+        if( n <= 0 || !MidiCodec::expandHeader(p, p + n, states, cell.time, cell.track, type) )
+            return false;
+        in->read(buf, p - (const quint8*)buf);
+    }else
+    {
+        cell.time = fromVarLen(in);
+        if( !in->getChar(&ch) )
+            ch = 0;
+        cell.track = (quint8) ch;
+    }
+    if( type == 0 ) // otherwise running status
+    {
+        if( !in->getChar(&ch) )
+            ch = 0;
+        type = (quint8) ch;
+    }
+    if( type == 0xff )
+    {
+        cell.meta = true;
+        if( !in->getChar(&ch) )
+            ch = 0;
+        cell.type = (quint8) ch; // 0x03 track name, 0x00 time filler
+        const quint32 len = fromVarLen(in);
+        cell.data = in->read(len);
+        if( states && cell.type == 0x03 )
+            states[cell.track] = MidiCompactState(); // see MidiCodec::compactCell
+        return true;
+    }else if( type == 0xf0 || type == 0xf7 )
+    {
+        // SysEx chunk; data is the MIDI file event, i.e. status, varlen length and bytes
+        cell.meta = false;
+        const quint32 len = fromVarLen(in);
+        cell.data.resize(1);
+        cell.data[0] = type;
+        cell.data += toVarLen(len);
+        cell.data += in->read(len);
+        return true;
+    }else
+    {
+        cell.meta = false;
+        if( !(type & 0x80) )
+            return false; // don't support running status
+        cell.data.resize(1);
+        cell.data[0] = type;
+        const quint8 status = type >> 4;
+        if( type == 0xf2 )
+            cell.data += in->read(2); // song position
+        else if( type == 0xf1 || type == 0xf3 )
+            cell.data += in->read(1); // time code, song select
+        else if( status == 0xf )
+            ; // other system messages have no data
+        else if( status == 0xc || status == 0xd )
+            cell.data += in->read(1);
+        else
+            cell.data += in->read(2);
+        return true;
+    }
+}
+
+bool MidiStream::readHeader( QIODevice* in, Header& h )
+{
+    const QByteArray tag = readString(in);
+    if( tag != "MidiSink" )
+        return false;
+    char ch;
+    if( !in->getChar(&ch) )
+        return false;
+    if( quint8(ch) >= '0' )
+    {
+        // v1 has no version byte, the timestamp follows immediately
+        in->ungetChar(ch);
+        h = Header();
+        h.timestamp = readString(in);
+        return true;
+    }
+    h.version = ch;
+    if( h.version < PlainVersion || h.version > Version )
+        return false;
+    h.timestamp = readString(in);
+    h.unit = fromVarLen(in);
+    if( h.unit == 0 )
+        return false;
+    while( true )
+    {
+        if( !in->getChar(&ch) )
+            return false;
+        if( ch == 0 )
+            break;
+        const quint32 len = fromVarLen(in);
+        const QByteArray data = in->read(len);
+        if( ch == SegmentSize || ch == Encoding )
+        {
+            QBuffer buf;
+            buf.setData(data);
+            buf.open(QIODevice::ReadOnly);
+            const quint32 value = fromVarLen(&buf);
+            if( ch == SegmentSize )
+                h.segmentMB = value;
+            else if( value > CompactCells )
+                return false;
+            else
+                h.encoding = value;
+        }else if( ch == Session )
+            h.session = data;
+        else if( ch == TimeBase && data.size() == 8 )
+        {
+            h.timeBase = 0;
+            for( int i = 0; i < 8; i++ )
+                h.timeBase = ( h.timeBase << 8 ) | quint8(data[i]);
+        }
+        // else unknown extension
+    }
+    return true;
+}
+
+bool MidiStream::atEnd( MidiSegmentDevice& in, const Header& h )
+{
+    return in.atEnd() || ( h.segmentMB && in.atPadding() );
+}
+
+bool MidiStream::checkHeader( QIODevice& in, Header* h)
+{
+    if( !in.open(QIODevice::ReadOnly) )
+        return false;
+    Header tmp;
+    return readHeader(&in, h ? *h : tmp);
+}
+
+// the end of the last cell, i.e. without the zero padding of an unfinished segment chain; the
+// whole size if the stream is corrupt, so that all of it is compared
+static qint64 logicalSize(const QString& path)
+{
+    MidiReader in;
+    if( !in.open(path) )
+        return -1;
+    MidiReader::Event e;
+    quint64 end = in.pos();
+    while( in.next(e) )
+        end = in.pos();
+    return in.failed() ? in.size() : end;
+}
+
+bool MidiStream::verifyMirror( const QString& a, const QString& b, QString& result )
+{
+    MidiSegmentDevice in1(a);
+    MidiSegmentDevice in2(b);
+    Header h1, h2;
+    if( !checkHeader(in1, &h1) || !checkHeader(in2, &h2) )
+    {
+        result = "not a MidiSink stream";
+        return false;
+    }
+    if( h1.session.isEmpty() || h1.session != h2.session )
+    {
+        result = "not from the same recording";
+        return false;
+    }
+    const qint64 len1 = logicalSize(a);
+    const qint64 len2 = logicalSize(b);
+    if( len1 < 0 || len2 < 0 )
+    {
+        result = "not a MidiSink stream";
+        return false;
+    }
+    in1.seek(0);
+    in2.seek(0);
+    const qint64 len = qMin(len1, len2);
+    const int chunk = 64 * 1024;
+    qint64 pos = 0;
+    while( pos < len )
+    {
+        const QByteArray d1 = in1.read(qMin(qint64(chunk), len - pos));
+        const QByteArray d2 = in2.read(d1.size());
+        if( d1.isEmpty() || d1.size() != d2.size() )
+        {
+            result = "cannot read";
+            return false;
+        }
+        int i = 0;
+        while( i < d1.size() && d1[i] == d2[i] )
+            i++;
+        if( i < d1.size() )
+        {
+            result = QString("differ at byte %1").arg(pos + i);
+            return false;
+        }
+        pos += d1.size();
+    }
+    if( len1 != len2 )
+        result = QString("%1 ends after %2 bytes").arg(len1 < len2 ? a : b).arg(len);
+    else
+        result = "identical";
+    return true;
+}
+
+bool MidiStream::readTakes( const QString& path, Takes& takes )
+{
+    QFile in(path + ".takes");
+    if( !in.open(QIODevice::ReadOnly) )
+        return false;
+    in.readLine(); // column names
+    while( !in.atEnd() )
+    {
+        const QList<QByteArray> fields = in.readLine().trimmed().split('\t');
+        if( fields.size() < 4 )
+            return false;
+        Take t;
+        t.offset = fields[0].toULongLong();
+        t.size = fields[1].toULongLong();
+        t.start = fields[2].toULongLong();
+        t.duration = fields[3].toULongLong();
+        if( fields.size() > 4 )
+        {
+            const QList<QByteArray> ports = fields[4].split(',');
+            for( int i = 0; i < ports.size(); i++ )
+                if( !ports[i].isEmpty() )
+                    t.ports.append(ports[i].toUInt());
+        }
+        takes.append(t);
+    }
+    return true;
+}
+
+bool MidiStream::writeTakes( const QString& path, const Takes& takes )
+{
+    QFile out(path + ".takes");
+    if( !out.open(QIODevice::WriteOnly) )
+        return false;
+    out.write("offset\tsize\tstart\tduration\tports\n");
+    for( int i = 0; i < takes.size(); i++ )
+    {
+        const Take& t = takes[i];
+        QByteArray line = QByteArray::number(t.offset) + '\t' + QByteArray::number(t.size) + '\t' +
+                QByteArray::number(t.start) + '\t' + QByteArray::number(t.duration) + '\t';
+        for( int j = 0; j < t.ports.size(); j++ )
+        {
+            if( j != 0 )
+                line += ',';
+            line += QByteArray::number(t.ports[j]);
+        }
+        line += '\n';
+        out.write(line);
+    }
+    return out.flush();
+}
+
+bool MidiStream::readStream( const QString& path, Tracks& tracks, quint16* division, const Take* take)
+{
+    MidiReader in;
+    if( !in.open(path) )
+        return false;
+    const Header& h = in.header();
+    if( take && !in.seek(take->offset) )
+        return false;
+    const quint64 end = take ? take->offset + take->size : 0;
+    const quint16 div = h.division();
+    if( division )
+        *division = div;
+
+    MidiReader::Event e;
+    quint8 buf[MidiCodec::MaxVarLen];
+    quint32 lastTime = 0;
+    // the name cells of a sync point bring the tracks to the start; a track first named
+    // after them was written with times since the start of the recording
+    const quint64 start = take ? take->start : h.timeBase;
+    bool leading = true;
+    QVector<bool> seen(256);
+    while( ( take == 0 || in.pos() < end ) && in.next(e) )
+    {
+        const bool meta = e.kind == MidiReader::Meta;
+        if( tracks.size() <= e.track )
+        {
+            if( !meta )
+                return false;
+            tracks.resize(e.track + 1);
+        }
+        Track& t = tracks[e.track];
+        if( !meta || e.type != 0x03 )
+            leading = false;
+        if( !seen[e.track] )
+        {
+            seen[e.track] = true;
+            if( !leading )
+                t.base = start;
+        }
+        t.time += e.delta;
+        if( meta && e.type != 0x06 )
+        {
+            if( e.type == 0x03 )
+                t.name = QByteArray((const char*)e.data, e.size);
+            else if( e.type == 0x2f )
+            {
+                // the port was closed; a port which gets the track later counts from the start
+                seen[e.track] = false;
+                t.time = t.base = 0;
+            }
+        }else
+        {
+            const quint64 ticks = h.toTicks(t.time > t.base ? t.time - t.base : 0, div);
+            lastTime = smfDelta(t.data, ticks > t.ticks ? ticks - t.ticks : 0);
+            t.ticks = qMax(ticks, t.ticks);
+            t.data.append((const char*)buf, MidiCodec::toVarLen(buf, lastTime) - buf);
+            if( e.kind == MidiReader::Message )
+            {
+                if( e.msg[0] > 0xf0 && e.msg[0] != 0xf7 )
+                {
+                    // MIDI files have no system common nor real-time events; store them escaped
+                    t.data += char(0xf7);
+                    t.data += char(e.len);
+                }
+                t.data.append((const char*)e.msg, e.len);
+            }else
+            {
+                // markers, e.g. of lost events, and SysEx chunks as in a MIDI file
+                if( meta )
+                    t.data += char(0xff);
+                t.data += char(e.type);
+                t.data.append((const char*)buf, MidiCodec::toVarLen(buf, e.size) - buf);
+                t.data.append((const char*)e.data, e.size);
+            }
+        }
+    }
+    if( in.failed() )
+        return false;
+
+    for( int i = 0; i < tracks.size(); i++ )
+    {
+        if( tracks[i].data.isEmpty() || tracks[i].name.isEmpty() )
+            continue;
+
+        QByteArray start;
+        start += toVarLen(0);
+        start += char(0xff);
+        start += char(0x03);
+        start += toVarLen(tracks[i].name.size());
+        start += tracks[i].name;
+
+        QByteArray end;
+        end += toVarLen(lastTime);
+        end += char(0xff);
+        end += char(0x2f);
+        end += char(0x00);
+
+        tracks[i].data = start + tracks[i].data + end;
+    }
+
+    return true;
+}
+
+void MidiStream::writeChunkHeader(QIODevice* out, const char* tag, quint32 len)
+{
+    out->write(tag, 4);
+    QByteArray bytes(4,char(0));
+    bytes[0] = char((len >> 24) & 0xff);
+    bytes[1] = char((len >> 16) & 0xff);
+    bytes[2] = char((len >> 8)) & 0xff;
+    bytes[3] = char(len & 0xff);
+    out->write(bytes);
+}
+
+void MidiStream::writeFileHeader(QIODevice* out, quint16 numTracks, quint16 division)
+{
+    writeChunkHeader(out, "MThd", 6);
+    QByteArray word(2,char(0));
+    word[1] = 1; // Format 1, one or more simultaneous tracks
+    out->write(word);
+    word[0] = char((numTracks >> 8) & 0xff);
+    word[1] = char(numTracks & 0xff);
+    out->write(word);
+#if 0
+    // millisecond-based tracks by specifying 25 frames/sec and a resolution of 40 units per frame
+    word[0] = char(0xe7); // twos complement of 25
+    word[1] = 0x28; // 40 units
+#else
+    // 120 pbm = 120 quarter notes per minute = 2 quarter notes per second
+    // so 1 quarter note is 500 ms, i.e. 500 ticks for millisecond resolution
+    const short ticks = division;
+    word[0] = char((ticks >> 8)) & 0xff;
+    word[1] = char(ticks & 0xff);
+    // tempo is assumed to be 120 bpm
+    // optionally add FF 58 and FF 51 to each track
+#endif
+    out->write(word);
+}
+
+bool MidiStream::writeStream( const QString& path, const Tracks& tracks, quint16 division)
+{
+    QFile out(path);
+    if( !out.open(QIODevice::WriteOnly) )
+        return false;
+
+    int numTracks = 0;
+    for( int i = 0; i < tracks.size(); i++ )
+    {
+        if( tracks[i].data.isEmpty() || tracks[i].name.isEmpty() )
+            continue;
+        numTracks++;
+    }
+
+    writeFileHeader(&out, numTracks, division);
+
+    for( int i = 0; i < tracks.size(); i++ )
+    {
+        if( tracks[i].data.isEmpty() || tracks[i].name.isEmpty() )
+            continue;
+        writeChunkHeader(&out, "MTrk", tracks[i].data.size()); // 4D 54 72 6B
+        out.write(tracks[i].data);
+    }
+
+    return true;
+}
+
+void MidiStream::gmPrefix(QFile& out, quint32 time, quint8 chan)
+{
+    QByteArray buf(3,0);
+    buf[0] = char( 0xb0 | chan );
+
+    out.write(toVarLen(time));
+    out.write(buf); // b0 0 0
+
+    buf[1] = 0x20;
+    buf[2] = 0;
+    out.write(toVarLen(0));
+    out.write(buf); // b0 20 0
+
+    buf[1] = 0x7;
+    buf[2] = 0x6e;
+    out.write(toVarLen(0));
+    out.write(buf); // b0 7 6e
+
+    buf[1] = 0xa;
+    buf[2] = 0x39;
+    out.write(toVarLen(0));
+    out.write(buf); // b0 a 39
+
+    buf[1] = 0xb;
+    buf[2] = 0x40;
+    out.write(toVarLen(0));
+    out.write(buf); // b0 b 40
+
+    buf[1] = 0x5b;
+    buf[2] = 0x69;
+    out.write(toVarLen(0));
+    out.write(buf); // b0 5b 69
+
+    buf[1] = 0x5d;
+    buf[2] = 0x1e;
+    out.write(toVarLen(0));
+    out.write(buf); // b0 5d 1e
+}
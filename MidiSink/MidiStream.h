@@ -0,0 +1,152 @@
+#ifndef _MIDISTREAM_H
+#define _MIDISTREAM_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QByteArray>
+#include <QVector>
+#include <QList>
+#include <QString>
+
+class QIODevice;
+class QFile;
+class MidiSegmentDevice;
+struct MidiCompactState;
+
+// Reading and writing of the .midisink format and its conversion to MIDI files;
+// shared by the recorder, the monitor and the tools.
+class MidiStream
+{
+public:
+    // .midisink v1: "MidiSink" 0, "yyyyMMdd-hhmmss" 0, cells with millisecond deltas
+    // .midisink v2: "MidiSink" 0, version byte, "yyyyMMdd-hhmmss" 0, varlen microseconds per delta unit,
+    //               extension records (key byte, varlen length, data) terminated by key 0, cells
+    // cell: varlen delta, track byte, then a MIDI message without running status, or
+    //       0xff type varlen length data (meta), or 0xf0/0xf7 varlen length data (SysEx chunk)
+    //       meta 0x2f (End of Track) when a port is closed; a port which gets the track later starts it anew
+    // .midisink v3: like v2, written if the cells use an encoding older readers don't know
+    enum { PlainVersion = 2, CompactVersion = 3, Version = CompactVersion }; // the latest one read
+    enum Extension { SegmentSize = 1, // varlen MB; the stream continues in path.1, path.2 etc.
+                     Encoding = 2, // varlen CellEncoding
+                     TimeBase = 3, // 8 bytes big endian, microseconds since the start of the recording
+                                   // at the start of the stream, e.g. of a pre-roll
+                     Session = 4 // 16 bytes, the same in all mirrors of a recording
+                   };
+    enum CellEncoding { PlainCells = 0, CompactCells = 1 }; // see MidiCodec::compactCell
+
+    static QByteArray toVarLen(quint32 value);
+
+    static quint32 fromVarLen(QIODevice* in);
+
+    // MIDI file deltas have at most four bytes; these write empty text events until the rest
+    // of delta fits and return the rest
+    enum { MaxSmfDelta = 0x0fffffff };
+    static quint32 smfDelta(QIODevice* out, quint64 delta);
+    static quint32 smfDelta(QByteArray& out, quint64 delta);
+
+    static QByteArray timeBaseRecord(quint64 usecs); // TimeBase extension record
+
+    struct Track
+    {
+        QByteArray name;
+        QByteArray data;
+        quint64 time; // in file units
+        quint64 ticks; // in MIDI file ticks
+        quint64 base; // subtracted from time; see readStream
+        Track():time(0),ticks(0),base(0){}
+    };
+    typedef QVector<Track> Tracks;
+
+    static QByteArray readString( QIODevice* in);
+
+    struct Cell
+    {
+        quint32 time;
+        quint8 track;
+        bool meta;
+        quint8 type; // meta type
+        QByteArray data; // SysEx chunks as in a MIDI file, i.e. with status and length
+        Cell():time(0),track(0),meta(false),type(0){}
+    };
+
+    struct Header
+    {
+        quint8 version;
+        quint32 unit; // microseconds per delta unit
+        quint32 segmentMB; // 0 unless written as a segment chain
+        quint8 encoding;
+        quint64 timeBase;
+        QByteArray session;
+        QByteArray timestamp;
+        Header():version(1),unit(1000),segmentMB(0),encoding(PlainCells),timeBase(0){}
+
+        bool compact() const { return encoding == CompactCells; }
+
+        // millisecond streams keep one tick per ms, microsecond streams get 50 us ticks
+        quint16 division() const { return unit >= 1000 ? 500 : 10000; }
+        // the MIDI files assume 120 bpm, i.e. 500000 us per quarter note
+        quint64 toTicks(quint64 time, quint16 division) const { return ( time * unit * division + 250000 ) / 500000; }
+    };
+
+    // A take starts with a name cell of every track, so a stream can be read from its offset;
+    // the track times are relative to the start of the take there. See MidiWriter::setTakeSplit.
+    struct Take
+    {
+        quint64 offset; // in the stream
+        quint64 size; // bytes
+        quint64 start; // microseconds since the start of the recording
+        quint64 duration; // microseconds
+        QList<quint8> ports; // tracks with events in the take
+        Take():offset(0),size(0),start(0),duration(0){}
+    };
+    typedef QList<Take> Takes;
+
+    // the take table is in the sidecar path.takes, one tab separated line per take
+    static bool readTakes( const QString& path, Takes& takes );
+    static bool writeTakes( const QString& path, const Takes& takes );
+
+    // states must point to 256 track states if the stream is compact, otherwise 0
+    static bool readCell( QIODevice* in, Cell& cell, MidiCompactState* states = 0 );
+
+    static bool readHeader( QIODevice* in, Header& h );
+
+    // true at the end of a (possibly unfinished) stream
+    static bool atEnd( MidiSegmentDevice& in, const Header& h );
+
+    static bool checkHeader( QIODevice& in, Header* h = 0 );
+
+    // true if both streams have the same session and one is the other or starts it, i.e. a mirror
+    // which was given up; result tells how they differ
+    static bool verifyMirror( const QString& a, const QString& b, QString& result );
+
+    // reads the whole stream or only the given take; tracks without a name cell at the start of a take
+    // or a stream with a TimeBase count from the start of the recording, e.g. ports plugged in later
+    static bool readStream( const QString& path, Tracks& tracks, quint16* division = 0, const Take* take = 0 );
+
+    static bool writeStream( const QString& path, const Tracks& tracks, quint16 division = 500 );
+
+    // MThd of a Format 1 file
+    static void writeFileHeader( QIODevice* out, quint16 numTracks, quint16 division );
+    static void writeChunkHeader( QIODevice* out, const char* tag, quint32 len );
+
+    static void gmPrefix(QFile& out, quint32 time, quint8 chan);
+};
+
+#endif // _MIDISTREAM_H
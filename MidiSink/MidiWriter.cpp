@@ -0,0 +1,581 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MidiWriter.h"
+#include "MidiCodec.h"
+#include "MidiClock.h"
+#include "MidiOutput.h"
+#include "MidiStats.h"
+#include "MidiFilter.h"
+#include "MidiSmf.h"
+#include <QtDebug>
+
+MidiWriter::MidiWriter(MidiOutput* out, const MidiClock* clock, const MidiFlushPolicy& policy):
+    d_changed(0),d_out(out),d_clock(clock),d_policy(policy),d_smf(0),
+    d_split(NoTakes),d_takeGap(0),d_lastEvent(0),d_quietSince(0),d_held(0),
+    d_dropControllers(false),d_syncInterval(0),d_sinceSync(0),d_unflushed(0),d_lastFlush(0),d_failed(false),d_compact(false),
+    d_written(0),d_flushes(0),d_flushUsecs(0),d_flushMax(0),d_backlog(0),d_stop(0)
+{
+    d_buf.reserve(64 * 1024);
+    d_pending.reserve(4096);
+}
+
+MidiWriter::~MidiWriter()
+{
+    stop();
+    for( int i = 0; i < d_sources.size(); i++ )
+        delete d_sources[i].filter;
+    for( int i = 0; i < d_changes.size(); i++ )
+        delete d_changes[i].source.filter;
+}
+
+void MidiWriter::addSource(MidiSlotRing* ring, quint8 track, const QByteArray& name, MidiPortStats* stats,
+                           const MidiFilter* filter, const QAtomicInt* dropped)
+{
+    Change c;
+    Source& s = c.source;
+    s.ring = ring;
+    s.stats = stats;
+    s.filter = filter && filter->isOn() ? new MidiFilter(*filter) : 0;
+    s.dropped = dropped;
+    s.lost = 0;
+    s.marked = 0;
+    s.carry = 0;
+    s.time = 0;
+    s.track = track;
+    s.name = name;
+    s.hasData = false;
+    s.inTake = false;
+    ::memset(s.notes, 0, sizeof(s.notes));
+    s.done = 0;
+    c.track = track;
+    c.done = 0;
+    QMutexLocker lock(&d_lock);
+    d_changes.append(c);
+    d_changed.storeRelease(1);
+}
+
+void MidiWriter::removeSource(quint8 track, QAtomicInt* done)
+{
+    Change c;
+    c.source.filter = 0;
+    c.track = track;
+    c.done = done;
+    QMutexLocker lock(&d_lock);
+    d_changes.append(c);
+    d_changed.storeRelease(1);
+}
+
+void MidiWriter::applyChanges()
+{
+    QMutexLocker lock(&d_lock);
+    for( int i = 0; i < d_changes.size(); i++ )
+    {
+        const Change& c = d_changes[i];
+        Source* s = 0;
+        for( int j = 0; j < d_sources.size() && s == 0; j++ )
+            if( d_sources[j].track == c.track )
+                s = &d_sources[j];
+        if( c.done )
+        {
+            if( s )
+                s->done = c.done;
+            else
+                c.done->storeRelease(1);
+            continue;
+        }
+        if( d_smf )
+            d_smf->addTrack(c.track, c.source.name);
+        // the engine only gives a track to a port again once it was retired and ended in the file,
+        // so the port starts it anew like any new one, see retire()
+        Q_ASSERT( s == 0 );
+        if( s == 0 )
+            d_sources.append(c.source);
+    }
+    d_changes.clear();
+    d_changed.store(0);
+}
+
+void MidiWriter::retire(int i)
+{
+    // ends the track in the file, so sync points don't need to cover it anymore and a port which
+    // gets the track later starts it from scratch, see MidiReader::Clock
+    Source& s = d_sources[i];
+    for( int j = 0; j < 16 * 128 / 32; j++ )
+        for( quint32 w = s.notes[j]; w; w &= w - 1 )
+            d_held--;
+    delete s.filter;
+    quint8 buf[2 * MidiCodec::MaxVarLen + 3];
+    const int n = MidiCodec::encodeMeta(buf, 0, s.track, 0x2f, 0, 0); // End of Track
+    append((const char*)buf, n);
+    s.done->storeRelease(1);
+    d_sources.removeAt(i);
+}
+
+void MidiWriter::stop()
+{
+    d_stop.storeRelease(1);
+    wait();
+}
+
+void MidiWriter::setSyncInterval(quint32 bytes)
+{
+    d_syncInterval.storeRelease(bytes);
+    if( bytes )
+        d_sinceSync = bytes; // the first cell gets one
+}
+
+int MidiWriter::fetchWritten()
+{
+    return d_written.fetchAndStoreOrdered(0);
+}
+
+MidiWriter::FlushStats MidiWriter::fetchFlushStats()
+{
+    FlushStats s;
+    s.count = d_flushes.fetchAndStoreOrdered(0);
+    const quint32 sum = d_flushUsecs.fetchAndStoreOrdered(0);
+    s.avgUsecs = s.count ? sum / s.count : 0;
+    s.maxUsecs = d_flushMax.fetchAndStoreOrdered(0);
+    return s;
+}
+
+int MidiWriter::fetchBacklog()
+{
+    return d_backlog.fetchAndStoreOrdered(0);
+}
+
+void MidiWriter::run()
+{
+    d_lastFlush = d_clock->elapsed();
+    while( !d_stop.loadAcquire() )
+    {
+        if( drain(false) == 0 )
+            msleep(2);
+        if( d_unflushed == 0 )
+            continue;
+        if( ( d_policy.bytes && d_unflushed >= d_policy.bytes ) ||
+                ( d_policy.msecs && d_clock->elapsed() - d_lastFlush >= d_policy.msecs * 1000ULL ) )
+            flush();
+    }
+    drain(true);
+    flush();
+    if( !d_takes.isEmpty() )
+        d_takes.last().size = d_out->size() - d_takes.last().offset;
+}
+
+void MidiWriter::flush()
+{
+    // group commit: everything written since the last flush goes to the OS (and the disk) at once
+    const quint64 start = d_clock->elapsed();
+    d_out->flush();
+    d_lastFlush = d_clock->elapsed();
+    const int usecs = d_lastFlush - start;
+    d_unflushed = 0;
+    d_flushes.fetchAndAddOrdered(1);
+    d_flushUsecs.fetchAndAddOrdered(usecs);
+    if( usecs > d_flushMax.load() )
+        d_flushMax.fetchAndStoreOrdered(usecs); // only this thread raises it
+}
+
+int MidiWriter::drain(bool all)
+{
+    // each ring is already in capture order, so a k-way merge of the ring fronts yields
+    // the global order; cells younger than HoldBack stay in the ring in case another port
+    // still delivers an older one.
+    const quint64 now = d_clock->elapsed();
+    const quint64 horizon = now > HoldBack ? now - HoldBack : 0;
+    int n = 0;
+    d_buf.resize(0); // keeps the reserved capacity, unlike clear()
+    d_pending.resize(0);
+    if( d_changed.loadAcquire() )
+        applyChanges();
+    quint32 backlog = 0;
+    for( int i = 0; i < d_sources.size(); i++ )
+    {
+        if( d_sources[i].ring == 0 )
+            continue;
+        const quint32 size = d_sources[i].ring->size();
+        if( d_sources[i].stats )
+            d_sources[i].stats->queued(size);
+        backlog += size;
+    }
+    if( int(backlog) > d_backlog.load() )
+        d_backlog.store(backlog);
+    // when the output is short of room the oldest controllers, i.e. those at the ring fronts, go first
+    const qint64 room = d_dropControllers ? d_out->room() : -1;
+    while( true )
+    {
+        Source* next = 0;
+        const MidiSlot* slot = 0;
+        for( int i = 0; i < d_sources.size(); i++ )
+        {
+            const MidiSlot* s = d_sources[i].ring ? d_sources[i].ring->front() : 0;
+            if( s && ( slot == 0 || s->time < slot->time ) )
+            {
+                slot = s;
+                next = &d_sources[i];
+            }
+        }
+        if( slot == 0 || ( !all && slot->time > horizon ) )
+            break;
+        if( next->filter && filtered(*next, slot) )
+        {
+            next->ring->pop(1 + slot->more);
+            continue;
+        }
+        if( room >= 0 && d_buf.size() + slot->len > room && slot->more == 0 )
+        {
+            quint32 delta;
+            quint8 track;
+            const quint8* msg;
+            const int len = MidiCodec::parseCell((const quint8*)slot->data, slot->len, delta, track, msg);
+            if( MidiFilter::key(msg, len) >= 0 )
+            {
+                next->carry += delta;
+                next->lost++;
+                next->ring->pop(1);
+                continue;
+            }
+        }
+        const quint32 syncInterval = d_syncInterval.loadAcquire();
+        if( syncInterval && d_sinceSync + d_buf.size() >= syncInterval )
+            writeSync(slot->time);
+        if( d_split != NoTakes )
+        {
+            quint32 delta;
+            quint8 track;
+            const quint8* msg;
+            const int len = MidiCodec::parseCell((const quint8*)slot->data, slot->len, delta, track, msg);
+            if( startsTake(msg, len, slot->time) )
+                startTake(slot->time);
+            trackTake(*next, msg, len, slot->time);
+        }
+        if( !next->hasData )
+        {
+            writeName(*next);
+            qDebug() << "    " << next->name;
+        }
+        const quint32 lost = next->lost + ( next->dropped ? next->dropped->load() : 0 );
+        if( lost != next->marked )
+        {
+            writeMarker(*next, lost - next->marked);
+            next->marked = lost;
+        }
+        write(*next, slot);
+        for( int i = 1; i <= slot->more; i++ )
+        {
+            const MidiSlot* s = next->ring->front(i);
+            d_buf.append(s->data, s->len);
+        }
+        if( d_smf )
+            toSmf(*next, slot);
+        if( next->stats )
+        {
+            Pending p;
+            p.time = slot->time;
+            p.stats = next->stats;
+            d_pending.append(p);
+        }
+        next->ring->pop(1 + slot->more);
+        n++;
+    }
+    // before writeOut(), which sends the End of Track cells too
+    for( int i = d_sources.size() - 1; i >= 0; i-- )
+        if( d_sources[i].done && d_sources[i].ring->size() == 0 )
+            retire(i);
+    writeOut();
+    return n;
+}
+
+void MidiWriter::writeOut()
+{
+    if( d_buf.isEmpty() )
+        return;
+    const qint64 res = d_out->write(d_buf.constData(), d_buf.size());
+    if( res != d_buf.size() && !d_failed )
+    {
+        qCritical() << "error writing to" << d_out->fileName();
+        d_failed = true;
+    }
+    if( res > 0 )
+    {
+        addWritten(res);
+        d_unflushed += res;
+    }
+    d_sinceSync += d_buf.size();
+    // the cells are now with the OS (or in the mapped segment)
+    const quint64 done = d_clock->elapsed();
+    for( int i = 0; i < d_pending.size(); i++ )
+        d_pending[i].stats->latency.add(done > d_pending[i].time ? done - d_pending[i].time : 0);
+    d_buf.resize(0);
+    d_pending.resize(0);
+}
+
+void MidiWriter::toSmf(Source& s, const MidiSlot* slot)
+{
+    const quint8* cell = (const quint8*)slot->data;
+    int len = slot->len;
+    if( slot->more )
+    {
+        d_cell.resize(0);
+        for( int i = 0; i <= slot->more; i++ )
+        {
+            const MidiSlot* part = s.ring->front(i);
+            d_cell.append(part->data, part->len);
+        }
+        cell = (const quint8*)d_cell.constData();
+        len = d_cell.size();
+    }
+    quint32 delta;
+    quint8 track;
+    const quint8* msg;
+    const int n = MidiCodec::parseCell(cell, len, delta, track, msg);
+    d_smf->add(track, slot->time, msg, n);
+}
+
+void MidiWriter::append(const char* cell, int len)
+{
+    if( !d_compact )
+    {
+        d_buf.append(cell, len);
+        return;
+    }
+    quint8 header[MidiCodec::MaxCompactHeader];
+    int consumed = 0;
+    const int n = MidiCodec::compactCell(header, (const quint8*)cell, len, d_states, consumed);
+    d_buf.append((const char*)header, n);
+    d_buf.append(cell + consumed, len - consumed);
+}
+
+bool MidiWriter::filtered(Source& s, const MidiSlot* slot)
+{
+    if( slot->more )
+        return false;
+    quint32 delta;
+    quint8 track;
+    const quint8* msg;
+    const int len = MidiCodec::parseCell((const quint8*)slot->data, slot->len, delta, track, msg);
+    MidiFilter::Verdict v = s.filter->check(msg, len, slot->time);
+    if( v == MidiFilter::DropIfSuperseded )
+    {
+        // the last event of a burst is always kept; all events up to HoldBack after this
+        // one are in the ring already
+        v = MidiFilter::Keep;
+        const int key = MidiFilter::key(msg, len);
+        const MidiSlot* next;
+        for( quint32 i = 1; ( next = s.ring->front(i) ) != 0 && next->time <= slot->time + HoldBack;
+             i += 1 + next->more )
+        {
+            quint32 d;
+            quint8 t;
+            const quint8* m;
+            const int l = MidiCodec::parseCell((const quint8*)next->data, next->len, d, t, m);
+            if( next->more == 0 && MidiFilter::key(m, l) == key )
+            {
+                v = MidiFilter::Drop;
+                break;
+            }
+        }
+    }
+    if( v == MidiFilter::Drop )
+    {
+        s.carry += delta;
+        if( s.stats )
+            s.stats->filtered();
+        return true;
+    }
+    s.filter->kept(msg, len, slot->time);
+    return false;
+}
+
+void MidiWriter::write(Source& s, const MidiSlot* slot)
+{
+    quint32 delta;
+    quint8 track;
+    const quint8* msg;
+    const int len = MidiCodec::parseCell((const quint8*)slot->data, slot->len, delta, track, msg);
+    if( s.carry == 0 )
+    {
+        s.time += delta;
+        append(slot->data, slot->len);
+        return;
+    }
+    // move the deltas of the dropped cells to this one, or subtract what the take start
+    // already advanced the track; a late cell of another port may be older than the take start
+    qint64 sum = qMax(qint64(0), qint64(delta) + s.carry);
+    s.carry = 0;
+    s.time += sum;
+    quint8 buf[2 * MidiCodec::MaxVarLen + 3 + sizeof(slot->data)];
+    while( sum > MidiCodec::MaxDelta )
+    {
+        const int n = MidiCodec::encodeMeta(buf, MidiCodec::MaxDelta, track, 0x00, 0, 0); // time filler
+        append((const char*)buf, n);
+        sum -= MidiCodec::MaxDelta;
+    }
+    quint8* p = MidiCodec::toVarLen(buf, sum);
+    *p++ = track;
+    ::memcpy(p, msg, len);
+    append((const char*)buf, ( p - buf ) + len);
+}
+
+void MidiWriter::writeName(Source& s)
+{
+    const int len = s.name.size();
+    QByteArray cell(2 * MidiCodec::MaxVarLen + 3 + len, 0);
+    const int n = MidiCodec::encodeMeta((quint8*)cell.data(), 0, s.track,
+                                        0x03, // Sequence/Track Name
+                                        (const quint8*)s.name.constData(), len);
+    append(cell.constData(), n);
+    s.hasData = true;
+}
+
+void MidiWriter::writeMarker(Source& s, quint32 lost)
+{
+    // documents the gap in the file, at the time of the last cell written before
+    const QByteArray text = "MidiSink: " + QByteArray::number(lost) + " events lost";
+    QByteArray cell(2 * MidiCodec::MaxVarLen + 3 + text.size(), 0);
+    const int n = MidiCodec::encodeMeta((quint8*)cell.data(), 0, s.track, 0x06, // Marker
+                                        (const quint8*)text.constData(), text.size());
+    append(cell.constData(), n);
+    qWarning() << text.constData() << "of" << s.name;
+    if( d_smf )
+    {
+        quint32 delta;
+        quint8 track;
+        const quint8* msg;
+        const int len = MidiCodec::parseCell((const quint8*)cell.constData(), n, delta, track, msg);
+        d_smf->add(s.track, s.time, msg, len);
+    }
+}
+
+void MidiWriter::writeFiller(Source& s, quint64 time)
+{
+    // advance the track in the file to the given time; the next delta from the ring is shortened by as much
+    if( time <= s.time )
+        return;
+    const quint64 diff = time - s.time;
+    quint8 buf[2 * MidiCodec::MaxVarLen + 3];
+    for( quint64 left = diff; left > 0; )
+    {
+        const quint32 d = qMin(left, quint64(MidiCodec::MaxDelta));
+        const int n = MidiCodec::encodeMeta(buf, d, s.track, 0x00, 0, 0); // time filler
+        append((const char*)buf, n);
+        left -= d;
+    }
+    s.time = time;
+    s.carry -= diff;
+}
+
+static inline bool isNoteOn(const quint8* msg, int len)
+{
+    return len >= 3 && ( msg[0] & 0xf0 ) == 0x90 && msg[2] != 0;
+}
+
+bool MidiWriter::startsTake(const quint8* msg, int len, quint64 time) const
+{
+    if( len <= 0 || msg[0] >= 0xf8 )
+        return false; // real-time messages and meta cells don't start a take
+    if( d_takes.isEmpty() )
+        return true;
+    // late cells may carry a time before the last event; they never open a gap
+    if( d_split == SilenceTakes )
+        return time > d_lastEvent && time - d_lastEvent >= d_takeGap;
+    else
+        return d_held == 0 && isNoteOn(msg, len) && time > d_quietSince && time - d_quietSince >= d_takeGap;
+}
+
+quint64 MidiWriter::writeSync(quint64 time)
+{
+    // bring all tracks to the given time and name them again, so that a reader can start
+    // at the returned offset with all track times 0
+    for( int i = 0; i < d_sources.size(); i++ )
+        writeFiller(d_sources[i], time);
+    quint64 offset;
+    if( d_syncInterval.loadAcquire() )
+    {
+        writeOut();
+        d_sinceSync = 0;
+        d_out->syncPoint(time);
+        offset = d_out->size();
+    }else
+        offset = d_out->size() + d_buf.size();
+    for( int i = 0; i < d_sources.size(); i++ )
+        writeName(d_sources[i]);
+    return offset;
+}
+
+void MidiWriter::startTake(quint64 time)
+{
+    const quint64 offset = writeSync(time);
+    if( !d_takes.isEmpty() )
+        d_takes.last().size = offset - d_takes.last().offset;
+    for( int i = 0; i < d_sources.size(); i++ )
+        d_sources[i].inTake = false;
+    MidiStream::Take t;
+    t.offset = offset;
+    t.start = time;
+    d_takes.append(t);
+    qDebug() << "take" << d_takes.size() << "at" << time / 1000000 << "s";
+}
+
+void MidiWriter::trackTake(Source& s, const quint8* msg, int len, quint64 time)
+{
+    if( len <= 0 || msg[0] >= 0xf8 || d_takes.isEmpty() )
+        return;
+    d_lastEvent = time;
+    MidiStream::Take& t = d_takes.last();
+    t.duration = time - t.start;
+    if( !s.inTake )
+    {
+        t.ports.append(s.track);
+        s.inTake = true;
+    }
+    if( len < 3 )
+        return;
+    const quint8 status = msg[0] & 0xf0;
+    const int chan = msg[0] & 0x0f;
+    const int held = d_held;
+    if( status == 0x90 || status == 0x80 )
+    {
+        const int note = chan * 128 + msg[1];
+        const quint32 bit = 1u << ( note & 31 );
+        if( isNoteOn(msg, len) )
+        {
+            if( !( s.notes[note >> 5] & bit ) )
+                d_held++;
+            s.notes[note >> 5] |= bit;
+        }else if( s.notes[note >> 5] & bit )
+        {
+            s.notes[note >> 5] &= ~bit;
+            d_held--;
+        }
+    }else if( status == 0xb0 && ( msg[1] == 120 || msg[1] == 123 ) )
+    {
+        // all sound off, all notes off
+        for( int i = chan * 4; i < chan * 4 + 4; i++ )
+        {
+            for( quint32 w = s.notes[i]; w; w &= w - 1 )
+                d_held--;
+            s.notes[i] = 0;
+        }
+    }
+    if( held > 0 && d_held == 0 )
+        d_quietSince = time;
+}
@@ -0,0 +1,183 @@
+#ifndef _MIDIWRITER_H
+#define _MIDIWRITER_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MusicTools application suite.
+*
+* The following is the license that applies to this copy of the
+* file. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QThread>
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+#include <QMutex>
+#include "MidiRing.h"
+#include "MidiCodec.h"
+#include "MidiStream.h"
+
+class MidiOutput;
+class MidiClock;
+class MidiPortStats;
+class MidiFilter;
+class MidiSmfWriter;
+
+// One encoded cell as pushed by a port callback; time is the capture time used to
+// merge the ports, data holds the cell bytes exactly as they go to the file.
+// Longer cells (SysEx chunks) continue in the next 'more' slots, which are committed together.
+struct MidiSlot
+{
+    quint64 time; // microseconds, see MidiClock
+    quint8 len;
+    quint8 more;
+    char data[14]; // at least MidiCodec::MaxVarLen + track + three MIDI bytes
+};
+
+typedef MidiRing<MidiSlot> MidiSlotRing;
+
+// When the writer hands its buffered data to the OS; how durable that is depends on
+// the MidiOutput. A flush happens when either threshold is reached; 0 disables a threshold.
+struct MidiFlushPolicy
+{
+    quint32 bytes;
+    quint32 msecs;
+    MidiFlushPolicy():bytes(0),msecs(1000){}
+};
+
+// Drains the rings of all ports in timestamp order into the sink output.
+// The callback threads never touch the file; only this thread does.
+class MidiWriter : public QThread
+{
+public:
+    enum { HoldBack = 10000 }; // us to wait for late cells of other ports before a cell is written
+    // SilenceTakes: a take starts after a gap without events; NoteTakes: a take starts with the
+    // first note on after all notes of all ports were off for the gap
+    enum TakeSplit { NoTakes, SilenceTakes, NoteTakes };
+
+    struct FlushStats
+    {
+        quint32 count;
+        quint32 avgUsecs;
+        quint32 maxUsecs;
+    };
+
+    MidiWriter(MidiOutput* out, const MidiClock* clock, const MidiFlushPolicy& = MidiFlushPolicy());
+    ~MidiWriter();
+
+    // stats may be 0, the filter is copied if on; dropped counts the cells the port couldn't push,
+    // the writer writes a marker cell when it grows. May be called while running, the source joins
+    // with the next drain; the track of a removed source ends in the file.
+    void addSource(MidiSlotRing* ring, quint8 track, const QByteArray& name, MidiPortStats* stats = 0,
+                   const MidiFilter* filter = 0, const QAtomicInt* dropped = 0);
+    // the writer writes what is left in the ring, then forgets the ring and sets done to 1;
+    // ring, stats and dropped must live until then or until stop()
+    void removeSource(quint8 track, QAtomicInt* done);
+    void setCompact(bool on) { d_compact = on; } // call before start(); see MidiCodec::compactCell
+    void setSmf(MidiSmfWriter* smf) { d_smf = smf; } // call before start(); gets every written cell too
+    void setTakeSplit(TakeSplit split, quint32 gapMsecs) { d_split = split; d_takeGap = gapMsecs * 1000ULL; } // call before start()
+    const MidiStream::Takes& getTakes() const { return d_takes; } // call after stop()
+    // drop controller, pressure and pitch bend cells instead of waiting while MidiOutput::room() is short
+    void setDropControllers(bool on) { d_dropControllers = on; } // call before start()
+    // writes a sync point (see writeSync) and calls MidiOutput::syncPoint() before the first cell
+    // and then whenever about the given number of bytes were written; call before start(),
+    // 0 (no more sync points) may be set while running
+    void setSyncInterval(quint32 bytes);
+    void stop(); // drains all rings and waits for the thread
+    int fetchWritten(); // bytes written since the last call
+    void addWritten(int bytes) { d_written.fetchAndAddOrdered(bytes); }
+    FlushStats fetchFlushStats(); // flushes since the last call
+    int fetchBacklog(); // max cells waiting in all rings since the last call
+protected:
+    void run();
+    int drain(bool all);
+    void flush();
+    void append(const char* cell, int len);
+    void writeOut();
+private:
+    struct Source
+    {
+        MidiSlotRing* ring;
+        MidiPortStats* stats;
+        MidiFilter* filter;
+        const QAtomicInt* dropped;
+        quint32 lost; // cells dropped by the writer
+        quint32 marked; // lost and dropped cells up to the last marker
+        QByteArray name;
+        quint8 track;
+        bool hasData;
+        bool inTake; // has events in the current take
+        quint64 time; // of the track in the file, i.e. the sum of the written deltas
+        qint64 carry; // to be added to the next delta: dropped cells, take starts
+        quint32 notes[16 * 128 / 32]; // on
+        QAtomicInt* done; // set when the ring is drained after removeSource()
+    };
+    QList<Source> d_sources; // removed ones until their ring is drained
+    struct Change
+    {
+        Source source; // to add if done is 0
+        quint8 track;
+        QAtomicInt* done;
+    };
+    QMutex d_lock;
+    QList<Change> d_changes;
+    QAtomicInt d_changed;
+    void applyChanges();
+    void retire(int i);
+    bool filtered(Source& s, const MidiSlot* slot);
+    void write(Source& s, const MidiSlot* slot);
+    void toSmf(Source& s, const MidiSlot* slot);
+    void writeName(Source& s);
+    void writeMarker(Source& s, quint32 lost);
+    void writeFiller(Source& s, quint64 time);
+    bool startsTake(const quint8* msg, int len, quint64 time) const;
+    quint64 writeSync(quint64 time);
+    void startTake(quint64 time);
+    void trackTake(Source& s, const quint8* msg, int len, quint64 time);
+    struct Pending
+    {
+        quint64 time;
+        MidiPortStats* stats;
+    };
+    QVector<Pending> d_pending; // cells in d_buf
+    MidiOutput* d_out;
+    const MidiClock* d_clock;
+    MidiFlushPolicy d_policy;
+    QByteArray d_buf;
+    QByteArray d_cell; // a cell spread over several slots
+    MidiSmfWriter* d_smf;
+    MidiStream::Takes d_takes;
+    TakeSplit d_split;
+    quint64 d_takeGap;
+    quint64 d_lastEvent; // time of the last cell other than real-time messages
+    quint64 d_quietSince; // all notes off since
+    int d_held; // notes on in all sources
+    bool d_dropControllers;
+    QAtomicInt d_syncInterval;
+    quint32 d_sinceSync; // bytes
+    quint32 d_unflushed;
+    quint64 d_lastFlush;
+    bool d_failed;
+    bool d_compact;
+    MidiCompactState d_states[256];
+    QAtomicInt d_written;
+    QAtomicInt d_flushes;
+    QAtomicInt d_flushUsecs;
+    QAtomicInt d_flushMax;
+    QAtomicInt d_backlog;
+    QAtomicInt d_stop;
+};
+
+#endif // _MIDIWRITER_H
@@ -23,9 +23,13 @@
 #include <QtDebug>
 #include <QCoreApplication>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include <QSettings>
+#include <QStringList>
 
-VirtualPiano::VirtualPiano(QObject *parent) : QObject(parent)
+VirtualPiano::VirtualPiano(int priority, int cpu, QObject *parent) : QObject(parent)
 {
     d_settings = new_fluid_settings();
     fluid_settings_setstr(d_settings, "audio.driver", "pulseaudio");
@@ -62,6 +66,7 @@ VirtualPiano::VirtualPiano(QObject *parent) : QObject(parent)
         qDebug() << "*** open" << name << "midi input port";
         RtMidiIn* port = new RtMidiIn();
         port->ignoreTypes(true,true,true);
+        port->setThreadConfig(priority, cpu);
         port->setCallback(midiIn,this);
         port->openPort(i, name.constData());
         ports.append(port);
@@ -69,6 +74,7 @@ VirtualPiano::VirtualPiano(QObject *parent) : QObject(parent)
 
     RtMidiIn* port = new RtMidiIn();
     port->ignoreTypes(true,true,true);
+    port->setThreadConfig(priority, cpu);
     port->setCallback(midiIn,this);
     port->openVirtualPort("VirtualPiano");
     ports.append(port);
@@ -122,10 +128,32 @@ int main(int argc, char *argv[])
 {
     QCoreApplication a(argc, argv);
 
-    VirtualPiano p;
+    // VirtualPiano [-rt priority] [-cpu n] [-mlock] [soundfont]; the defaults come from the settings
+    QSettings set;
+    int priority = set.value("CapturePriority", 0).toInt();
+    int cpu = set.value("CaptureCpu", -1).toInt();
+    bool lock = set.value("LockMemory", false).toBool();
+    QString sound;
+    const QStringList args = a.arguments();
+    for( int i = 1; i < args.size(); i++ )
+    {
+        if( args[i] == "-rt" && i + 1 < args.size() )
+            priority = args[++i].toInt();
+        else if( args[i] == "-cpu" && i + 1 < args.size() )
+            cpu = args[++i].toInt();
+        else if( args[i] == "-mlock" )
+            lock = true;
+        else
+            sound = args[i];
+    }
+
+    VirtualPiano p(priority, cpu);
+
+    if( !sound.isEmpty() )
+        p.loadSound(sound);
 
-    if( a.arguments().size() > 1 )
-        p.loadSound(a.arguments()[1]);
+    if( lock && ::mlockall(MCL_CURRENT | MCL_FUTURE) != 0 )
+        qWarning() << "cannot lock memory, continuing without:" << strerror(errno);
 
     qDebug() << "listening, press enter to quit";
     getchar();
@@ -31,7 +31,8 @@ class RtMidiIn;
 class VirtualPiano : public QObject
 {
 public:
-    explicit VirtualPiano(QObject *parent = 0);
+    // priority and cpu of the MIDI in threads, see RtMidiIn::setThreadConfig()
+    explicit VirtualPiano(int priority = 0, int cpu = -1, QObject *parent = 0);
     ~VirtualPiano();
 
     void loadSound(const QString& path);
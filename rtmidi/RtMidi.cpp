@@ -190,6 +190,7 @@ class MidiInAlsa: public MidiInApi
 
  protected:
   void initialize( const std::string& clientName );
+  int startThread( void );
 };
 
 class MidiOutAlsa: public MidiOutApi
@@ -1614,6 +1615,8 @@ void MidiOutCore :: sendMessage( const unsigned char *message, size_t size )
 
 #include <pthread.h>
 #include <sys/time.h>
+#include <string.h>
+#include <time.h>
 
 // ALSA header file.
 #include <alsa/asoundlib.h>
@@ -1633,11 +1636,34 @@ struct AlsaMidiData {
   pthread_t dummy_thread_id;
   snd_seq_real_time_t lastTime;
   int queue_id; // an input queue is needed to get timestamped events
+  long long queueBase; // CLOCK_MONOTONIC microseconds at queue real time zero
   int trigger_fds[2];
 };
 
 #define PORT_TYPE( pinfo, bits ) ((snd_seq_port_info_get_capability(pinfo) & (bits)) == (bits))
 
+#ifndef AVOID_TIMESTAMPING
+// Start the input queue and relate its real time to the monotonic clock,
+// so that event time stamps of different clients can be compared.
+static void startAlsaQueue( AlsaMidiData *data )
+{
+  snd_seq_start_queue( data->seq, data->queue_id, NULL );
+  snd_seq_drain_output( data->seq );
+
+  snd_seq_queue_status_t *status;
+  snd_seq_queue_status_alloca( &status );
+  struct timespec now;
+  if ( snd_seq_get_queue_status( data->seq, data->queue_id, status ) < 0 ||
+       clock_gettime( CLOCK_MONOTONIC, &now ) != 0 ) {
+    data->queueBase = -1; // no host time available
+    return;
+  }
+  const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time( status );
+  data->queueBase = ( (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000 ) -
+      ( (long long)rt->tv_sec * 1000000 + rt->tv_nsec / 1000 );
+}
+#endif
+
 //*********************************************************************//
 //  API: LINUX ALSA
 //  Class Definitions: MidiInAlsa
@@ -1709,7 +1735,7 @@ static void *alsaMidiHandler( void *ptr )
 
     // This is a bit weird, but we now have to decode an ALSA MIDI
     // event (back) into MIDI bytes.  We'll ignore non-MIDI types.
-    if ( !continueSysex ) message.bytes.clear();
+    if ( !continueSysex || data->sysexChunks ) message.bytes.clear();
 
     doDecode = false;
     switch ( ev->type ) {
@@ -1775,13 +1801,14 @@ static void *alsaMidiHandler( void *ptr )
         // than this, they are segmented into 256 byte chunks.  So,
         // we'll watch for this and concatenate sysex chunks into a
         // single sysex message if necessary.
-        if ( !continueSysex )
+        // With sysexChunks each chunk is delivered as it comes.
+        if ( !continueSysex || data->sysexChunks )
           message.bytes.assign( buffer, &buffer[nBytes] );
         else
           message.bytes.insert( message.bytes.end(), buffer, &buffer[nBytes] );
 
         continueSysex = ( ( ev->type == SND_SEQ_EVENT_SYSEX ) && ( message.bytes.back() != 0xF7 ) );
-        if ( !continueSysex ) {
+        if ( !continueSysex || data->sysexChunks ) {
 
           // Calculate the time stamp:
           message.timeStamp = 0.0;
@@ -1818,6 +1845,10 @@ static void *alsaMidiHandler( void *ptr )
           time = (int)x.tv_sec - y.tv_sec + ((int)x.tv_nsec - y.tv_nsec)*1e-9;
 
           apiData->lastTime = ev->time.time;
+#ifndef AVOID_TIMESTAMPING
+          if ( apiData->queueBase >= 0 )
+            data->hostTime = apiData->queueBase + (long long)x.tv_sec * 1000000 + x.tv_nsec / 1000;
+#endif
 
           if ( data->firstMessage == true )
             data->firstMessage = false;
@@ -1833,7 +1864,7 @@ static void *alsaMidiHandler( void *ptr )
     }
 
     snd_seq_free_event( ev );
-    if ( message.bytes.size() == 0 || continueSysex ) continue;
+    if ( message.bytes.size() == 0 || ( continueSysex && !data->sysexChunks ) ) continue;
 
     if ( data->usingCallback ) {
       RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
@@ -1909,6 +1940,7 @@ void MidiInAlsa :: initialize( const std::string& clientName )
   data->thread = data->dummy_thread_id;
   data->trigger_fds[0] = -1;
   data->trigger_fds[1] = -1;
+  data->queueBase = -1;
   data->bufferSize = inputData_.bufferSize;
   apiData_ = (void *) data;
   inputData_.apiData = (void *) data;
@@ -2086,18 +2118,11 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string &portNam
   if ( inputData_.doInput == false ) {
     // Start the input queue
 #ifndef AVOID_TIMESTAMPING
-    snd_seq_start_queue( data->seq, data->queue_id, NULL );
-    snd_seq_drain_output( data->seq );
+    startAlsaQueue( data );
 #endif
     // Start our MIDI input thread.
-    pthread_attr_t attr;
-    pthread_attr_init( &attr );
-    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE );
-    pthread_attr_setschedpolicy( &attr, SCHED_OTHER );
-
     inputData_.doInput = true;
-    int err = pthread_create( &data->thread, &attr, alsaMidiHandler, &inputData_ );
-    pthread_attr_destroy( &attr );
+    int err = startThread();
     if ( err ) {
       snd_seq_unsubscribe_port( data->seq, data->subscription );
       snd_seq_port_subscribe_free( data->subscription );
@@ -2112,6 +2137,44 @@ void MidiInAlsa :: openPort( unsigned int portNumber, const std::string &portNam
   connected_ = true;
 }
 
+int MidiInAlsa :: startThread( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  const bool configured = inputData_.threadPriority > 0 || inputData_.threadCpu >= 0;
+  for ( int attempt = 0; attempt < 2; attempt++ ) {
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE );
+    pthread_attr_setschedpolicy( &attr, SCHED_OTHER );
+    if ( attempt == 0 && inputData_.threadPriority > 0 ) {
+      struct sched_param param;
+      param.sched_priority = inputData_.threadPriority;
+      pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED );
+      pthread_attr_setschedpolicy( &attr, SCHED_FIFO );
+      pthread_attr_setschedparam( &attr, &param );
+    }
+#ifdef __linux__
+    if ( attempt == 0 && inputData_.threadCpu >= 0 ) {
+      cpu_set_t cpus;
+      CPU_ZERO( &cpus );
+      CPU_SET( inputData_.threadCpu, &cpus );
+      pthread_attr_setaffinity_np( &attr, sizeof(cpus), &cpus );
+    }
+#endif
+    int err = pthread_create( &data->thread, &attr, alsaMidiHandler, &inputData_ );
+    pthread_attr_destroy( &attr );
+    if ( err == 0 || !configured || attempt > 0 )
+      return err;
+    // Typically EPERM without CAP_SYS_NICE or a RLIMIT_RTPRIO, or EINVAL for an unknown CPU.
+    std::ostringstream ost;
+    ost << "MidiInAlsa::startThread: cannot apply the thread configuration (" << strerror( err )
+        << "), using default scheduling.";
+    errorString_ = ost.str();
+    error( RtMidiError::WARNING, errorString_ );
+  }
+  return -1;
+}
+
 void MidiInAlsa :: openVirtualPort( const std::string &portName )
 {
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
@@ -2148,18 +2211,11 @@ void MidiInAlsa :: openVirtualPort( const std::string &portName )
 
     // Start the input queue
 #ifndef AVOID_TIMESTAMPING
-    snd_seq_start_queue( data->seq, data->queue_id, NULL );
-    snd_seq_drain_output( data->seq );
+    startAlsaQueue( data );
 #endif
     // Start our MIDI input thread.
-    pthread_attr_t attr;
-    pthread_attr_init( &attr );
-    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE );
-    pthread_attr_setschedpolicy( &attr, SCHED_OTHER );
-
     inputData_.doInput = true;
-    int err = pthread_create( &data->thread, &attr, alsaMidiHandler, &inputData_ );
-    pthread_attr_destroy( &attr );
+    int err = startThread();
     if ( err ) {
       if ( data->subscription ) {
         snd_seq_unsubscribe_port( data->seq, data->subscription );
@@ -373,6 +373,32 @@ class RTMIDI_DLL_PUBLIC RtMidiIn : public RtMidi
   */
   double getMessage( std::vector<unsigned char> *message );
 
+  //! Return the driver time stamp of the message currently delivered to the callback function.
+  /*!
+    Only valid when called from within the callback function. The value is the
+    absolute time in microseconds on the CLOCK_MONOTONIC time base, derived from
+    the ALSA sequencer real-time stamp of the event, so it is comparable between
+    ports. APIs without support return 0.
+  */
+  unsigned long long getMessageHostTime() const;
+
+  //! Deliver large sysex messages in the chunks the driver provides instead of concatenating them.
+  /*!
+    The first chunk starts with 0xF0, the last one ends with 0xF7; chunks in between
+    consist of data bytes only. Only supported by the ALSA API; the others always
+    deliver complete messages. Should be called before openPort().
+  */
+  void setSysexChunks( bool chunks = true );
+
+  //! Configure the scheduling of the input thread.
+  /*!
+    A priority from 1 to 99 runs the thread with SCHED_FIFO, 0 keeps the default
+    scheduling; a cpu of 0 or more pins the thread to that CPU. If the process lacks
+    the privileges the thread runs with default scheduling and a warning is issued.
+    Only supported by the ALSA API. Must be called before openPort().
+  */
+  void setThreadConfig( int priority, int cpu = -1 );
+
   //! Set an error callback function to be invoked when an error has occured.
   /*!
     The callback function will be called whenever an error has occured. It is best
@@ -560,6 +586,9 @@ class RTMIDI_DLL_PUBLIC MidiInApi : public MidiApi
   void cancelCallback( void );
   virtual void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
   double getMessage( std::vector<unsigned char> *message );
+  unsigned long long getMessageHostTime() const { return inputData_.hostTime; }
+  void setSysexChunks( bool chunks ) { inputData_.sysexChunks = chunks; }
+  void setThreadConfig( int priority, int cpu ) { inputData_.threadPriority = priority; inputData_.threadCpu = cpu; }
   virtual void setBufferSize( unsigned int size, unsigned int count );
 
   // A MIDI structure used internally by the class to store incoming
@@ -604,11 +633,16 @@ class RTMIDI_DLL_PUBLIC MidiInApi : public MidiApi
     bool continueSysex;
     unsigned int bufferSize;
     unsigned int bufferCount;
+    unsigned long long hostTime; // microseconds, see RtMidiIn::getMessageHostTime()
+    bool sysexChunks; // see RtMidiIn::setSysexChunks()
+    int threadPriority; // see RtMidiIn::setThreadConfig()
+    int threadCpu;
 
     // Default constructor.
     RtMidiInData()
       : ignoreFlags(7), doInput(false), firstMessage(true), apiData(0), usingCallback(false),
-        userCallback(0), userData(0), continueSysex(false), bufferSize(1024), bufferCount(4) {}
+        userCallback(0), userData(0), continueSysex(false), bufferSize(1024), bufferCount(4), hostTime(0),
+        sysexChunks(false), threadPriority(0), threadCpu(-1) {}
   };
 
  protected:
@@ -641,6 +675,9 @@ inline unsigned int RtMidiIn :: getPortCount( void ) { return rtapi_->getPortCou
 inline std::string RtMidiIn :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiIn :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense ) { static_cast<MidiInApi *>(rtapi_)->ignoreTypes( midiSysex, midiTime, midiSense ); }
 inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message ) { return static_cast<MidiInApi *>(rtapi_)->getMessage( message ); }
+inline unsigned long long RtMidiIn :: getMessageHostTime() const { return static_cast<MidiInApi *>(rtapi_)->getMessageHostTime(); }
+inline void RtMidiIn :: setSysexChunks( bool chunks ) { static_cast<MidiInApi *>(rtapi_)->setSysexChunks( chunks ); }
+inline void RtMidiIn :: setThreadConfig( int priority, int cpu ) { static_cast<MidiInApi *>(rtapi_)->setThreadConfig( priority, cpu ); }
 inline void RtMidiIn :: setErrorCallback( RtMidiErrorCallback errorCallback, void *userData ) { rtapi_->setErrorCallback(errorCallback, userData); }
 inline void RtMidiIn :: setBufferSize( unsigned int size, unsigned int count ) { static_cast<MidiInApi *>(rtapi_)->setBufferSize(size, count); }
 